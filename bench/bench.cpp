@@ -0,0 +1,516 @@
+/**
+allocation benchmark suite: mm against the system malloc.
+
+every pattern runs twice per allocator, once untimed per operation for the
+throughput and once timing every operation for the latency percentiles. each
+allocator runs in a forked child, so the peak RSS reported is its own. the
+dTLB load misses of the throughput run are counted with perf_event where the
+kernel allows it; "mm-huge" is mm with its slabs in huge page regions.
+usage: bench [ops] [pattern]
+configure with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+*/
+#include "mm.h"
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ALIGNMENT 16
+// live objects of the churn patterns
+#define WINDOW 1024
+// objects handed from the producer to the consumer at once
+#define QUEUE_SIZE 4096
+// small objects walked by the scan pattern: far more pages than TLB entries
+#define SCAN_OBJECTS (1 << 20)
+
+struct allocator {
+  const char *name;
+  // run in the child before the first allocation, may be NULL
+  void (*setup)();
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+  void *(*realloc)(void *ptr, size_t size);
+};
+
+static void *mm_malloc_fn(size_t size) { return mm_malloc(size, ALIGNMENT); }
+static void mm_free_fn(void *ptr) { mm_free(ptr); }
+static void *mm_realloc_fn(void *ptr, size_t size) {
+  return mm_realloc(ptr, size, ALIGNMENT);
+}
+
+static void mm_huge_setup() { mm_set_hugepages(true); }
+
+static const struct allocator allocators[] = {
+    {"mm", NULL, mm_malloc_fn, mm_free_fn, mm_realloc_fn},
+    {"mm-huge", mm_huge_setup, mm_malloc_fn, mm_free_fn, mm_realloc_fn},
+    {"system", NULL, malloc, free, realloc},
+};
+
+static inline unsigned long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+latency histogram: 16 linear buckets per power of two of nanoseconds, so a
+percentile is off by less than 1/16.
+*/
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct histogram {
+  unsigned long long count;
+  unsigned long long buckets[HIST_BUCKETS];
+};
+
+static inline int hist_bucket(unsigned long long ns) {
+  if (ns < HIST_SUB) {
+    return (int)ns;
+  }
+  int power = 63 - __builtin_clzll(ns);
+  int sub = (int)((ns >> (power - 4)) & (HIST_SUB - 1));
+  return (power - 3) * HIST_SUB + sub;
+}
+
+static unsigned long long hist_value(int bucket) {
+  if (bucket < HIST_SUB) {
+    return bucket;
+  }
+  int power = bucket / HIST_SUB + 3;
+  unsigned long long sub = bucket % HIST_SUB;
+  return (1ULL << power) + (sub << (power - 4));
+}
+
+static inline void hist_add(struct histogram *h, unsigned long long ns) {
+  h->buckets[hist_bucket(ns)]++;
+  h->count++;
+}
+
+static void hist_merge(struct histogram *to, const struct histogram *from) {
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    to->buckets[i] += from->buckets[i];
+  }
+  to->count += from->count;
+}
+
+static unsigned long long hist_percentile(const struct histogram *h,
+                                          double pct) {
+  unsigned long long rank = (unsigned long long)(h->count * pct / 100.0);
+  unsigned long long seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > rank) {
+      return hist_value(i);
+    }
+  }
+  return 0;
+}
+
+// xorshift, so that both allocators see the same sizes
+static inline unsigned long long next_random(unsigned long long *state) {
+  unsigned long long x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+// mostly small sizes, a few large ones, like a typical service
+static inline size_t random_size(unsigned long long *state) {
+  unsigned long long r = next_random(state);
+  if (r % 100 < 90) {
+    return 8 + (r >> 8) % 248;
+  }
+  if (r % 100 < 99) {
+    return 256 + (r >> 8) % 3840;
+  }
+  return 4096 + (r >> 8) % 60000;
+}
+
+/**
+one run of a pattern. with a histogram every operation is timed.
+returns the number of operations done.
+*/
+typedef unsigned long long (*pattern_fn)(const struct allocator *a,
+                                         unsigned long long ops,
+                                         struct histogram *hist);
+
+// time op into hist when there is one
+#define TIMED(hist, op)                                                        \
+  do {                                                                         \
+    if (hist) {                                                                \
+      unsigned long long timed_start = now_ns();                               \
+      op;                                                                      \
+      hist_add(hist, now_ns() - timed_start);                                  \
+    } else {                                                                   \
+      op;                                                                      \
+    }                                                                          \
+  } while (0)
+
+// one size, freed right away
+static unsigned long long pattern_fixed(const struct allocator *a,
+                                        unsigned long long ops,
+                                        struct histogram *hist) {
+  for (unsigned long long i = 0; i < ops / 2; i++) {
+    void *p;
+    TIMED(hist, p = a->malloc(64));
+    *(volatile char *)p = 1;
+    TIMED(hist, a->free(p));
+  }
+  return ops / 2 * 2;
+}
+
+// random sizes replacing random live objects
+static unsigned long long pattern_random(const struct allocator *a,
+                                         unsigned long long ops,
+                                         struct histogram *hist) {
+  void *live[WINDOW] = {};
+  unsigned long long rng = 88172645463325252ULL;
+  unsigned long long done = 0;
+  while (done < ops) {
+    size_t slot = next_random(&rng) % WINDOW;
+    if (live[slot]) {
+      TIMED(hist, a->free(live[slot]));
+      done++;
+    }
+    size_t size = random_size(&rng);
+    TIMED(hist, live[slot] = a->malloc(size));
+    *(volatile char *)live[slot] = 1;
+    done++;
+  }
+  for (int i = 0; i < WINDOW; i++) {
+    a->free(live[i]);
+  }
+  return done;
+}
+
+// batches freed in reverse (LIFO) or in allocation order (FIFO)
+static unsigned long long pattern_batches(const struct allocator *a,
+                                          unsigned long long ops,
+                                          struct histogram *hist, bool lifo) {
+  void *batch[WINDOW];
+  unsigned long long rng = 2463534242ULL;
+  unsigned long long done = 0;
+  while (done < ops) {
+    for (int i = 0; i < WINDOW; i++) {
+      size_t size = 16 + next_random(&rng) % 240;
+      TIMED(hist, batch[i] = a->malloc(size));
+      *(volatile char *)batch[i] = 1;
+    }
+    for (int i = 0; i < WINDOW; i++) {
+      void *p = batch[lifo ? WINDOW - 1 - i : i];
+      TIMED(hist, a->free(p));
+    }
+    done += 2 * WINDOW;
+  }
+  return done;
+}
+
+static unsigned long long pattern_lifo(const struct allocator *a,
+                                       unsigned long long ops,
+                                       struct histogram *hist) {
+  return pattern_batches(a, ops, hist, true);
+}
+
+static unsigned long long pattern_fifo(const struct allocator *a,
+                                       unsigned long long ops,
+                                       struct histogram *hist) {
+  return pattern_batches(a, ops, hist, false);
+}
+
+// objects allocated by one thread and freed by another
+struct queue {
+  void *slots[QUEUE_SIZE];
+  unsigned long long head;
+  unsigned long long tail;
+};
+
+struct consumer_arg {
+  const struct allocator *a;
+  struct queue *q;
+  unsigned long long count;
+  struct histogram *hist;
+};
+
+static void *consumer(void *arg) {
+  struct consumer_arg *ca = (struct consumer_arg *)arg;
+  struct queue *q = ca->q;
+  for (unsigned long long i = 0; i < ca->count; i++) {
+    while (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head) {
+      sched_yield();
+    }
+    void *p = q->slots[q->head % QUEUE_SIZE];
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    TIMED(ca->hist, ca->a->free(p));
+  }
+  return NULL;
+}
+
+static unsigned long long pattern_producer_consumer(const struct allocator *a,
+                                                    unsigned long long ops,
+                                                    struct histogram *hist) {
+  static struct queue q;
+  static struct histogram consumer_hist;
+  q.head = q.tail = 0;
+  memset(&consumer_hist, 0, sizeof(consumer_hist));
+  struct consumer_arg ca = {a, &q, ops / 2, hist ? &consumer_hist : NULL};
+  pthread_t tid;
+  pthread_create(&tid, NULL, consumer, &ca);
+  unsigned long long rng = 1181783497276652981ULL;
+  for (unsigned long long i = 0; i < ca.count; i++) {
+    size_t size = 16 + next_random(&rng) % 240;
+    void *p;
+    TIMED(hist, p = a->malloc(size));
+    *(volatile char *)p = 1;
+    while (q.tail - __atomic_load_n(&q.head, __ATOMIC_ACQUIRE) == QUEUE_SIZE) {
+      sched_yield();
+    }
+    q.slots[q.tail % QUEUE_SIZE] = p;
+    __atomic_store_n(&q.tail, q.tail + 1, __ATOMIC_RELEASE);
+  }
+  pthread_join(tid, NULL);
+  if (hist) {
+    hist_merge(hist, &consumer_hist);
+  }
+  return ca.count * 2;
+}
+
+// buffers growing step by step, like string builders and vectors
+static unsigned long long pattern_realloc(const struct allocator *a,
+                                          unsigned long long ops,
+                                          struct histogram *hist) {
+  unsigned long long rng = 7664345821815920749ULL;
+  unsigned long long done = 0;
+  while (done < ops) {
+    void *p = NULL;
+    size_t size = 0;
+    while (size < 65536 && done < ops) {
+      size += 16 + next_random(&rng) % 112;
+      TIMED(hist, p = a->realloc(p, size));
+      ((volatile char *)p)[size - 1] = 1;
+      done++;
+    }
+    TIMED(hist, a->free(p));
+    done++;
+  }
+  return done;
+}
+
+// half of many objects stays alive while other sizes come and go
+static unsigned long long pattern_fragmentation(const struct allocator *a,
+                                                unsigned long long ops,
+                                                struct histogram *hist) {
+  const size_t objs_num = 65536;
+  void **objs = (void **)mmap(NULL, objs_num * sizeof(void *),
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  unsigned long long rng = 3935559000370003845ULL;
+  unsigned long long done = 0;
+  for (size_t i = 0; i < objs_num; i++) {
+    TIMED(hist, objs[i] = a->malloc(random_size(&rng)));
+    *(volatile char *)objs[i] = 1;
+    done++;
+  }
+  // free every other object: the survivors pin their pages
+  for (size_t i = 0; i < objs_num; i += 2) {
+    TIMED(hist, a->free(objs[i]));
+    objs[i] = NULL;
+    done++;
+  }
+  while (done < ops) {
+    size_t slot = (next_random(&rng) % (objs_num / 2)) * 2;
+    if (objs[slot]) {
+      TIMED(hist, a->free(objs[slot]));
+      done++;
+    }
+    // other sizes than the ones that were freed
+    TIMED(hist, objs[slot] = a->malloc(32 + random_size(&rng) * 3 / 2));
+    *(volatile char *)objs[slot] = 1;
+    done++;
+  }
+  for (size_t i = 0; i < objs_num; i++) {
+    if (objs[i]) {
+      a->free(objs[i]);
+    }
+  }
+  munmap(objs, objs_num * sizeof(void *));
+  return done;
+}
+
+// many small objects linked in a random order and walked: each load is likely
+// on another page, so the time goes to TLB misses unless the pages are huge
+struct scan_node {
+  struct scan_node *next;
+  char payload[40];
+};
+
+static unsigned long long pattern_scan(const struct allocator *a,
+                                       unsigned long long ops,
+                                       struct histogram *hist) {
+  struct scan_node **nodes = (struct scan_node **)mmap(
+      NULL, SCAN_OBJECTS * sizeof(void *), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  unsigned long long done = 0;
+  for (size_t i = 0; i < SCAN_OBJECTS; i++) {
+    TIMED(hist, nodes[i] = (struct scan_node *)a->malloc(
+                    sizeof(struct scan_node)));
+    done++;
+  }
+  // shuffle, then link in that order
+  unsigned long long rng = 1442695040888963407ULL;
+  for (size_t i = SCAN_OBJECTS - 1; i > 0; i--) {
+    size_t j = next_random(&rng) % (i + 1);
+    struct scan_node *tmp = nodes[i];
+    nodes[i] = nodes[j];
+    nodes[j] = tmp;
+  }
+  for (size_t i = 0; i < SCAN_OBJECTS; i++) {
+    nodes[i]->next = nodes[(i + 1) % SCAN_OBJECTS];
+  }
+  struct scan_node *p = nodes[0];
+  while (done < ops) {
+    TIMED(hist, p = p->next);
+    done++;
+  }
+  if (p == NULL) {
+    printf("unreachable\n");
+  }
+  for (size_t i = 0; i < SCAN_OBJECTS; i++) {
+    a->free(nodes[i]);
+  }
+  munmap(nodes, SCAN_OBJECTS * sizeof(void *));
+  return done + SCAN_OBJECTS;
+}
+
+static const struct {
+  const char *name;
+  pattern_fn run;
+} patterns[] = {
+    {"fixed", pattern_fixed},
+    {"random", pattern_random},
+    {"lifo", pattern_lifo},
+    {"fifo", pattern_fifo},
+    {"prodcons", pattern_producer_consumer},
+    {"realloc", pattern_realloc},
+    {"fragment", pattern_fragmentation},
+    {"scan", pattern_scan},
+};
+
+/**
+open a counter of the dTLB load misses of this process and the threads it
+creates from now on. returns -1 if the kernel or the cpu has none.
+*/
+static int tlb_counter_open() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+struct result {
+  double ops_per_sec;
+  // dTLB load misses per thousand operations, < 0 if not counted
+  double tlb_misses;
+  unsigned long long p50;
+  unsigned long long p99;
+  unsigned long long p999;
+};
+
+static struct result measure(const struct allocator *a, pattern_fn run,
+                             unsigned long long ops) {
+  struct result r;
+  int tlb_fd = tlb_counter_open();
+  if (tlb_fd >= 0) {
+    ioctl(tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  unsigned long long start = now_ns();
+  unsigned long long done = run(a, ops, NULL);
+  r.ops_per_sec = done * 1e9 / (now_ns() - start);
+  r.tlb_misses = -1;
+  unsigned long long misses;
+  if (tlb_fd >= 0) {
+    ioctl(tlb_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(tlb_fd, &misses, sizeof(misses)) == sizeof(misses)) {
+      r.tlb_misses = misses * 1000.0 / done;
+    }
+    close(tlb_fd);
+  }
+  // the histogram is large, keep it out of both allocators
+  struct histogram *hist = (struct histogram *)mmap(
+      NULL, sizeof(struct histogram), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  run(a, ops, hist);
+  r.p50 = hist_percentile(hist, 50);
+  r.p99 = hist_percentile(hist, 99);
+  r.p999 = hist_percentile(hist, 99.9);
+  munmap(hist, sizeof(struct histogram));
+  return r;
+}
+
+int main(int argc, char **argv) {
+  unsigned long long ops = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+  const char *only = argc > 2 ? argv[2] : NULL;
+  printf("%-9s %-7s %12s %8s %8s %8s %10s %10s\n", "pattern", "alloc",
+         "Mops/s", "p50 ns", "p99 ns", "p999 ns", "peak RSS", "dTLB/kop");
+  fflush(stdout);
+  for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+    if (only && strcmp(only, patterns[p].name) != 0) {
+      continue;
+    }
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+      int fds[2];
+      if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+      }
+      pid_t pid = fork();
+      if (pid == 0) {
+        close(fds[0]);
+        if (allocators[i].setup) {
+          allocators[i].setup();
+        }
+        struct result r = measure(&allocators[i], patterns[p].run, ops);
+        ssize_t written = write(fds[1], &r, sizeof(r));
+        _exit(written == sizeof(r) ? 0 : 1);
+      }
+      close(fds[1]);
+      struct result r;
+      ssize_t got = read(fds[0], &r, sizeof(r));
+      close(fds[0]);
+      int status;
+      struct rusage usage;
+      wait4(pid, &status, 0, &usage);
+      if (got != sizeof(r) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        printf("%-9s %-7s failed\n", patterns[p].name, allocators[i].name);
+        continue;
+      }
+      printf("%-9s %-7s %12.2f %8llu %8llu %8llu %7ld MB", patterns[p].name,
+             allocators[i].name, r.ops_per_sec / 1e6, r.p50, r.p99, r.p999,
+             usage.ru_maxrss / 1024);
+      if (r.tlb_misses >= 0) {
+        printf(" %10.2f\n", r.tlb_misses);
+      } else {
+        printf(" %10s\n", "-");
+      }
+      fflush(stdout);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+/**
+arena benchmark: requests that each allocate a few dozen small objects and
+drop them all at the end, served by mm_malloc and mm_free one object at a
+time, and by an arena reset once per request.
+usage: bench_arena [requests] [objects per request]
+configure with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+*/
+#include "arena.h"
+#include "mm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ALIGNMENT 16
+#define OBJECTS_MAX 4096
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// sizes from 16 to 256 bytes, the same sequence for both runs
+static size_t object_size(unsigned int *seed) {
+  return 16 + rand_r(seed) % 241;
+}
+
+static double run_malloc(size_t requests, size_t objects) {
+  void *objs[OBJECTS_MAX];
+  unsigned int seed = 1;
+  double start = now_sec();
+  for (size_t r = 0; r < requests; ++r) {
+    for (size_t i = 0; i < objects; ++i) {
+      objs[i] = mm_malloc(object_size(&seed), ALIGNMENT);
+      *(char *)objs[i] = (char)i;
+    }
+    for (size_t i = 0; i < objects; ++i) {
+      mm_free(objs[i]);
+    }
+  }
+  return (now_sec() - start) * 1e9 / ((double)requests * objects);
+}
+
+static double run_arena(size_t requests, size_t objects) {
+  struct mm_arena arena;
+  mm_arena_init(&arena, 0, true);
+  unsigned int seed = 1;
+  double start = now_sec();
+  for (size_t r = 0; r < requests; ++r) {
+    for (size_t i = 0; i < objects; ++i) {
+      void *obj = mm_arena_alloc(&arena, object_size(&seed), ALIGNMENT);
+      *(char *)obj = (char)i;
+    }
+    mm_arena_reset(&arena);
+  }
+  double ns = (now_sec() - start) * 1e9 / ((double)requests * objects);
+  mm_arena_destroy(&arena);
+  return ns;
+}
+
+int main(int argc, char **argv) {
+  size_t requests = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+  size_t objects = argc > 2 ? strtoul(argv[2], NULL, 10) : 50;
+  if (requests == 0) {
+    requests = 1;
+  }
+  if (objects == 0 || objects > OBJECTS_MAX) {
+    objects = OBJECTS_MAX;
+  }
+  // warm the caches of mm before timing it
+  run_malloc(requests / 10 + 1, objects);
+  printf("%zu requests of %zu objects\n", requests, objects);
+  printf("%16s %10.2f ns/object\n", "mm_malloc+free",
+         run_malloc(requests, objects));
+  printf("%16s %10.2f ns/object\n", "mm_arena", run_arena(requests, objects));
+  return 0;
+}
@@ -0,0 +1,102 @@
+/**
+slab coloring benchmark: chase pointers through the first object of every slab
+of a cache, once with slab coloring and once without.
+
+without coloring the first objects of all slabs share one offset in their page,
+so they compete for the few ways of a single L1 set as soon as there are more
+of them than ways. with coloring they spread over colors_num sets.
+usage: bench_coloring [max_slabs]
+configure with -DMM_DEBUG_LOG=OFF, or the debug log dominates the timings.
+*/
+#include "slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// 11 objects in a two page slab leave room for 6 colors
+#define OBJECT_SIZE 700
+#define ALIGNMENT 64
+#define STEPS 20000000
+
+struct node {
+  struct node *next;
+};
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// returns nanoseconds per dependent load through the first object of each of
+// slabs_num slabs
+static double run(size_t slabs_num, bool coloring) {
+  struct slab_cache cache;
+  slab_cache_init(&cache, OBJECT_SIZE, ALIGNMENT, NULL, NULL);
+  slab_cache_set_coloring(&cache, coloring);
+  size_t per_slab = cache.objects_num_per_slab;
+  size_t num = slabs_num * per_slab;
+  void **objs = (void **)malloc(sizeof(void *) * num);
+  for (size_t i = 0; i < num; ++i) {
+    objs[i] = slab_cache_alloc(&cache);
+    if (objs[i] == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  // a new slab hands out its objects in order: every per_slab-th object is
+  // the first one of a slab. link them into a ring, visited in a shuffled
+  // order so the prefetchers cannot follow
+  size_t *order = (size_t *)malloc(sizeof(size_t) * slabs_num);
+  for (size_t i = 0; i < slabs_num; ++i) {
+    order[i] = i;
+  }
+  unsigned int seed = 1;
+  for (size_t i = slabs_num - 1; i > 0; --i) {
+    size_t j = rand_r(&seed) % (i + 1);
+    size_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  for (size_t i = 0; i < slabs_num; ++i) {
+    struct node *from = (struct node *)objs[order[i] * per_slab];
+    from->next = (struct node *)objs[order[(i + 1) % slabs_num] * per_slab];
+  }
+  struct node *p = (struct node *)objs[order[0] * per_slab];
+  // warm up the caches
+  for (size_t i = 0; i < slabs_num * 4; ++i) {
+    p = p->next;
+  }
+  double start = now_sec();
+  for (int i = 0; i < STEPS; ++i) {
+    p = p->next;
+  }
+  double ns = (now_sec() - start) * 1e9 / STEPS;
+  // keep the chase from being optimized away
+  if (p == NULL) {
+    printf("unreachable\n");
+  }
+  for (size_t i = 0; i < num; ++i) {
+    slab_free_to(slab_of(objs[i]), objs[i]);
+  }
+  slab_cache_shrink(&cache);
+  free(order);
+  free(objs);
+  return ns;
+}
+
+int main(int argc, char **argv) {
+  size_t max_slabs = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+  struct slab_cache cache;
+  slab_cache_init(&cache, OBJECT_SIZE, ALIGNMENT, NULL, NULL);
+  printf("object size %d, %zu objects per slab, %zu colors of %zu bytes\n",
+         OBJECT_SIZE, cache.objects_num_per_slab, cache.colors_num,
+         cache.color_step);
+  printf("%8s %14s %14s\n", "slabs", "plain ns/load", "colored ns/load");
+  for (size_t slabs = 4; slabs <= max_slabs; slabs *= 2) {
+    double plain = run(slabs, false);
+    double colored = run(slabs, true);
+    printf("%8zu %14.2f %14.2f\n", slabs, plain, colored);
+  }
+  return 0;
+}
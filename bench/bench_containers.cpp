@@ -0,0 +1,124 @@
+/**
+container benchmark: fill, look up and empty standard containers with
+std::allocator (the system malloc), mm::allocator and std::pmr containers on
+mm::resource().
+usage: bench_containers [elements]
+configure with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+*/
+#include "allocator.h"
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+
+#define ROUNDS 5
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+template <typename Map> static long map_round(Map *map, size_t num) {
+  unsigned int seed = 1;
+  for (size_t i = 0; i < num; ++i) {
+    (*map)[rand_r(&seed)] = (long)i;
+  }
+  long sum = 0;
+  seed = 1;
+  for (size_t i = 0; i < num; ++i) {
+    sum += map->find(rand_r(&seed))->second;
+  }
+  map->clear();
+  return sum;
+}
+
+template <typename List> static long list_round(List *list, size_t num) {
+  for (size_t i = 0; i < num; ++i) {
+    list->push_back((int)i);
+  }
+  long sum = 0;
+  for (int v : *list) {
+    sum += v;
+  }
+  list->clear();
+  return sum;
+}
+
+// vectors of small vectors: many buffers grown by doubling
+template <typename Outer> static long vector_round(Outer *outer, size_t num) {
+  outer->resize(num / 16);
+  for (size_t i = 0; i < num; ++i) {
+    (*outer)[i % outer->size()].push_back((int)i);
+  }
+  long sum = 0;
+  for (size_t i = 0; i < outer->size(); ++i) {
+    sum += (long)(*outer)[i].size();
+  }
+  outer->clear();
+  return sum;
+}
+
+// returns nanoseconds per element over ROUNDS rounds
+template <typename C>
+static double run(long (*round)(C *, size_t), C *container, size_t num) {
+  static volatile long sink;
+  round(container, num);
+  double start = now_sec();
+  for (int i = 0; i < ROUNDS; ++i) {
+    sink = sink + round(container, num);
+  }
+  return (now_sec() - start) * 1e9 / ((double)ROUNDS * num);
+}
+
+template <typename K, typename V>
+using mm_map =
+    std::map<K, V, std::less<K>, mm::allocator<std::pair<const K, V>>>;
+template <typename K, typename V>
+using mm_unordered_map =
+    std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+                       mm::allocator<std::pair<const K, V>>>;
+
+int main(int argc, char **argv) {
+  size_t num = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+  if (num < 16) {
+    num = 16;
+  }
+  std::pmr::memory_resource *resource = mm::resource();
+  printf("%zu elements, ns/element\n", num);
+  printf("%16s %14s %14s %14s\n", "container", "std::allocator",
+         "mm::allocator", "pmr resource");
+
+  std::map<int, long> map_std;
+  mm_map<int, long> map_mm;
+  std::pmr::map<int, long> map_pmr(resource);
+  printf("%16s %14.2f %14.2f %14.2f\n", "map", run(map_round, &map_std, num),
+         run(map_round, &map_mm, num), run(map_round, &map_pmr, num));
+
+  std::unordered_map<int, long> umap_std;
+  mm_unordered_map<int, long> umap_mm;
+  std::pmr::unordered_map<int, long> umap_pmr(resource);
+  printf("%16s %14.2f %14.2f %14.2f\n", "unordered_map",
+         run(map_round, &umap_std, num), run(map_round, &umap_mm, num),
+         run(map_round, &umap_pmr, num));
+
+  std::list<int> list_std;
+  std::list<int, mm::allocator<int>> list_mm;
+  std::pmr::list<int> list_pmr(resource);
+  printf("%16s %14.2f %14.2f %14.2f\n", "list", run(list_round, &list_std, num),
+         run(list_round, &list_mm, num), run(list_round, &list_pmr, num));
+
+  std::vector<std::vector<int>> vec_std;
+  std::vector<std::vector<int, mm::allocator<int>>,
+              mm::allocator<std::vector<int, mm::allocator<int>>>>
+      vec_mm;
+  std::pmr::vector<std::pmr::vector<int>> vec_pmr(resource);
+  printf("%16s %14.2f %14.2f %14.2f\n", "vector<vector>",
+         run(vector_round, &vec_std, num), run(vector_round, &vec_mm, num),
+         run(vector_round, &vec_pmr, num));
+  return 0;
+}
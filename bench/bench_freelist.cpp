@@ -0,0 +1,84 @@
+/**
+freelist benchmark: allocate a working set of objects from one slab cache,
+then free and allocate them again in a shuffled order, with each freelist
+representation (see slab_cache_set_freelist).
+the index array touches its freelist page on every alloc and free, the linked
+list only the block itself, the bitmap one word per block.
+usage: bench_freelist [objects]
+configure with -DMM_DEBUG_LOG=OFF, or the debug log dominates the timings.
+*/
+#include "slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ROUNDS 20
+
+static const size_t sizes[] = {16, 64, 256, 1024};
+static const enum slab_freelist_kind kinds[] = {
+    SLAB_FREELIST_INDEX, SLAB_FREELIST_LINKED, SLAB_FREELIST_BITMAP};
+static const char *kind_names[] = {"index", "linked", "bitmap"};
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// returns nanoseconds per alloc+free pair over ROUNDS shuffled rounds
+static double run(size_t size, enum slab_freelist_kind kind, size_t num,
+                  size_t *per_slab) {
+  struct slab_cache cache;
+  slab_cache_init(&cache, size, 8, NULL, NULL);
+  slab_cache_set_freelist(&cache, kind);
+  *per_slab = cache.objects_num_per_slab;
+  void **objs = (void **)malloc(sizeof(void *) * num);
+  for (size_t i = 0; i < num; ++i) {
+    objs[i] = slab_cache_alloc(&cache);
+    if (objs[i] == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  unsigned int seed = 1;
+  double start = now_sec();
+  for (int round = 0; round < ROUNDS; ++round) {
+    // free half of the objects at random, then allocate them again
+    for (size_t i = 0; i < num / 2; ++i) {
+      size_t j = i + rand_r(&seed) % (num - i);
+      void *tmp = objs[i];
+      objs[i] = objs[j];
+      objs[j] = tmp;
+      slab_free_to(slab_of(objs[i]), objs[i]);
+    }
+    for (size_t i = 0; i < num / 2; ++i) {
+      objs[i] = slab_cache_alloc(&cache);
+      // use the object like a program would
+      *(char *)objs[i] = (char)i;
+    }
+  }
+  double ns = (now_sec() - start) * 1e9 / ((double)ROUNDS * (num / 2));
+  for (size_t i = 0; i < num; ++i) {
+    slab_free_to(slab_of(objs[i]), objs[i]);
+  }
+  slab_cache_shrink(&cache);
+  free(objs);
+  return ns;
+}
+
+int main(int argc, char **argv) {
+  size_t num = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  if (num < 2) {
+    num = 2;
+  }
+  printf("%6s %8s %10s %14s\n", "size", "freelist", "per slab",
+         "ns/alloc+free");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    for (size_t k = 0; k < 3; ++k) {
+      size_t per_slab;
+      double ns = run(sizes[s], kinds[k], num, &per_slab);
+      printf("%6zu %8s %10zu %14.2f\n", sizes[s], kind_names[k], per_slab, ns);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,109 @@
+/**
+microbenchmark of the allocator's memory kernels: copy, fill and compare of
+object-sized buffers with the former byte loops and with every implementation
+of memops.h the cpu supports.
+usage: bench_memops
+*/
+#include "memops.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define TOTAL_BYTES (1ULL << 30)
+
+// the byte loops mm.cpp used before, kept from being turned into libc calls
+#if defined(__clang__)
+#define BYTE_LOOP __attribute__((noinline, no_builtin))
+#else
+#define BYTE_LOOP                                                              \
+  __attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+#endif
+
+BYTE_LOOP static void byte_memcpy(void *dest, const void *src, size_t n) {
+  unsigned char *d = (unsigned char *)dest;
+  const unsigned char *s = (const unsigned char *)src;
+  for (size_t i = 0; i < n; i++) {
+    d[i] = s[i];
+  }
+}
+
+BYTE_LOOP static void byte_memset(void *dest, int value, size_t n) {
+  unsigned char *d = (unsigned char *)dest;
+  for (size_t i = 0; i < n; i++) {
+    d[i] = (unsigned char)value;
+  }
+}
+
+BYTE_LOOP static int byte_memcmp(const void *ptr1, const void *ptr2, size_t n) {
+  const unsigned char *p1 = (const unsigned char *)ptr1;
+  const unsigned char *p2 = (const unsigned char *)ptr2;
+  for (size_t i = 0; i < n; i++) {
+    if (p1[i] != p2[i]) {
+      return p1[i] - p2[i];
+    }
+  }
+  return 0;
+}
+
+struct kernels {
+  const char *name;
+  void (*copy)(void *dest, const void *src, size_t n);
+  void (*set)(void *dest, int value, size_t n);
+  int (*cmp)(const void *ptr1, const void *ptr2, size_t n);
+};
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned char buf_a[4096], buf_b[4096];
+static volatile int sink;
+
+// returns GB/s of each kernel over objects of size bytes
+static void run(const struct kernels *k, size_t size) {
+  size_t rounds = TOTAL_BYTES / size;
+  double start = now_sec();
+  for (size_t i = 0; i < rounds; ++i) {
+    k->copy(buf_a, buf_b, size);
+  }
+  double copy = TOTAL_BYTES / (now_sec() - start) / 1e9;
+  start = now_sec();
+  for (size_t i = 0; i < rounds; ++i) {
+    k->set(buf_a, (int)i, size);
+  }
+  double set = TOTAL_BYTES / (now_sec() - start) / 1e9;
+  memcpy(buf_a, buf_b, size);
+  int acc = 0;
+  start = now_sec();
+  for (size_t i = 0; i < rounds; ++i) {
+    acc += k->cmp(buf_a, buf_b, size);
+  }
+  double cmp = TOTAL_BYTES / (now_sec() - start) / 1e9;
+  sink = acc;
+  printf("%-8s %6zu %10.2f %10.2f %10.2f\n", k->name, size, copy, set, cmp);
+}
+
+int main() {
+  static const char *names[] = {"word", "sse2", "avx2"};
+  static const size_t sizes[] = {16, 64, 256, 1024, 4096};
+  struct kernels byte = {"byte", byte_memcpy, byte_memset, byte_memcmp};
+  struct kernels mm = {NULL, mm_memcpy, mm_memset, mm_memcmp};
+  memset(buf_b, 0x3C, sizeof(buf_b));
+  printf("memory kernels, GB/s over %llu MB per kernel and size\n",
+         TOTAL_BYTES >> 20);
+  printf("%-8s %6s %10s %10s %10s\n", "kernel", "size", "copy", "set",
+         "compare");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    run(&byte, sizes[s]);
+    for (int isa = MEMOPS_WORD; isa <= MEMOPS_AVX2; ++isa) {
+      if (memops_set_isa((enum memops_isa)isa) != 0) {
+        continue;
+      }
+      mm.name = names[isa];
+      run(&mm, sizes[s]);
+    }
+  }
+  return 0;
+}
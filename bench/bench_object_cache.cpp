@@ -0,0 +1,121 @@
+/**
+object cache benchmark: create and destroy a working set of small objects in
+a shuffled order, through
+- mm_malloc with placement new and an explicit destructor call,
+- a slab_cache whose ctor and dtor hooks construct the objects,
+- mm::object_cache<T>, whose constructor and destructor calls are inlined.
+usage: bench_object_cache [objects]
+configure with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+*/
+#include "mm.h"
+#include "object_cache.h"
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ROUNDS 20
+
+struct node {
+  node *left;
+  node *right;
+  long key;
+  long value;
+  node() : left(NULL), right(NULL), key(0), value(0) {}
+  node(long k, long v) : left(NULL), right(NULL), key(k), value(v) {}
+};
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void node_ctor(void *ptr, size_t size) {
+  (void)size;
+  new (ptr) node();
+}
+
+static void node_dtor(void *ptr, size_t size) {
+  (void)size;
+  ((node *)ptr)->~node();
+}
+
+struct malloc_pool {
+  node *create(long i) {
+    return new (mm_malloc(sizeof(node), alignof(node))) node(i, i);
+  }
+  void destroy(node *n) {
+    n->~node();
+    mm_free(n);
+  }
+};
+
+struct hook_pool {
+  struct slab_cache cache;
+  hook_pool() {
+    slab_cache_init(&cache, sizeof(node), alignof(node), node_ctor, node_dtor);
+    slab_cache_set_freelist(&cache, SLAB_FREELIST_LINKED);
+  }
+  ~hook_pool() { slab_cache_shrink(&cache); }
+  node *create(long i) {
+    node *n = (node *)slab_cache_alloc(&cache);
+    n->key = i;
+    n->value = i;
+    return n;
+  }
+  void destroy(node *n) { slab_free_to(slab_of(n), n); }
+};
+
+struct typed_pool {
+  mm::object_cache<node> cache;
+  node *create(long i) { return cache.construct(i, i); }
+  void destroy(node *n) { cache.destroy(n); }
+};
+
+// returns nanoseconds per create+destroy pair
+template <typename Pool> static double run(Pool *pool, size_t num) {
+  node **objs = (node **)malloc(sizeof(node *) * num);
+  for (size_t i = 0; i < num; ++i) {
+    objs[i] = pool->create((long)i);
+  }
+  unsigned int seed = 1;
+  double start = now_sec();
+  for (int round = 0; round < ROUNDS; ++round) {
+    // destroy half of the objects at random, then create them again
+    for (size_t i = 0; i < num / 2; ++i) {
+      size_t j = i + rand_r(&seed) % (num - i);
+      node *tmp = objs[i];
+      objs[i] = objs[j];
+      objs[j] = tmp;
+      pool->destroy(objs[i]);
+    }
+    for (size_t i = 0; i < num / 2; ++i) {
+      objs[i] = pool->create((long)i);
+    }
+  }
+  double ns = (now_sec() - start) * 1e9 / ((double)ROUNDS * (num / 2));
+  for (size_t i = 0; i < num; ++i) {
+    pool->destroy(objs[i]);
+  }
+  free(objs);
+  return ns;
+}
+
+int main(int argc, char **argv) {
+  size_t num = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  if (num < 2) {
+    num = 2;
+  }
+  malloc_pool by_malloc;
+  hook_pool by_hooks;
+  typed_pool by_type;
+  printf("%zu objects of %zu bytes\n", num, sizeof(node));
+  printf("%20s %10.2f ns/create+destroy\n", "mm_malloc",
+         run(&by_malloc, num));
+  printf("%20s %10.2f ns/create+destroy\n", "slab_cache+hooks",
+         run(&by_hooks, num));
+  printf("%20s %10.2f ns/create+destroy\n", "mm::object_cache",
+         run(&by_type, num));
+  return 0;
+}
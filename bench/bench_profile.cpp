@@ -0,0 +1,77 @@
+/**
+heap profiler benchmark: a working set of small objects freed and allocated
+again in a shuffled order, with the profiler off and sampling at several
+rates, to show what sampling costs the allocation path.
+usage: bench_profile [objects]
+configure with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+*/
+#include "mm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ROUNDS 20
+#define ALIGNMENT 16
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// sizes from 16 to 256 bytes
+static size_t object_size(unsigned int *seed) {
+  return 16 + rand_r(seed) % 241;
+}
+
+static void discard(void *arg, const char *buf, size_t len) {
+  (void)buf;
+  *(size_t *)arg += len;
+}
+
+// returns nanoseconds per free+malloc pair
+static double run(size_t rate, size_t num) {
+  mm_set_profile_rate(rate);
+  void **objs = (void **)malloc(sizeof(void *) * num);
+  unsigned int seed = 1;
+  for (size_t i = 0; i < num; ++i) {
+    objs[i] = mm_malloc(object_size(&seed), ALIGNMENT);
+  }
+  double start = now_sec();
+  for (int round = 0; round < ROUNDS; ++round) {
+    for (size_t i = 0; i < num / 2; ++i) {
+      size_t j = i + rand_r(&seed) % (num - i);
+      void *tmp = objs[i];
+      objs[i] = objs[j];
+      objs[j] = tmp;
+      mm_free(objs[i]);
+    }
+    for (size_t i = 0; i < num / 2; ++i) {
+      objs[i] = mm_malloc(object_size(&seed), ALIGNMENT);
+    }
+  }
+  double ns = (now_sec() - start) * 1e9 / ((double)ROUNDS * (num / 2));
+  for (size_t i = 0; i < num; ++i) {
+    mm_free(objs[i]);
+  }
+  free(objs);
+  mm_set_profile_rate(0);
+  return ns;
+}
+
+int main(int argc, char **argv) {
+  size_t num = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  if (num < 2) {
+    num = 2;
+  }
+  static const size_t rates[] = {0, 4 << 20, 512 << 10, 64 << 10, 4 << 10};
+  printf("%zu objects of 16 to 256 bytes\n", num);
+  for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i) {
+    printf("rate %8zu %10.2f ns/free+malloc\n", rates[i], run(rates[i], num));
+  }
+  size_t dumped = 0;
+  double start = now_sec();
+  mm_profile_dump(discard, &dumped);
+  printf("dump: %zu bytes in %.2f ms\n", dumped, (now_sec() - start) * 1e3);
+  return 0;
+}
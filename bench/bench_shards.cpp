@@ -0,0 +1,92 @@
+/**
+scaling benchmark of the slab caches behind the thread caches: N threads
+allocate and free batches of objects from one slab cache, once with a single
+lock and once split into per-cpu shards.
+usage: bench_shards [max_threads]
+configure with -DMM_DEBUG_LOG=OFF, or the debug log dominates the timings.
+*/
+#include "slab.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OBJECT_SIZE 64
+#define BATCH 32
+#define ROUNDS 20000
+
+struct worker_arg {
+  struct slab_cache *cache;
+  pthread_barrier_t *barrier;
+};
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *worker(void *arg) {
+  struct worker_arg *wa = (struct worker_arg *)arg;
+  void *objs[BATCH];
+  pthread_barrier_wait(wa->barrier);
+  for (int round = 0; round < ROUNDS; ++round) {
+    for (int i = 0; i < BATCH; ++i) {
+      objs[i] = slab_cache_alloc(wa->cache);
+    }
+    for (int i = 0; i < BATCH; ++i) {
+      slab_free_to(slab_of(objs[i]), objs[i]);
+    }
+  }
+  return NULL;
+}
+
+// returns millions of alloc+free operations per second
+static double run(int threads, size_t shards_num) {
+  struct slab_cache cache;
+  slab_cache_init(&cache, OBJECT_SIZE, 8, NULL, NULL);
+  if (shards_num > 1 && slab_cache_shard(&cache, shards_num) != 0) {
+    fprintf(stderr, "failed to shard the cache\n");
+    exit(1);
+  }
+  pthread_barrier_t barrier;
+  pthread_barrier_init(&barrier, NULL, threads + 1);
+  pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+  struct worker_arg wa = {&cache, &barrier};
+  for (int i = 0; i < threads; ++i) {
+    pthread_create(&tids[i], NULL, worker, &wa);
+  }
+  double start = now_sec();
+  pthread_barrier_wait(&barrier);
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+  double elapsed = now_sec() - start;
+  free(tids);
+  pthread_barrier_destroy(&barrier);
+  return 2.0 * BATCH * ROUNDS * threads / elapsed / 1e6;
+}
+
+int main(int argc, char **argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = argc > 1 ? atoi(argv[1]) : (int)cpus;
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+  printf("slab cache scaling, %d-byte objects, batches of %d, %ld cpus\n",
+         OBJECT_SIZE, BATCH, cpus);
+  printf("%8s %16s %16s\n", "threads", "single (Mop/s)", "sharded (Mop/s)");
+  for (int threads = 1;; threads *= 2) {
+    if (threads > max_threads) {
+      threads = max_threads;
+    }
+    double single = run(threads, 1);
+    double sharded = run(threads, (size_t)cpus);
+    printf("%8d %16.2f %16.2f\n", threads, single, sharded);
+    if (threads == max_threads) {
+      break;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,114 @@
+/**
+standard library adapters, so containers allocate from mm without changing
+their call sites:
+- mm::slab_resource, a std::pmr::memory_resource over the slab cache array of
+  mm_malloc, for the std::pmr containers:
+    std::pmr::vector<int> v(mm::resource());
+- mm::allocator<T>, a stateless allocator for the classic containers:
+    std::map<int, int, std::less<int>, mm::allocator<std::pair<const int, int>>>
+both free with mm_free_sized, so a node or buffer goes back to its thread
+cache without a page map lookup. like operator new, they throw std::bad_alloc
+when out of memory.
+*/
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+#include "mm.h"
+#include <memory_resource>
+#include <new>
+#include <stdint.h>
+
+namespace mm {
+
+class slab_resource : public std::pmr::memory_resource {
+public:
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  slab_resource() noexcept {}
+#else
+  slab_resource(struct slab_cache *cache_array,
+                size_t cache_array_size) noexcept
+      : cache_array_(cache_array), cache_array_size_(cache_array_size) {}
+#endif
+
+protected:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+    void *ptr = mm_malloc(bytes, alignment);
+#else
+    void *ptr = mm_malloc(bytes, alignment, cache_array_, cache_array_size_);
+#endif
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    return ptr;
+  }
+
+  void do_deallocate(void *ptr, size_t bytes, size_t alignment) override {
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+    mm_free_sized(ptr, bytes, alignment);
+#else
+    mm_free_sized(ptr, bytes, alignment, cache_array_, cache_array_size_);
+#endif
+  }
+
+  // all resources over the same cache array can free each other's memory
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    const slab_resource *resource = dynamic_cast<const slab_resource *>(&other);
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+    return resource != nullptr;
+#else
+    return resource != nullptr && resource->cache_array_ == cache_array_;
+#endif
+  }
+
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+private:
+  struct slab_cache *cache_array_;
+  size_t cache_array_size_;
+#endif
+};
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+/**
+get the resource of the global slab caches.
+*/
+inline slab_resource *resource() noexcept {
+  static slab_resource global_resource;
+  return &global_resource;
+}
+
+template <typename T> struct allocator {
+  typedef T value_type;
+
+  allocator() noexcept {}
+  template <typename U> allocator(const allocator<U> &) noexcept {}
+
+  T *allocate(size_t n) {
+    if (n > SIZE_MAX / sizeof(T)) {
+      throw std::bad_array_new_length();
+    }
+    void *ptr = mm_malloc(n * sizeof(T), alignof(T));
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T *>(ptr);
+  }
+
+  void deallocate(T *ptr, size_t n) noexcept {
+    mm_free_sized(ptr, n * sizeof(T), alignof(T));
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+  return false;
+}
+#endif
+
+} // namespace mm
+#endif
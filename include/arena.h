@@ -0,0 +1,139 @@
+/**
+arenas: bump allocation for objects that all die together, e.g. the objects
+of one request. an arena hands out memory from chunks of bulk_alloc by moving
+a pointer forward:
+|| struct arena_chunk | object | pad | object | ... | free space ||
+objects are never freed one by one. mm_arena_reset frees them all at once and
+keeps the chunks for the next round, mm_arena_destroy gives the chunks back
+to the page source.
+
+a savepoint records where the arena stands; restoring it frees everything
+allocated since, so savepoints nest like a stack. restoring a savepoint taken
+after another one that was restored already, or before the last reset, is
+undefined.
+
+an object that does not fit in what is left of the current chunk starts a new
+chunk, large enough for it. if the arena was created with oversize fallback,
+such an object larger than a chunk's share (ARENA_OVERSIZE_FRACTION) goes to
+mm_malloc instead, and is freed with mm_free when the arena is reset, restored
+past it or destroyed.
+
+arena objects carry no canary and must not be passed to mm_free. an arena is
+not thread safe: use one per thread, or lock it.
+*/
+#ifndef ARENA_H
+#define ARENA_H
+#include "utils.h"
+#include <stdint.h>
+
+#define ARENA_CHUNK_SIZE_DEFAULT (64 * 1024)
+// with oversize fallback, requests larger than a chunk's space divided by it
+// go to mm_malloc rather than leave much of the current chunk unused
+#define ARENA_OVERSIZE_FRACTION 4
+
+struct arena_chunk {
+  // the chunk filled before this one, or the next spare chunk
+  struct arena_chunk *prev;
+  // size of the whole mapping
+  size_t size;
+};
+
+// an object of the oversize fallback, allocated from the arena itself
+struct arena_oversize {
+  struct arena_oversize *prev;
+  void *ptr;
+};
+
+struct mm_arena {
+  // the chunk allocated from, newest first, and the oldest one of the list
+  struct arena_chunk *chunk;
+  struct arena_chunk *first;
+  // chunks kept by mm_arena_reset and mm_arena_restore for reuse
+  struct arena_chunk *spare;
+  // free space of the current chunk
+  char *cur;
+  char *end;
+  // oversize objects from mm_malloc, newest first
+  struct arena_oversize *oversize;
+  size_t chunk_size;
+  bool oversize_fallback;
+  // bytes mapped for chunks, in use or spare
+  size_t mapped_bytes;
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+  struct slab_cache *cache_array;
+  size_t cache_array_size;
+#endif
+};
+
+struct mm_arena_savepoint {
+  struct arena_chunk *chunk;
+  char *cur;
+  struct arena_oversize *oversize;
+};
+
+/**
+init an empty arena taking chunk_size bytes at a time from bulk_alloc, rounded
+up to pages; 0 picks ARENA_CHUNK_SIZE_DEFAULT. no memory is mapped before the
+first allocation.
+*/
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+void mm_arena_init(struct mm_arena *arena, size_t chunk_size,
+                   bool oversize_fallback);
+#else
+void mm_arena_init(struct mm_arena *arena, size_t chunk_size,
+                   bool oversize_fallback, struct slab_cache *cache_array,
+                   size_t cache_array_size);
+#endif
+
+/**
+free every object and give all chunks back to the page source. the arena is
+empty afterwards and can be used again.
+*/
+void mm_arena_destroy(struct mm_arena *arena);
+
+void *mm_arena_alloc_slow(struct mm_arena *arena, size_t size,
+                          size_t alignment);
+
+/**
+alloc size bytes aligned to alignment, a power of two. the memory is not
+initialized. returns NULL if out of memory or alignment is not a power of two.
+*/
+static inline void *mm_arena_alloc(struct mm_arena *arena, size_t size,
+                                   size_t alignment) {
+  // the slow path refuses the alignment, however full the chunk is
+  if (__builtin_expect(alignment == 0 || (alignment & (alignment - 1)) != 0,
+                       0)) {
+    return mm_arena_alloc_slow(arena, size, alignment);
+  }
+  uintptr_t ptr = ((uintptr_t)arena->cur + alignment - 1) & ~(alignment - 1);
+  uintptr_t end = (uintptr_t)arena->end;
+  // size - 1 sends a 0 byte request to the slow path
+  if (__builtin_expect(ptr <= end && size - 1 < end - ptr, 1)) {
+    arena->cur = (char *)(ptr + size);
+    return (void *)ptr;
+  }
+  return mm_arena_alloc_slow(arena, size, alignment);
+}
+
+/**
+free every object of the arena in O(1), besides one mm_free per oversize
+object. the chunks are kept for the next allocations.
+*/
+void mm_arena_reset(struct mm_arena *arena);
+
+/**
+get a savepoint of the arena, see mm_arena_restore.
+*/
+static inline struct mm_arena_savepoint mm_arena_save(struct mm_arena *arena) {
+  struct mm_arena_savepoint savepoint = {arena->chunk, arena->cur,
+                                         arena->oversize};
+  return savepoint;
+}
+
+/**
+free every object allocated since savepoint was taken. the chunks filled since
+are kept for reuse.
+*/
+void mm_arena_restore(struct mm_arena *arena,
+                      const struct mm_arena_savepoint *savepoint);
+#endif
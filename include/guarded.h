@@ -0,0 +1,118 @@
+/**
+guarded allocations: about one in every sample rate mm_malloc calls is served
+from a pool of single page slots, each between two PROT_NONE guard pages:
+|| guard | slot | guard | slot | guard | ... ||
+the object is placed at the end of its slot, so writing or reading past it
+faults right away, and a freed slot is made PROT_NONE too, so a use after free
+faults as well. a SIGSEGV handler then reports the address with the stacks
+that allocated and freed the object, and lets the fault kill the process.
+
+freed slots are reused oldest first, to keep catching late uses after free for
+as long as possible. the bytes between the object and the end of its slot,
+left over by the alignment, are filled with a pattern checked on free.
+
+the guard pages are changed with bulk_protect of the page source. a page
+source that can not protect pages need not define it: sampling then never
+picks an allocation.
+*/
+#ifndef GUARDED_H
+#define GUARDED_H
+#include "pagemap.h"
+#include "utils.h"
+
+#define GUARDED_SLOTS_NUM 256
+// largest object a slot can hold
+#define GUARDED_SIZE_MAX PAGE_SIZE
+#define GUARDED_STACK_DEPTH 16
+#define GUARDED_POOL_SIZE ((2 * GUARDED_SLOTS_NUM + 1) * PAGE_SIZE)
+
+struct guarded_stack {
+  size_t depth;
+  void *frames[GUARDED_STACK_DEPTH];
+};
+
+enum guarded_slot_state {
+  GUARDED_SLOT_UNUSED = 0,
+  GUARDED_SLOT_LIVE,
+  GUARDED_SLOT_FREED,
+};
+
+struct guarded_slot {
+  // the object of the slot, or the last one it held
+  void *ptr;
+  size_t size;
+  enum guarded_slot_state state;
+  struct guarded_stack alloc_stack;
+  struct guarded_stack free_stack;
+};
+
+struct guarded_stats {
+  // objects served from the pool, and those still live
+  size_t allocs;
+  size_t live;
+  // sampled allocations that fell back to the slab caches: the pool was full,
+  // or the object too large or too aligned
+  size_t misses;
+};
+
+/**
+set how often allocations are sampled: about one in rate. 0 turns sampling
+off, which is the default. threads pick the new rate up with their next
+sample.
+*/
+void guarded_set_sample_rate(size_t rate);
+
+// allocations the calling thread makes before its next sample
+extern __thread size_t guarded_countdown
+    __attribute__((tls_model("initial-exec")));
+
+bool guarded_sample_slow();
+
+/**
+check whether the next allocation of the calling thread is to be guarded.
+*/
+static inline bool guarded_sample() {
+  if (__builtin_expect(guarded_countdown > 1, 1)) {
+    guarded_countdown--;
+    return false;
+  }
+  return guarded_sample_slow();
+}
+
+/**
+alloc a guarded object of size bytes aligned to alignment. the memory is not
+initialized. returns NULL if it does not fit a slot or no slot is free.
+*/
+void *guarded_alloc(size_t size, size_t alignment);
+
+/**
+get the slot holding ptr, or NULL if ptr is not in the guarded pool.
+*/
+struct guarded_slot *guarded_of(const void *ptr);
+
+// start of the pool, NULL until it is set up by the first guarded allocation
+extern char *guarded_pool_base;
+
+/**
+check whether ptr lies in the guarded pool, without a page map lookup.
+*/
+static inline bool guarded_owns(const void *ptr) {
+  char *base = __atomic_load_n(&guarded_pool_base, __ATOMIC_RELAXED);
+  return base != NULL && (unsigned long long)ptr - (unsigned long long)base <
+                             GUARDED_POOL_SIZE;
+}
+
+/**
+free a guarded object. a double free, a pointer into the middle of the
+object, or an overwritten alignment tail is reported and aborts.
+*/
+void guarded_free(struct guarded_slot *slot, void *ptr);
+
+void guarded_get_stats(struct guarded_stats *stats);
+
+/**
+take and release the lock of the pool, see mm_prefork().
+*/
+void guarded_lock();
+void guarded_unlock();
+#endif
@@ -0,0 +1,56 @@
+/**
+large object allocator for requests too big for the size classes.
+
+every large object gets its own page mapping from bulk_alloc, which starts with
+a struct large_block:
+|| struct large_block | padding | object ... | unused tail of the last page ||
+the page holding the object's first byte is registered in the page map, so the
+block of an object is found in O(1) on free.
+
+growing or shrinking a block goes through bulk_realloc, which a page source
+backed by mmap implements with mremap: the mapping is resized in place if it
+can be, otherwise its pages are moved, not copied, onto a new mapping that is
+registered first.
+*/
+#ifndef LARGE_H
+#define LARGE_H
+#include "utils.h"
+
+struct large_block {
+  // size of the whole mapping, a multiple of PAGE_SIZE
+  size_t map_size;
+  // size the object was allocated or reallocated with
+  size_t size;
+  // alignment the object was allocated with
+  size_t alignment;
+  // offset of the object from the start of the mapping
+  size_t offset;
+};
+
+/**
+alloc a large object of size bytes aligned to alignment.
+*/
+void *large_alloc(size_t size, size_t alignment);
+
+/**
+free a large object.
+*/
+void large_free(void *ptr);
+
+/**
+resize a large object in place or by moving its pages, keeping its contents.
+returns the new address of the object or NULL if out of memory, in which case
+the old object is left untouched.
+*/
+void *large_realloc(void *ptr, size_t size);
+
+/**
+get the block of a large object, or NULL if ptr is not a large object.
+*/
+struct large_block *large_of(const void *ptr);
+
+/**
+get the number of live large objects and the bytes mapped for them.
+*/
+void large_get_stats(size_t *blocks_num, size_t *mapped_bytes);
+#endif
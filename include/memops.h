@@ -0,0 +1,40 @@
+/**
+memory kernels of the allocator: copy, fill and compare.
+
+the allocator does not depend on libc, so it brings its own memcpy, memset and
+memcmp. they work a machine word at a time, and on x86-64 with 16 byte SSE2 or
+32 byte AVX2 vectors, picked at runtime from what the cpu supports.
+*/
+#ifndef MEMOPS_H
+#define MEMOPS_H
+#include "utils.h"
+
+enum memops_isa {
+  // portable, one machine word at a time
+  MEMOPS_WORD = 0,
+  MEMOPS_SSE2,
+  MEMOPS_AVX2,
+};
+
+void mm_memcpy(void *dest, const void *src, size_t n);
+
+void mm_memset(void *dest, int value, size_t n);
+
+/**
+compare n bytes like memcmp: < 0, 0 or > 0 as the first differing byte of ptr1
+is smaller, equal or larger than the one of ptr2.
+*/
+int mm_memcmp(const void *ptr1, const void *ptr2, size_t n);
+
+/**
+get the implementation in use. the best one the cpu supports is picked on the
+first call to any kernel.
+*/
+enum memops_isa memops_get_isa();
+
+/**
+force an implementation, e.g. to benchmark or test them all.
+returns 0 on success, -1 if the cpu does not support it.
+*/
+int memops_set_isa(enum memops_isa isa);
+#endif
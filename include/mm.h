@@ -1,21 +1,225 @@
 /**
 C版本的内存管理器头文件。
 */
+#include "slab.h"
+#include "stats.h"
 #include "utils.h"
+
+/**
+hardening tiers, chosen at build time with -DMM_HARDENING=... (cmake
+-DMM_HARDENING=off|fast|full):
+- MM_HARDENING_OFF: objects carry nothing but the user's bytes. mm_usable_size
+  is the size of the object's class.
+- MM_HARDENING_FAST: a random 8-byte per-process canary follows the user's
+  bytes, checked with one load on free and realloc, and a size trailer ends
+  the object.
+- MM_HARDENING_FULL: the 24-byte string canary, compared byte by byte, and the
+  size trailer. the default.
+fast and full abort when a canary was overwritten.
+*/
+#ifndef MM_HARDENING_OFF
+#define MM_HARDENING_OFF 0
+#define MM_HARDENING_FAST 1
+#define MM_HARDENING_FULL 2
+#ifndef MM_HARDENING
+#define MM_HARDENING MM_HARDENING_FULL
+#endif
+#if MM_HARDENING == MM_HARDENING_FULL
+#define MM_CANARY_SIZE 24
+#elif MM_HARDENING == MM_HARDENING_FAST
+#define MM_CANARY_SIZE 8
+#else
+#define MM_CANARY_SIZE 0
+#endif
+// bytes a slab object holds beyond what was asked for: canary and trailer
+#define MM_HARDENING_OVERHEAD                                                  \
+  (MM_HARDENING == MM_HARDENING_OFF ? 0 : MM_CANARY_SIZE + sizeof(size_t))
+#endif
 #ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+/**
+alloc size bytes aligned to alignment. the memory is not initialized.
+*/
 void *mm_malloc(size_t size, size_t alignment);
 
+/**
+alloc num * size zeroed bytes. objects still zero from the page source are
+not cleared again.
+*/
+void *mm_calloc(size_t num, size_t size, size_t alignment);
+
 void mm_free(void *ptr);
 
+/**
+free ptr given the size and alignment it was allocated or last resized with,
+like sized operator delete. the size class follows from them, so a slab
+object goes to the thread cache without a page map lookup. any other size is
+undefined behavior; MM_HARDENING_FULL checks it against the page map and the
+object's trailer and aborts on a mismatch.
+*/
+void mm_free_sized(void *ptr, size_t size, size_t alignment);
+
 void *mm_realloc(void *ptr, size_t size, size_t alignment);
 
+/**
+give every empty slab back to the page source (bulk_free), after flushing the
+calling thread's cache. other threads keep their cached objects.
+returns the number of bytes released.
+*/
+size_t mm_trim();
+
+/**
+release only the slabs that stayed empty for a few calls, see
+slab_cache_decay(); call it periodically.
+returns the number of bytes released.
+*/
+size_t mm_decay();
+
+/**
+get the statistics of every size class and of large objects. the counts are
+summed over all threads without stopping them, so they are a close snapshot.
+*/
+void mm_stats_get(struct mm_stats *stats);
+
+/**
+write the statistics through write, as a table or as JSON.
+*/
+void mm_stats_dump(enum mm_stats_format format, mm_stats_write_fn write,
+                   void *arg);
+
+/**
+visit every slab of every cache, the empty ones included, and every object in
+use in it: slab_fn is called for a slab, then object_fn for each of its
+objects. either may be NULL. the calling thread's cache is flushed first;
+objects cached by other threads are reported as in use. large and guarded
+objects are not walked.
+each cache is locked while it is walked, so the callbacks must not call mm.
+returns 0 on success, -1 if there was no memory for the walk.
+*/
+int mm_heap_walk(mm_heap_slab_fn slab_fn, mm_heap_object_fn object_fn,
+                 void *arg);
+
+/**
+get the fragmentation of every cache from a heap walk: slabs by occupancy,
+and where their bytes go: to what was asked for, to padding, to the canary and
+trailer, to free objects or to the slabs themselves.
+returns 0 on success, -1 if the walk failed.
+*/
+int mm_frag_get(struct mm_frag_report *report);
+
+/**
+write the fragmentation report through write, as tables or as JSON.
+returns 0 on success, -1 if the walk failed.
+*/
+int mm_frag_dump(enum mm_stats_format format, mm_stats_write_fn write,
+                 void *arg);
+
+/**
+take every lock of the allocator before fork(), and release them in both the
+parent and the child after it, so the child never inherits a lock held by a
+thread that does not exist there. install them with
+pthread_atfork(mm_prefork, mm_postfork, mm_postfork).
+objects cached by the other threads' thread caches are lost to the child.
+*/
+void mm_prefork();
+
+void mm_postfork();
+
 #else
 void *mm_malloc(size_t size, size_t alignment, struct slab_cache *cache_array,
                 size_t cache_array_size);
 
+void *mm_calloc(size_t num, size_t size, size_t alignment,
+                struct slab_cache *cache_array, size_t cache_array_size);
+
 void mm_free(void *ptr, struct slab_cache *cache_array,
              size_t cache_array_size);
 
+void mm_free_sized(void *ptr, size_t size, size_t alignment,
+                   struct slab_cache *cache_array, size_t cache_array_size);
+
 void *mm_realloc(void *ptr, size_t size, size_t alignment,
                  struct slab_cache *cache_array, size_t cache_array_size);
-#endif
\ No newline at end of file
+
+size_t mm_trim(struct slab_cache *cache_array, size_t cache_array_size);
+
+size_t mm_decay(struct slab_cache *cache_array, size_t cache_array_size);
+
+void mm_stats_get(struct mm_stats *stats, struct slab_cache *cache_array,
+                  size_t cache_array_size);
+
+void mm_stats_dump(enum mm_stats_format format, mm_stats_write_fn write,
+                   void *arg, struct slab_cache *cache_array,
+                   size_t cache_array_size);
+
+int mm_heap_walk(mm_heap_slab_fn slab_fn, mm_heap_object_fn object_fn,
+                 void *arg, struct slab_cache *cache_array,
+                 size_t cache_array_size);
+
+int mm_frag_get(struct mm_frag_report *report, struct slab_cache *cache_array,
+                size_t cache_array_size);
+
+int mm_frag_dump(enum mm_stats_format format, mm_stats_write_fn write,
+                 void *arg, struct slab_cache *cache_array,
+                 size_t cache_array_size);
+#endif
+
+/**
+get the number of bytes usable at ptr, which is what was asked for when it was
+allocated or last resized: the bytes right after it hold the canary. without
+hardening, it is the size of the object's class.
+returns 0 if ptr was not allocated by mm_malloc.
+*/
+size_t mm_usable_size(void *ptr);
+
+/**
+get how many mm_realloc calls resized the object in place: within its size
+class, or by growing or shrinking a large object's mapping where it is.
+*/
+size_t mm_realloc_in_place_count();
+
+/**
+give slab caches created by the allocator from now on shards_num per-cpu
+shards (see slab_cache_shard). pass e.g. the number of cpus. 0 or 1 turns
+sharding off, which is the default.
+the global caches are created on the first allocation, so call it before.
+*/
+void mm_set_shards_num(size_t shards_num);
+
+/**
+let slab caches created by the allocator from now on carve their slabs out of
+2 MB huge page regions (see region.h), so a heap of many small objects needs
+few TLB entries, at the cost of reserving 2 MB per size class in use. off by
+default. like mm_set_shards_num, call it before the first allocation.
+*/
+void mm_set_hugepages(bool enabled);
+
+/**
+set the freelist representation of slab caches created by the allocator from
+now on, see slab_cache_set_freelist. SLAB_FREELIST_LINKED by default: the
+size classes are at least a pointer large, so it costs no metadata. like
+mm_set_shards_num, call it before the first allocation.
+*/
+void mm_set_freelist(enum slab_freelist_kind kind);
+
+/**
+serve about one in rate allocations of at most a page from the guarded pool,
+where overflows and uses after free fault right away and are reported with
+the stacks that allocated and freed the object, see guarded.h. 0 turns it
+off, which is the default. it can be changed at any time. guarded objects are
+not counted by mm_stats, see guarded_get_stats.
+*/
+void mm_set_guarded_sample_rate(size_t rate);
+
+/**
+record the stack of about one allocation in every rate bytes, and keep it
+with the object until it is freed, see profile.h. 0 turns the profiler off,
+which is the default. it can be changed at any time.
+*/
+void mm_set_profile_rate(size_t rate);
+
+/**
+write the heap profile through write, in the text format of gperftools that
+pprof reads: the sampled objects still live and all sampled so far, by call
+site.
+*/
+void mm_profile_dump(mm_stats_write_fn write, void *arg);
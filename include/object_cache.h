@@ -0,0 +1,99 @@
+/**
+object_cache<T>: a slab cache of T objects for C++ code.
+
+the size and alignment of the objects come from T at compile time, and create
+and destroy run T's constructor and destructor in place, so they are inlined
+instead of being called through the ctor and dtor hooks of the slab cache:
+  mm::object_cache<node> nodes;
+  node *n = nodes.construct(key, value);
+  nodes.destroy(n);
+  mm::object_cache<node>::handle h = nodes.create(key, value);
+a handle destroys its object when it goes out of scope, like a unique_ptr.
+
+objects are not counted by mm_stats, and must not be passed to mm_free. the
+cache is thread safe like any slab cache; tune it through cache() before
+the first object, e.g. with slab_cache_shard(). all objects must be destroyed
+before the cache.
+*/
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+#include "slab.h"
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace mm {
+
+template <typename T> class object_cache {
+public:
+  struct deleter {
+    object_cache *cache;
+    void operator()(T *obj) const { cache->destroy(obj); }
+  };
+  typedef std::unique_ptr<T, deleter> handle;
+
+  object_cache() {
+    slab_cache_init(&cache_, sizeof(T), alignof(T), nullptr, nullptr);
+    // no metadata per object; stays SLAB_FREELIST_INDEX if T is too small
+    slab_cache_set_freelist(&cache_, SLAB_FREELIST_LINKED);
+  }
+
+  // slabs keep a pointer to their cache, so it can not move
+  object_cache(const object_cache &) = delete;
+  object_cache &operator=(const object_cache &) = delete;
+
+  // gives the empty slabs back to the page source
+  ~object_cache() { slab_cache_shrink(&cache_); }
+
+  /**
+  alloc an object and construct it from args. returns nullptr if out of
+  memory. if the constructor throws, the memory is freed again.
+  */
+  template <typename... Args> T *construct(Args &&...args) {
+    void *ptr = slab_cache_alloc(&cache_);
+    if (ptr == nullptr) {
+      return nullptr;
+    }
+    block_guard guard = {ptr};
+    T *obj = new (ptr) T(std::forward<Args>(args)...);
+    guard.ptr = nullptr;
+    return obj;
+  }
+
+  /**
+  like construct, returning a handle that destroys the object. the handle is
+  empty if out of memory.
+  */
+  template <typename... Args> handle create(Args &&...args) {
+    return handle(construct(std::forward<Args>(args)...), deleter{this});
+  }
+
+  /**
+  destroy an object of this cache and free its memory. nullptr is ignored.
+  */
+  void destroy(T *obj) {
+    if (obj == nullptr) {
+      return;
+    }
+    obj->~T();
+    slab_free_to(slab_of(obj), obj);
+  }
+
+  struct slab_cache *cache() { return &cache_; }
+
+private:
+  // frees a block whose object could not be constructed
+  struct block_guard {
+    void *ptr;
+    ~block_guard() {
+      if (ptr != nullptr) {
+        slab_free_to(slab_of(ptr), ptr);
+      }
+    }
+  };
+
+  struct slab_cache cache_;
+};
+
+} // namespace mm
+#endif
@@ -0,0 +1,54 @@
+/**
+page map: a radix tree from page number to the metadata that owns the page.
+
+every page handed out by bulk_alloc that holds objects is registered here, so
+that the owner of any pointer (e.g. its struct slab) can be found in O(1)
+without walking the slab lists.
+
+a 48-bit virtual address has 36 bits of page number, which is split into three
+12-bit levels:
+|| root index | mid index | leaf index | page offset ||
+the root level is static, mid and leaf nodes are allocated on demand with
+bulk_alloc and never freed.
+*/
+#ifndef PAGEMAP_H
+#define PAGEMAP_H
+#include "utils.h"
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+
+/**
+pages are owned by different kinds of metadata. the kind is kept in the low
+bits of the owner pointer, which are free because metadata is 8-byte aligned.
+*/
+enum pagemap_kind {
+  // the owner is a struct slab
+  PAGEMAP_SLAB = 0,
+  // the owner is a struct large_block, see large.h
+  PAGEMAP_LARGE = 1,
+  // the owner is a struct guarded_slot, see guarded.h
+  PAGEMAP_GUARDED = 2,
+};
+#define PAGEMAP_KIND_MASK 7ULL
+#define PAGEMAP_OWNER_MAKE(owner, kind)                                        \
+  ((void *)((unsigned long long)(owner) | (kind)))
+#define PAGEMAP_OWNER_KIND(owner)                                              \
+  ((enum pagemap_kind)((unsigned long long)(owner) & PAGEMAP_KIND_MASK))
+#define PAGEMAP_OWNER_PTR(owner)                                               \
+  ((void *)((unsigned long long)(owner) & ~PAGEMAP_KIND_MASK))
+
+/**
+set the owner of all pages covering [addr, addr + size).
+pass owner=NULL to unregister the pages.
+returns 0 on success, -1 if a radix node could not be allocated or the address
+is out of the range covered by the map.
+*/
+int pagemap_set(const void *addr, size_t size, void *owner);
+
+/**
+get the owner of the page that addr lies in, or NULL if the page is not
+registered.
+*/
+void *pagemap_get(const void *addr);
+#endif
@@ -0,0 +1,109 @@
+/**
+sampled heap profiler: records the stack of about one allocation in every
+rate bytes handed out by mm_malloc, keeps it with the object until mm_free,
+and dumps the live and cumulative profile by call site for pprof.
+
+sampling is Poisson: the bytes between two samples are drawn from an
+exponential distribution with mean rate, so every byte has the same chance of
+being sampled whatever the size of its object, and no allocation pattern can
+line up with the samples. an object of size bytes is sampled with probability
+1 - exp(-size / rate); pprof undoes it from the rate in the profile header. on
+the fast path, sampling costs a thread-local subtraction.
+
+a sampled slab object is counted in its slab (struct slab sampled), so
+mm_free only looks the sample table up for the few slabs that hold one, and
+large objects only while samples are live. guarded objects are not sampled.
+
+the dump is the text heap profile of gperftools (heap_v2):
+  pprof -inuse_space ./app mm.heap
+  pprof -alloc_space ./app mm.heap
+stacks start in the allocator and are at most PROFILE_STACK_DEPTH frames.
+*/
+#ifndef PROFILE_H
+#define PROFILE_H
+#include "slab.h"
+#include "stats.h"
+#include "utils.h"
+
+#define PROFILE_STACK_DEPTH 24
+// distinct call sites kept, and sampled objects live at once: samples beyond
+// either are dropped and counted
+#define PROFILE_BUCKETS_MAX 4096
+#define PROFILE_SAMPLES_MAX 8192
+
+struct profile_stats {
+  // objects sampled, since the start and still live
+  size_t samples;
+  size_t live;
+  // samples lost to a full table
+  size_t dropped;
+  size_t buckets;
+};
+
+/**
+sample about one allocation in every rate bytes. 0 turns the profiler off,
+which is the default. threads pick a new rate up within a few megabytes of
+allocations.
+*/
+void profile_set_rate(size_t rate);
+
+// bytes the calling thread allocates before its next sample
+extern __thread long long profile_countdown
+    __attribute__((tls_model("initial-exec")));
+
+bool profile_sample_slow();
+
+/**
+check whether an allocation of size bytes by the calling thread is sampled.
+*/
+static inline bool profile_sample(size_t size) {
+  long long left = profile_countdown - (long long)size;
+  if (__builtin_expect(left > 0, 1)) {
+    profile_countdown = left;
+    return false;
+  }
+  return profile_sample_slow();
+}
+
+/**
+record the stack of a sampled object. slab is the slab of the object, or NULL
+for a large object.
+*/
+void profile_record(void *ptr, size_t size, struct slab *slab);
+
+// number of sampled objects still live
+extern size_t profile_live;
+
+static inline bool profile_has_live() {
+  return __atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0;
+}
+
+static inline bool profile_slab_sampled(struct slab *slab) {
+  return __atomic_load_n(&slab->sampled, __ATOMIC_RELAXED) != 0;
+}
+
+/**
+forget the sample of ptr, if it has one, when it is freed. slab is the slab
+of the object, or NULL for a large object.
+*/
+void profile_free(void *ptr, struct slab *slab);
+
+/**
+move the sample of a large object that was moved by mm_realloc.
+*/
+void profile_move(void *old_ptr, void *new_ptr);
+
+/**
+write the profile through write: one line per call site with its live and
+cumulative sampled objects and bytes, then the memory map of the process.
+*/
+void profile_dump(mm_stats_write_fn write, void *arg);
+
+void profile_get_stats(struct profile_stats *stats);
+
+/**
+take and release the lock of the profiler, see mm_prefork().
+*/
+void profile_lock();
+void profile_unlock();
+#endif
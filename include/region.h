@@ -0,0 +1,68 @@
+/**
+huge page regions: slabs carved out of 2 MB blocks.
+
+every slab is normally a mapping of its own from bulk_alloc, so a heap of many
+small objects takes one TLB entry per slab page. a slab cache set to use
+regions (slab_cache_set_huge) takes its slabs from REGION_SIZE blocks of
+bulk_alloc_huge instead, which the page source backs with huge pages where it
+can: a whole region then costs a single TLB entry.
+
+a region pool belongs to one slab cache, i.e. one size class, and its shards,
+so the slabs of other classes never split its huge pages. a region is given
+back to the page source once its last slab is released.
+*/
+#ifndef REGION_H
+#define REGION_H
+#include "pagemap.h"
+#include "spinlock.h"
+#include "utils.h"
+
+#define REGION_SHIFT 21
+#define REGION_SIZE (1UL << REGION_SHIFT)
+// a region starts with its header page, followed by the slab slots
+#define REGION_SLOTS_MAX (REGION_SIZE / PAGE_SIZE - 1)
+
+struct slab_region {
+  struct slab_region *prev;
+  struct slab_region *next;
+  size_t slots_num;
+  size_t slots_used;
+  // set bits mark the slots holding a slab
+  unsigned long long used[(REGION_SLOTS_MAX + 63) / 64];
+  // set bits mark the slots that held a slab before, so are not zero any more
+  unsigned long long dirty[(REGION_SLOTS_MAX + 63) / 64];
+};
+
+struct region_pool {
+  // regions of the pool; the ones with free slots are moved to the front
+  struct slab_region *regions;
+  size_t regions_num;
+  // slots holding a slab, over all regions
+  size_t slots_used;
+  struct spinlock lock;
+};
+
+#define REGION_POOL_INIT {(struct slab_region *)0, 0, 0, SPINLOCK_INIT}
+
+/**
+get a slot of slab_size bytes from pool, reserving a new region if all are
+full. *fresh tells whether the slot is still zero from the page source.
+returns NULL if slab_size does not fit a region or the page source has no
+huge blocks to give.
+*/
+void *region_alloc_slab(struct region_pool *pool, size_t slab_size,
+                        bool *fresh);
+
+/**
+give back a slot got from region_alloc_slab, and the region with it if it was
+the last slot in use.
+*/
+void region_free_slab(struct region_pool *pool, void *slab, size_t slab_size);
+
+/**
+get the number of regions of pool and how many bytes of them are not used by
+slabs.
+*/
+void region_pool_stats(struct region_pool *pool, size_t slab_size,
+                       size_t *regions_num, size_t *bytes_unused);
+#endif
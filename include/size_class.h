@@ -0,0 +1,99 @@
+/**
+size classes of the general-purpose allocator.
+
+sizes up to SIZE_CLASS_SPACING_START are spaced by SIZE_CLASS_QUANTUM, above
+that every power of two is split into SIZE_CLASS_STEPS classes:
+8, 16, 32, 48, ..., 128, 160, 192, 224, 256, 320, 384, 448, 512, 640, ...
+so a request wastes less than SIZE_CLASS_QUANTUM bytes up to
+SIZE_CLASS_SPACING_START, and less than 1/SIZE_CLASS_STEPS (25%) of its size
+above.
+
+the classes and a lookup table from size to class are generated at compile
+time, so size_class_of() is a single table load.
+*/
+#ifndef SIZE_CLASS_H
+#define SIZE_CLASS_H
+#include "utils.h"
+
+#define SIZE_CLASS_QUANTUM 16
+#define SIZE_CLASS_SPACING_START 128
+#define SIZE_CLASS_STEPS 4
+// the largest size served by the size classes. it must fit into one slab.
+#define SMALL_SIZE_MAX 3584
+// the lookup table has one entry per 8 bytes
+#define SIZE_CLASS_LOOKUP_SHIFT 3
+
+constexpr size_t size_class_next(size_t size) {
+  if (size < SIZE_CLASS_QUANTUM) {
+    return SIZE_CLASS_QUANTUM;
+  }
+  if (size < SIZE_CLASS_SPACING_START) {
+    return size + SIZE_CLASS_QUANTUM;
+  }
+  size_t power = SIZE_CLASS_SPACING_START;
+  while (power * 2 <= size) {
+    power *= 2;
+  }
+  return size + power / SIZE_CLASS_STEPS;
+}
+
+constexpr size_t size_classes_count() {
+  size_t num = 0;
+  for (size_t size = 8; size <= SMALL_SIZE_MAX; size = size_class_next(size)) {
+    num++;
+  }
+  return num;
+}
+
+// number of size classes
+constexpr size_t SIZE_CLASSES_NUM = size_classes_count();
+
+struct size_class_table {
+  // object size of each class
+  size_t sizes[SIZE_CLASSES_NUM];
+  // natural alignment of each class: the largest power of two dividing its size
+  size_t alignments[SIZE_CLASSES_NUM];
+  // class index for every (size + 7) >> 3
+  unsigned char lookup[(SMALL_SIZE_MAX >> SIZE_CLASS_LOOKUP_SHIFT) + 1];
+};
+
+constexpr struct size_class_table size_class_table_make() {
+  struct size_class_table table = {};
+  size_t index = 0;
+  for (size_t size = 8; size <= SMALL_SIZE_MAX; size = size_class_next(size)) {
+    table.sizes[index] = size;
+    table.alignments[index] = size & (~size + 1);
+    index++;
+  }
+  index = 0;
+  for (size_t i = 0; i <= (SMALL_SIZE_MAX >> SIZE_CLASS_LOOKUP_SHIFT); i++) {
+    while (table.sizes[index] < (i << SIZE_CLASS_LOOKUP_SHIFT)) {
+      index++;
+    }
+    table.lookup[i] = (unsigned char)index;
+  }
+  return table;
+}
+
+inline constexpr struct size_class_table size_classes = size_class_table_make();
+static_assert(SIZE_CLASSES_NUM <= 256, "class indexes must fit the lookup");
+
+/**
+get the class serving size bytes aligned to alignment (a power of two), or
+SIZE_CLASSES_NUM if the request is too large for the size classes.
+a class whose size is a multiple of alignment is aligned to it, so the class of
+the size rounded up to alignment is the answer.
+*/
+static inline size_t size_class_of(size_t size, size_t alignment) {
+  // checked before rounding up, which would wrap around for sizes close to
+  // SIZE_MAX
+  if (size > SMALL_SIZE_MAX) {
+    return SIZE_CLASSES_NUM;
+  }
+  size = (size + alignment - 1) & ~(alignment - 1);
+  if (size > SMALL_SIZE_MAX) {
+    return SIZE_CLASSES_NUM;
+  }
+  return size_classes.lookup[(size + 7) >> SIZE_CLASS_LOOKUP_SHIFT];
+}
+#endif
@@ -1,44 +1,257 @@
+#ifndef SLAB_H
+#define SLAB_H
 #include "ptrlist.h"
+#include "region.h"
+#include "spinlock.h"
 #include "utils.h"
 
+/**
+how a slab keeps track of its free blocks, chosen per cache with
+slab_cache_set_freelist():
+- SLAB_FREELIST_INDEX: an FILO array of shorts after struct slab that holds the
+  index of the mem blocks. when to malloc, freelist[active++] is returned. when
+  to free, freelist[--active] = index of the freed block. thus we can get a hot
+  memblock (a block that was recently used). it costs two bytes per object and
+  caps a slab at SLAB_OBJECTS_MAX objects.
+- SLAB_FREELIST_LINKED: a FILO list threaded through the first bytes of the
+  freed blocks, with no metadata at all. blocks never handed out are taken in
+  order from clean, so a new slab needs no setup. needs blocks of at least
+  sizeof(void *).
+- SLAB_FREELIST_BITMAP: one bit per block after struct slab, set when the block
+  is free. the lowest free block is found with ctz, so the blocks in use stay
+  packed at the start of the slab.
+*/
+enum slab_freelist_kind {
+  SLAB_FREELIST_INDEX = 0,
+  SLAB_FREELIST_LINKED,
+  SLAB_FREELIST_BITMAP,
+};
+
 /**
 a slab mem struct is like this:
-|| struct slab | freelist | mem blocks ||
-freelist is an FILO array that holds the index of the mem blocks.
-when to malloc, freelist[active++] is returned.
-when to free, freelist[--active] = index of the freed block.
-thus we can get a hot memblock(a block that was recently used).
+|| struct slab | freelist or bitmap, if any | mem blocks ||
+
+every page of a slab is registered in the page map (see pagemap.h), so the slab
+owning any object can be found in O(1) with slab_of().
 */
 struct slab {
   int active;
-  // pointer to freelist array. we use short here because we wont make a slab
-  // larger than 4kb.
-  short *freelist;
+  // SLAB_FREELIST_LINKED: blocks at this index and above were never handed
+  // out from this slab, so they are not on the list.
+  // SLAB_FREELIST_BITMAP: the words of the bitmap below it are all zero.
+  unsigned int cursor;
+  // the slab cache (or shard of it) this slab belongs to
+  struct slab_cache *cache;
+  union {
+    // SLAB_FREELIST_INDEX: pointer to freelist array. we use short here
+    // because such a slab holds at most SLAB_OBJECTS_MAX objects.
+    short *freelist;
+    // SLAB_FREELIST_LINKED: the last freed block, or NULL
+    void *free_head;
+    // SLAB_FREELIST_BITMAP: the free bits
+    unsigned long long *bitmap;
+  };
   // pointer used in the freelist
   // pointer to the start of the memory block that actually holds the objects
   void *mem_ptr;
+  // epoch of the cache when the slab became empty, see slab_cache_decay()
+  unsigned int empty_epoch;
+  // objects at this index and above were never handed out, so they are still
+  // zero from the page source
+  int clean;
+  // the slab was carved out of a huge page region, see region.h
+  bool in_region;
+  // live objects of the slab sampled by the heap profiler, see profile.h
+  unsigned int sampled;
   PTRLIST_DEF(struct slab)
 };
 
+/**
+all fields but the slab lists are immutable after slab_cache_init. the slab
+lists are protected by lock.
+
+a slab cache can be split into per-cpu shards with slab_cache_shard(). each
+shard is a slab_cache of its own with the same object layout, its own slab
+lists and its own lock; the lists of the parent cache stay unused.
+*/
 struct slab_cache {
   size_t object_size;
   // alignment of memory address of objects in this slab cache
   size_t alignment;
   size_t objects_num_per_slab;
+  enum slab_freelist_kind freelist_kind;
   struct slab *slabs_full;
   struct slab *slabs_partial;
   struct slab *slabs_empty;
   void (*ctor)(void *ptr, size_t size);
   void (*dtor)(void *ptr, size_t size);
+  struct spinlock lock;
+  // array of per-cpu shards, or NULL if the cache is not sharded
+  struct slab_cache *shards;
+  size_t shards_num;
+  // the cache this shard belongs to, or NULL if this is not a shard
+  struct slab_cache *parent;
+  // size of every slab of this cache, as passed to bulk_alloc/bulk_free
+  size_t slab_size;
+  // slab coloring: the objects area of each new slab starts color_step bytes
+  // further than the one of the previous slab, cycling through colors_num
+  // offsets, so that objects at the same index in different slabs fall into
+  // different cpu cache sets. the offsets come out of the space the objects
+  // leave at the end of the slab.
+  size_t colors_num;
+  size_t color_step;
+  size_t color_next;
+  // take slabs from huge page regions, see slab_cache_set_huge(). shards use
+  // the setting and the regions of their parent.
+  bool huge;
+  struct region_pool regions;
+  // empty slabs are kept newest first, see slab_cache_set_reclaim()
+  size_t slabs_empty_num;
+  size_t empty_slabs_max;
+  unsigned int decay_epochs;
+  unsigned int epoch;
+  // slabs taken from and given back to the page source, see
+  // slab_cache_get_stats()
+  size_t slabs_created;
+  size_t slabs_released;
+  // lock-free MPSC list of blocks freed by threads that did not get the lock
+  // (or, for a shard, by threads on another cpu). the blocks are linked through
+  // their first bytes and put back to their slabs by the next allocation.
+  void *remote_free;
 };
-#define SLAB_SIZE 4096
+// slabs are 1, 2, 4 ... SLAB_PAGES_MAX pages, picked per cache by
+// slab_cache_init so that the tail left after the last object is at most
+// SLAB_WASTE_MAX_PERCENT of the slab
+#define SLAB_PAGES_MAX 16
+#define SLAB_WASTE_MAX_PERCENT 10
+// SLAB_FREELIST_INDEX indexes are shorts
+#define SLAB_OBJECTS_MAX 32767
+// size of a cpu cache line, the smallest step between slab colors
+#define SLAB_CACHE_LINE 64
+// default high watermark of empty slabs kept by a cache
+#define SLAB_EMPTY_MAX_DEFAULT 8
+// default number of slab_cache_decay() calls an empty slab survives
+#define SLAB_DECAY_EPOCHS_DEFAULT 2
 /**
-init the slab cache array item.
+init the slab cache array item, with a SLAB_FREELIST_INDEX freelist.
 */
 void slab_cache_init(struct slab_cache *cache, size_t object_size,
                      size_t alignment, void (*ctor)(void *, size_t),
                      void (*dtor)(void *, size_t));
 
+/**
+split cache into shards_num shards. objects are allocated from the shard of
+the calling cpu, and a shard that runs dry steals empty slabs from the other
+shards before it creates a new slab.
+must be called before the cache is used.
+returns 0 on success, -1 if the shards could not be allocated.
+*/
+int slab_cache_shard(struct slab_cache *cache, size_t shards_num);
+
+/**
+set the freelist representation of cache (and its shards), and pick its slab
+size and colors again for the new metadata size. must be called before the
+cache is used, and before slab_cache_set_coloring().
+returns 0 on success, -1 if the objects are too small for a
+SLAB_FREELIST_LINKED list.
+*/
+int slab_cache_set_freelist(struct slab_cache *cache,
+                            enum slab_freelist_kind kind);
+
+/**
+turn slab coloring of cache (and its shards) on or off. it is on by default;
+slabs created before keep their color.
+*/
+void slab_cache_set_coloring(struct slab_cache *cache, bool enabled);
+
+/**
+let cache (and its shards) take its slabs from 2 MB huge page regions, or from
+bulk_alloc one by one, which is the default. see region.h.
+slabs created before keep where they came from.
+*/
+void slab_cache_set_huge(struct slab_cache *cache, bool enabled);
+
+/**
+set how a cache (and its shards) gives empty slabs back with bulk_free:
+- more than empty_slabs_max empty slabs are released as soon as a slab becomes
+  empty, the coldest first;
+- an empty slab that is not reused is released by the (decay_epochs + 1)-th
+  call to slab_cache_decay() after it became empty.
+*/
+void slab_cache_set_reclaim(struct slab_cache *cache, size_t empty_slabs_max,
+                            unsigned int decay_epochs);
+
+/**
+release all empty slabs of cache and its shards.
+returns the number of bytes given back with bulk_free.
+*/
+size_t slab_cache_shrink(struct slab_cache *cache);
+
+/**
+advance the decay epoch of cache and its shards and release the empty slabs
+that stayed unused for more than decay_epochs epochs. call it periodically,
+e.g. once a second, so memory is released gradually after a spike without
+thrashing slabs on an oscillating workload.
+returns the number of bytes given back with bulk_free.
+*/
+size_t slab_cache_decay(struct slab_cache *cache);
+
+/**
+take the locks of cache and of all its shards, e.g. so that fork() does not
+copy a lock held by another thread. slab_cache_unlock_all() releases them.
+*/
+void slab_cache_lock_all(struct slab_cache *cache);
+
+void slab_cache_unlock_all(struct slab_cache *cache);
+
+struct slab_cache_stats {
+  size_t slabs_created;
+  size_t slabs_released;
+  size_t slabs_partial;
+  size_t slabs_full;
+  size_t slabs_empty;
+  // objects handed out by the slabs, including those held by thread caches
+  size_t objects_active;
+  // bytes of all slabs the cache holds, and of the unused part of its
+  // huge page regions
+  size_t bytes_reserved;
+  size_t regions_num;
+};
+
+/**
+get the slab counts of cache, summed over its shards. every shard is locked in
+turn, so the counts of a busy cache are a close snapshot, not an exact one.
+*/
+void slab_cache_get_stats(struct slab_cache *cache,
+                          struct slab_cache_stats *stats);
+
+/**
+called by slab_cache_walk() for every slab of a cache, and for every object in
+use in it.
+*/
+typedef void (*slab_walk_slab_fn)(void *arg, struct slab *slab);
+typedef void (*slab_walk_object_fn)(void *arg, struct slab *slab, void *obj);
+
+/**
+visit every slab of cache and its shards, the empty ones included: slab_fn is
+called for the slab, then object_fn for each object it handed out, in address
+order. either may be NULL. objects waiting in the remote free list are put back
+first; objects held by thread caches count as in use.
+every shard is locked while it is walked, so the callbacks must neither
+allocate from nor free to the cache.
+returns 0 on success, -1 if there was no memory to walk the objects.
+*/
+int slab_cache_walk(struct slab_cache *cache, slab_walk_slab_fn slab_fn,
+                    slab_walk_object_fn object_fn, void *arg);
+
+/**
+get the cache a slab belongs to, seen from the cache array: the parent cache if
+the slab belongs to a shard.
+*/
+static inline struct slab_cache *slab_top_cache(struct slab *slab) {
+  return slab->cache->parent ? slab->cache->parent : slab->cache;
+}
+
 /**
 alloc a slab from system memory and initialize it for the given slab cache.
 */
@@ -53,17 +266,75 @@ put a memory block back to the given slab.
 */
 void free_memory_block(void *ptr);
 
+/**
+find the smallest cache in cache_array that fits size and alignment.
+returns NULL if there is none.
+*/
+struct slab_cache *slab_find_cache(size_t size, size_t alignment,
+                                   struct slab_cache *cache_array,
+                                   size_t cache_array_size);
+/**
+alloc an object from the given slab cache, or from the shard of the calling
+cpu if the cache is sharded.
+*/
+void *slab_cache_alloc(struct slab_cache *cache);
+
+/**
+like slab_cache_alloc, and tell in *clean whether the object is known to be
+all zero: it was never handed out since its slab was mapped, and the cache has
+no ctor.
+*/
+void *slab_cache_alloc_clean(struct slab_cache *cache, bool *clean);
+
+/**
+alloc up to num objects of cache into objs under a single lock, taking as many
+as possible from each slab at once. if clean is not NULL, clean[i] tells
+whether objs[i] is known to be all zero, see slab_cache_alloc_clean().
+returns the number of objects allocated, less than num only when out of memory.
+*/
+size_t slab_cache_alloc_bulk(struct slab_cache *cache, void **objs, size_t num,
+                             bool *clean);
+
 /*
 alloc memory from slab allocator.
+the smallest cache in cache_array that fits size and alignment is used.
 
-## reminder: the caller should ensure that the cache_array is sorted by
-object_size ascendingly.
+## reminder: slabs keep a pointer to their slab_cache, so a slab_cache must not
+be moved or copied once it owns slabs.
 */
 void *slab_alloc(size_t size, size_t alignment, struct slab_cache *cache_array,
                  size_t cache_array_size);
+/**
+alloc up to num objects into objs from the smallest cache in cache_array that
+fits size and alignment. returns the number of objects allocated.
+*/
+size_t slab_alloc_bulk(size_t size, size_t alignment,
+                       struct slab_cache *cache_array, size_t cache_array_size,
+                       void **objs, size_t num);
+/**
+free memory allocated by slab_alloc. the owning slab is found through the page
+map, cache_array is kept for API compatibility.
+*/
 void slab_free(void *ptr, struct slab_cache *cache_array,
                size_t cache_array_size);
 
+/**
+get the slab that owns ptr, or NULL if ptr was not allocated from a slab.
+*/
+struct slab *slab_of(const void *ptr);
+/**
+free ptr to a slab already looked up with slab_of().
+this never waits for the lock of the slab cache: when it is taken, or the slab
+belongs to another cpu's shard, ptr goes to the cache's remote free list.
+*/
+void slab_free_to(struct slab *slab, void *ptr);
+/**
+free num objects of any slab caches. consecutive objects of the same cache are
+freed under one lock, and the slab lists are fixed up once per run of objects
+from the same slab.
+*/
+void slab_free_bulk(void **objs, size_t num);
+
 /**
     get the size of the allocated object in slab.
 */
@@ -73,4 +344,5 @@ size_t get_slab_obj_size(void *ptr, struct slab_cache *cache_array,
     get the size of the usable allocated mem.
 */
 size_t get_alloced_size(void *ptr, struct slab_cache *cache_array,
-                        size_t cache_array_size);
\ No newline at end of file
+                        size_t cache_array_size);
+#endif
@@ -0,0 +1,41 @@
+/**
+a minimal test-and-test-and-set spin lock built on the compiler's atomic
+builtins, so that the allocator needs no threading library to lock its caches.
+*/
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+struct spinlock {
+  int locked;
+};
+
+#define SPINLOCK_INIT {0}
+
+static inline void spin_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+static inline void spin_init(struct spinlock *lock) {
+  __atomic_store_n(&lock->locked, 0, __ATOMIC_RELAXED);
+}
+
+static inline bool spin_trylock(struct spinlock *lock) {
+  return __atomic_load_n(&lock->locked, __ATOMIC_RELAXED) == 0 &&
+         __atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline void spin_lock(struct spinlock *lock) {
+  while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+    // wait on a plain load so the cache line is not bounced around
+    while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+      spin_relax();
+    }
+  }
+}
+
+static inline void spin_unlock(struct spinlock *lock) {
+  __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+#endif
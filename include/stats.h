@@ -0,0 +1,172 @@
+/**
+allocator statistics.
+
+mm_malloc/mm_free count into a block of counters owned by the calling thread,
+so counting costs a few plain adds and never shares a cache line. reading the
+statistics sums the blocks of all threads, plus the counts of threads that
+already exited. slab and large object counts are kept by their caches under
+the locks they take anyway, see slab_cache_stats().
+*/
+#ifndef STATS_H
+#define STATS_H
+#include "tcache.h"
+#include "utils.h"
+
+// counters are kept per cache of the cache array: one per thread cache bin
+#define STATS_CLASSES_NUM TCACHE_BINS_NUM
+
+struct mm_class_stats {
+  // object size of the cache, 0 for large objects
+  size_t object_size;
+  // mm_malloc/mm_free calls served, since the start
+  size_t allocs;
+  size_t frees;
+  size_t live_objects;
+  // bytes the callers asked for, of the live objects
+  size_t bytes_requested;
+  // bytes handed out for the live objects: bytes_allocated - bytes_requested
+  // is the internal fragmentation, canary and size trailer included
+  size_t bytes_allocated;
+  // bytes taken from the page source
+  size_t bytes_reserved;
+  size_t slabs_created;
+  size_t slabs_released;
+  size_t slabs_partial;
+  size_t slabs_full;
+  size_t slabs_empty;
+};
+
+struct mm_stats {
+  // number of entries used in classes
+  size_t classes_num;
+  struct mm_class_stats classes[STATS_CLASSES_NUM];
+  struct mm_class_stats large;
+  // sums of all classes and large
+  struct mm_class_stats total;
+};
+
+// slabs are counted by occupancy in buckets of equal width
+#define MM_FRAG_BUCKETS 10
+
+/**
+fragmentation of one slab cache, from a walk of its slabs. the bytes of its
+slabs add up as bytes_reserved = bytes_requested + bytes_padding +
+bytes_hardening + bytes_free + bytes_slab_overhead.
+*/
+struct mm_frag_class {
+  size_t object_size;
+  size_t slab_size;
+  size_t objects_per_slab;
+  size_t slabs;
+  size_t slabs_empty;
+  // slabs with objects in use, by occupancy: bucket i counts those with more
+  // than i / MM_FRAG_BUCKETS and at most (i + 1) / MM_FRAG_BUCKETS of their
+  // objects in use
+  size_t occupancy[MM_FRAG_BUCKETS];
+  size_t objects_live;
+  // bytes of all slabs
+  size_t bytes_reserved;
+  // bytes the callers asked for, of the live objects
+  size_t bytes_requested;
+  // what the live objects hold beyond the request and the hardening: the
+  // rounding up to the size class and to its alignment
+  size_t bytes_padding;
+  // canary and size trailer of the live objects
+  size_t bytes_hardening;
+  // free objects, in partial and empty slabs
+  size_t bytes_free;
+  // slab headers, freelists, colors and the tails after the last object
+  size_t bytes_slab_overhead;
+  // bytes given back if the live objects were packed into as few slabs as
+  // possible. the empty slabs among them are released by mm_trim, the others
+  // only once their objects are freed.
+  size_t bytes_reclaimable;
+};
+
+struct mm_frag_report {
+  // number of entries used in classes
+  size_t classes_num;
+  struct mm_frag_class classes[STATS_CLASSES_NUM];
+  // sums of all classes, with no object or slab size
+  struct mm_frag_class total;
+};
+
+/**
+a slab seen by mm_heap_walk.
+*/
+struct mm_heap_slab {
+  // index of its cache in the cache array
+  size_t cache_index;
+  struct slab *slab;
+  // the memory of the slab, its header included
+  void *start;
+  size_t size;
+  size_t objects_num;
+  // objects in use, those held by thread caches included
+  size_t objects_live;
+};
+
+typedef void (*mm_heap_slab_fn)(void *arg, const struct mm_heap_slab *slab);
+// size is what was asked for, see mm_usable_size
+typedef void (*mm_heap_object_fn)(void *arg, const struct mm_heap_slab *slab,
+                                  void *ptr, size_t size);
+
+enum mm_stats_format {
+  // one line per cache, for humans
+  MM_STATS_TEXT = 0,
+  // one JSON object, for metrics exporters
+  MM_STATS_JSON,
+};
+
+/**
+receives the text of a dump, possibly in several pieces.
+*/
+typedef void (*mm_stats_write_fn)(void *arg, const char *buf, size_t len);
+
+// index of the counters of large objects
+#define STATS_LARGE STATS_CLASSES_NUM
+// index counting nothing, for caches beyond STATS_CLASSES_NUM
+#define STATS_NONE (STATS_CLASSES_NUM + 1)
+
+/**
+count an allocation of size requested bytes from cache index cls (or
+STATS_LARGE) for the calling thread.
+*/
+void stats_count_alloc(size_t cls, size_t size);
+
+/**
+count a free of an object of size requested bytes.
+*/
+void stats_count_free(size_t cls, size_t size);
+
+/**
+count an object resized in place from old_size to new_size requested bytes.
+*/
+void stats_count_resize(size_t cls, size_t old_size, size_t new_size);
+
+/**
+add the counts of all threads to the allocs, frees, live_objects and
+bytes_requested of every class of stats and of its large entry.
+*/
+void stats_collect(struct mm_stats *stats);
+
+/**
+take and release the lock of the thread list, around fork().
+*/
+void stats_lock_all();
+
+void stats_unlock_all();
+
+/**
+write stats through write in the given format.
+*/
+void stats_format(const struct mm_stats *stats, enum mm_stats_format format,
+                  mm_stats_write_fn write, void *arg);
+
+/**
+write a fragmentation report through write in the given format.
+*/
+void stats_format_frag(const struct mm_frag_report *report,
+                       enum mm_stats_format format, mm_stats_write_fn write,
+                       void *arg);
+#endif
@@ -0,0 +1,58 @@
+/**
+thread cache: a per-thread layer in front of the slab caches.
+
+every thread keeps a small LIFO bin of free objects for each slab cache of the
+global cache array. most malloc/free pairs are served from the bin of the
+calling thread without touching shared state; an empty bin is refilled with a
+batch of objects from its slab cache, a full bin flushes a batch back.
+
+bins are indexed by the position of the slab cache in the cache array, so the
+cache array must not be reordered while thread caches are in use.
+*/
+#ifndef TCACHE_H
+#define TCACHE_H
+#include "utils.h"
+
+struct slab_cache;
+
+// max number of slab caches a thread cache has bins for
+#define TCACHE_BINS_NUM 64
+// max number of objects held by one bin
+#define TCACHE_BIN_CAP 32
+// number of objects moved between a bin and its slab cache at once
+#define TCACHE_BATCH 16
+
+// set in the low bit of a cached object known to be all zero, see
+// slab_cache_alloc_clean(). objects of the global caches are at least 8 byte
+// aligned, so the bit is free.
+#define TCACHE_CLEAN 1ULL
+
+struct tcache_bin {
+  int count;
+  void *objs[TCACHE_BIN_CAP];
+};
+
+struct tcache {
+  struct tcache_bin bins[TCACHE_BINS_NUM];
+};
+
+/**
+alloc an object of cache, which is cache_array[index], from the calling
+thread's cache. if clean is not NULL, *clean tells whether the object is known
+to be all zero.
+the ctor/dtor of the slab cache only run when objects move between a bin and
+the slab cache, so thread caches are meant for slab caches without them.
+*/
+void *tcache_alloc(struct slab_cache *cache, size_t index, bool *clean);
+
+/**
+put ptr, which belongs to cache_array[index], into the calling thread's cache.
+*/
+void tcache_free(size_t index, void *ptr);
+
+/**
+return all objects cached by the calling thread to their slab caches.
+this also happens automatically when the thread exits.
+*/
+void tcache_flush();
+#endif
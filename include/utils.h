@@ -1,4 +1,5 @@
 // typedef unsigned long long size_t;
+#include <stddef.h>
 
 #ifdef _DEBUG
 #include <stdio.h>
@@ -0,0 +1,53 @@
+// mmap page source of the benchmarks and libmm_preload: bulk_alloc straight
+// from mmap, which returns page-aligned, zero-filled memory as mm expects
+#include <stddef.h>
+#include <sys/mman.h>
+
+void *bulk_alloc(size_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+void bulk_free(void *ptr, size_t size) { munmap(ptr, size); }
+
+void *bulk_realloc(void *ptr, size_t old_size, size_t new_size, void *dest) {
+  void *new_ptr =
+      dest ? mremap(ptr, old_size, new_size, MREMAP_MAYMOVE | MREMAP_FIXED,
+                    dest)
+           : mremap(ptr, old_size, new_size, 0);
+  return new_ptr == MAP_FAILED ? NULL : new_ptr;
+}
+
+// 2 MB blocks for the slab regions, see region.h: explicit huge pages if the
+// system has some reserved, otherwise transparent ones asked for with madvise
+#define HUGE_BLOCK (2UL << 20)
+
+void *bulk_alloc_huge(size_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (ptr != MAP_FAILED) {
+    return ptr;
+  }
+  // map a block larger by the alignment and cut it down to an aligned one
+  char *raw = (char *)mmap(NULL, size + HUGE_BLOCK, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    return NULL;
+  }
+  char *block =
+      (char *)(((size_t)raw + HUGE_BLOCK - 1) & ~(HUGE_BLOCK - 1));
+  if (block > raw) {
+    munmap(raw, block - raw);
+  }
+  // the tail is never empty: block is at most HUGE_BLOCK - 1 bytes past raw
+  munmap(block + size, raw + HUGE_BLOCK - block);
+  madvise(block, size, MADV_HUGEPAGE);
+  return block;
+}
+
+void bulk_free_huge(void *ptr, size_t size) { munmap(ptr, size); }
+
+int bulk_protect(void *ptr, size_t size, bool accessible) {
+  return mprotect(ptr, size, accessible ? PROT_READ | PROT_WRITE : PROT_NONE);
+}
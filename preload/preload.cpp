@@ -0,0 +1,412 @@
+/**
+malloc replacement: LD_PRELOAD=libmm_preload.so runs an unmodified binary on
+mm. the allocation functions of libc and every operator new/delete are served
+by mm_malloc/mm_free, with the page source of pages/pages.cpp.
+
+environment:
+- MM_SHARDS=n: give the slab caches n per-cpu shards, see mm_set_shards_num().
+- MM_HUGEPAGES=1: carve the slabs out of huge page regions, see
+  mm_set_hugepages().
+- MM_FREELIST=index, linked or bitmap: the freelist of the slab caches, see
+  mm_set_freelist().
+- MM_GUARDED=n: serve about one in n allocations from the guarded pool, see
+  mm_set_guarded_sample_rate().
+- MM_PROFILE=n: sample the heap about every n bytes, see
+  mm_set_profile_rate(), and write the profile to MM_PROFILE_FILE, or
+  mm.<pid>.heap, at exit.
+- MM_STATS=text or MM_STATS=json: dump the statistics to stderr at exit.
+- MM_FRAG=text or MM_FRAG=json: dump the fragmentation report to stderr at
+  exit.
+*/
+#include "memops.h"
+#include "mm.h"
+#include "pagemap.h"
+#include "spinlock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <new>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NULPTR ((void *)0)
+// what malloc guarantees: enough for any fundamental type
+#define PRELOAD_ALIGNMENT 16
+#define ALIGN_UP(v, alignment) (((v) + (alignment) - 1) & ~((alignment) - 1))
+
+/**
+bootstrap heap: allocations made while the allocator sets itself up, e.g. by
+pthread_atfork, must not recurse into it. they are served from a static buffer
+and never freed. the size of a chunk is stored right before it.
+*/
+#define BOOT_HEAP_SIZE (64 * 1024)
+alignas(PAGE_SIZE) static char boot_heap[BOOT_HEAP_SIZE];
+static size_t boot_used;
+
+static void *boot_alloc(size_t size, size_t alignment) {
+  if (size > BOOT_HEAP_SIZE || alignment > PAGE_SIZE) {
+    return NULPTR;
+  }
+  size_t start;
+  size_t used = __atomic_load_n(&boot_used, __ATOMIC_RELAXED);
+  do {
+    start = ALIGN_UP(used + sizeof(size_t), alignment);
+    if (start + size > BOOT_HEAP_SIZE) {
+      return NULPTR;
+    }
+  } while (!__atomic_compare_exchange_n(&boot_used, &used, start + size, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  // the buffer is static, so the chunk is zero like calloc wants it
+  *(size_t *)(boot_heap + start - sizeof(size_t)) = size;
+  return boot_heap + start;
+}
+
+static inline bool boot_owns(const void *ptr) {
+  return (const char *)ptr >= boot_heap &&
+         (const char *)ptr < boot_heap + BOOT_HEAP_SIZE;
+}
+
+static size_t boot_size(const void *ptr) {
+  return *(const size_t *)((const char *)ptr - sizeof(size_t));
+}
+
+enum preload_state {
+  PRELOAD_UNINIT = 0,
+  // being set up: allocations go to the bootstrap heap
+  PRELOAD_INITING,
+  PRELOAD_READY,
+};
+static int preload_state;
+
+static void preload_init() {
+  const char *shards = getenv("MM_SHARDS");
+  if (shards) {
+    mm_set_shards_num(strtoul(shards, (char **)NULPTR, 10));
+  }
+  const char *freelist = getenv("MM_FREELIST");
+  if (freelist && strcmp(freelist, "index") == 0) {
+    mm_set_freelist(SLAB_FREELIST_INDEX);
+  } else if (freelist && strcmp(freelist, "bitmap") == 0) {
+    mm_set_freelist(SLAB_FREELIST_BITMAP);
+  }
+  const char *guarded = getenv("MM_GUARDED");
+  if (guarded) {
+    mm_set_guarded_sample_rate(strtoul(guarded, (char **)NULPTR, 10));
+  }
+  const char *profile = getenv("MM_PROFILE");
+  if (profile) {
+    mm_set_profile_rate(strtoul(profile, (char **)NULPTR, 10));
+  }
+  const char *hugepages = getenv("MM_HUGEPAGES");
+  if (hugepages && strcmp(hugepages, "0") != 0) {
+    mm_set_hugepages(true);
+  }
+  // set up the global caches before anything can fork
+  mm_free(mm_malloc(1, 1));
+  pthread_atfork(mm_prefork, mm_postfork, mm_postfork);
+  __atomic_store_n(&preload_state, PRELOAD_READY, __ATOMIC_RELEASE);
+}
+
+/**
+check whether mm can serve the calling thread, setting it up on the first
+call. while it is being set up, by this thread or another one, the bootstrap
+heap is used instead of waiting: the thread setting it up may need a lock the
+caller holds.
+*/
+static inline bool preload_ready() {
+  if (__builtin_expect(__atomic_load_n(&preload_state, __ATOMIC_ACQUIRE) ==
+                           PRELOAD_READY,
+                       1)) {
+    return true;
+  }
+  int expected = PRELOAD_UNINIT;
+  if (!__atomic_compare_exchange_n(&preload_state, &expected, PRELOAD_INITING,
+                                   false, __ATOMIC_ACQUIRE,
+                                   __ATOMIC_ACQUIRE)) {
+    return expected == PRELOAD_READY;
+  }
+  preload_init();
+  return true;
+}
+
+static void *preload_alloc(size_t size, size_t alignment) {
+  if (alignment < PRELOAD_ALIGNMENT) {
+    alignment = PRELOAD_ALIGNMENT;
+  }
+  void *ptr = preload_ready() ? mm_malloc(size, alignment)
+                              : boot_alloc(size, alignment);
+  if (ptr == NULPTR) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+static void preload_free(void *ptr) {
+  if (ptr == NULPTR || boot_owns(ptr)) {
+    return;
+  }
+  mm_free(ptr);
+}
+
+static inline bool is_power_of_2(size_t v) { return v && !(v & (v - 1)); }
+
+extern "C" {
+void *malloc(size_t size) noexcept {
+  return preload_alloc(size, PRELOAD_ALIGNMENT);
+}
+
+void free(void *ptr) noexcept { preload_free(ptr); }
+
+void *calloc(size_t num, size_t size) noexcept {
+  if (!preload_ready()) {
+    if (size && num > ~(size_t)0 / size) {
+      errno = ENOMEM;
+      return NULPTR;
+    }
+    return preload_alloc(num * size, PRELOAD_ALIGNMENT);
+  }
+  void *ptr = mm_calloc(num, size, PRELOAD_ALIGNMENT);
+  if (ptr == NULPTR) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+  if (ptr == NULPTR) {
+    return preload_alloc(size, PRELOAD_ALIGNMENT);
+  }
+  if (size == 0) {
+    // like glibc: free and return NULL
+    preload_free(ptr);
+    return NULPTR;
+  }
+  if (boot_owns(ptr)) {
+    void *new_ptr = preload_alloc(size, PRELOAD_ALIGNMENT);
+    if (new_ptr) {
+      size_t old_size = boot_size(ptr);
+      mm_memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    }
+    return new_ptr;
+  }
+  void *new_ptr = mm_realloc(ptr, size, PRELOAD_ALIGNMENT);
+  if (new_ptr == NULPTR) {
+    errno = ENOMEM;
+  }
+  return new_ptr;
+}
+
+void *reallocarray(void *ptr, size_t num, size_t size) noexcept {
+  if (size && num > ~(size_t)0 / size) {
+    errno = ENOMEM;
+    return NULPTR;
+  }
+  return realloc(ptr, num * size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) noexcept {
+  if (alignment < sizeof(void *) || !is_power_of_2(alignment)) {
+    return EINVAL;
+  }
+  // posix_memalign reports errors only through its return value
+  int saved_errno = errno;
+  void *ptr = preload_alloc(size, alignment);
+  errno = saved_errno;
+  if (ptr == NULPTR) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+  if (!is_power_of_2(alignment)) {
+    errno = EINVAL;
+    return NULPTR;
+  }
+  return preload_alloc(size, alignment);
+}
+
+void *memalign(size_t alignment, size_t size) noexcept {
+  // like glibc: any other alignment is rounded up to the next power of 2
+  if (!is_power_of_2(alignment) && alignment > PRELOAD_ALIGNMENT) {
+    if (alignment > (~(size_t)0 >> 1) + 1) {
+      errno = EINVAL;
+      return NULPTR;
+    }
+    size_t rounded = PRELOAD_ALIGNMENT;
+    while (rounded < alignment) {
+      rounded <<= 1;
+    }
+    alignment = rounded;
+  }
+  return preload_alloc(size, alignment);
+}
+
+void *valloc(size_t size) noexcept { return preload_alloc(size, PAGE_SIZE); }
+
+void *pvalloc(size_t size) noexcept {
+  // rounding up would wrap around to a small size
+  if (size > ~(size_t)0 - PAGE_SIZE) {
+    errno = ENOMEM;
+    return NULPTR;
+  }
+  return preload_alloc(ALIGN_UP(size, PAGE_SIZE), PAGE_SIZE);
+}
+
+size_t malloc_usable_size(void *ptr) noexcept {
+  if (ptr == NULPTR) {
+    return 0;
+  }
+  if (boot_owns(ptr)) {
+    return boot_size(ptr);
+  }
+  return mm_usable_size(ptr);
+}
+}
+
+/**
+operator new: retry through the new handler, and throw std::bad_alloc when
+there is none.
+*/
+static void *preload_new(size_t size, size_t alignment) {
+  for (;;) {
+    void *ptr = preload_alloc(size, alignment);
+    if (ptr) {
+      return ptr;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (!handler) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+static void *preload_new_nothrow(size_t size, size_t alignment) noexcept {
+  try {
+    return preload_new(size, alignment);
+  } catch (...) {
+    return NULPTR;
+  }
+}
+
+void *operator new(size_t size) { return preload_new(size, PRELOAD_ALIGNMENT); }
+
+void *operator new[](size_t size) {
+  return preload_new(size, PRELOAD_ALIGNMENT);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return preload_new_nothrow(size, PRELOAD_ALIGNMENT);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return preload_new_nothrow(size, PRELOAD_ALIGNMENT);
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  return preload_new(size, (size_t)alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return preload_new(size, (size_t)alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return preload_new_nothrow(size, (size_t)alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return preload_new_nothrow(size, (size_t)alignment);
+}
+
+// the page map finds the owner of any object, so the size and alignment given
+// to the sized and aligned forms are not needed
+void operator delete(void *ptr) noexcept { preload_free(ptr); }
+
+void operator delete[](void *ptr) noexcept { preload_free(ptr); }
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  preload_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  preload_free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept { preload_free(ptr); }
+
+void operator delete[](void *ptr, size_t) noexcept { preload_free(ptr); }
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+  preload_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  preload_free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+  preload_free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+  preload_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  preload_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  preload_free(ptr);
+}
+
+// arg points to the file descriptor to write to
+static void stats_write(void *arg, const char *buf, size_t len) {
+  int fd = *(int *)arg;
+  while (len) {
+    ssize_t written = write(fd, buf, len);
+    if (written <= 0) {
+      return;
+    }
+    buf += written;
+    len -= written;
+  }
+}
+
+__attribute__((destructor)) static void preload_exit() {
+  const char *profile = getenv("MM_PROFILE");
+  if (profile) {
+    char name[64];
+    const char *path = getenv("MM_PROFILE_FILE");
+    if (path == NULPTR) {
+      snprintf(name, sizeof(name), "mm.%d.heap", (int)getpid());
+      path = name;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+      mm_profile_dump(stats_write, &fd);
+      close(fd);
+    }
+  }
+  int fd = STDERR_FILENO;
+  const char *format = getenv("MM_STATS");
+  if (format) {
+    mm_stats_dump(strcmp(format, "json") == 0 ? MM_STATS_JSON : MM_STATS_TEXT,
+                  stats_write, &fd);
+  }
+  format = getenv("MM_FRAG");
+  if (format) {
+    mm_frag_dump(strcmp(format, "json") == 0 ? MM_STATS_JSON : MM_STATS_TEXT,
+                 stats_write, &fd);
+  }
+}
@@ -0,0 +1,176 @@
+#include "arena.h"
+#include "mm.h"
+#include "pagemap.h"
+
+#define NULPTR ((void *)0)
+#define ALIGN_UP(v, alignment) (((v) + (alignment) - 1) & ~((alignment) - 1))
+extern void *bulk_alloc(size_t size);
+extern void bulk_free(void *ptr, size_t size);
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+void mm_arena_init(struct mm_arena *arena, size_t chunk_size,
+                   bool oversize_fallback)
+#else
+void mm_arena_init(struct mm_arena *arena, size_t chunk_size,
+                   bool oversize_fallback, struct slab_cache *cache_array,
+                   size_t cache_array_size)
+#endif
+{
+  if (chunk_size == 0) {
+    chunk_size = ARENA_CHUNK_SIZE_DEFAULT;
+  }
+  arena->chunk = (struct arena_chunk *)NULPTR;
+  arena->first = (struct arena_chunk *)NULPTR;
+  arena->spare = (struct arena_chunk *)NULPTR;
+  arena->cur = (char *)NULPTR;
+  arena->end = (char *)NULPTR;
+  arena->oversize = (struct arena_oversize *)NULPTR;
+  arena->chunk_size = ALIGN_UP(chunk_size, PAGE_SIZE);
+  arena->oversize_fallback = oversize_fallback;
+  arena->mapped_bytes = 0;
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+  arena->cache_array = cache_array;
+  arena->cache_array_size = cache_array_size;
+#endif
+}
+
+static void arena_free_oversize(struct mm_arena *arena,
+                                struct arena_oversize *until) {
+  while (arena->oversize != until) {
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+    mm_free(arena->oversize->ptr);
+#else
+    mm_free(arena->oversize->ptr, arena->cache_array, arena->cache_array_size);
+#endif
+    arena->oversize = arena->oversize->prev;
+  }
+}
+
+/**
+get a chunk with at least size bytes: the first spare chunk if it is large
+enough, a new one from bulk_alloc otherwise.
+*/
+static struct arena_chunk *arena_chunk_get(struct mm_arena *arena,
+                                           size_t size) {
+  struct arena_chunk *chunk = arena->spare;
+  if (chunk != NULPTR && chunk->size >= size) {
+    arena->spare = chunk->prev;
+    return chunk;
+  }
+  size_t map_size = ALIGN_UP(size, PAGE_SIZE);
+  if (map_size < arena->chunk_size) {
+    map_size = arena->chunk_size;
+  }
+  chunk = (struct arena_chunk *)bulk_alloc(map_size);
+  if (chunk == NULPTR) {
+    LOG("mm_arena: failed to map a chunk of %zu bytes.\n", map_size);
+    return (struct arena_chunk *)NULPTR;
+  }
+  chunk->size = map_size;
+  arena->mapped_bytes += map_size;
+  return chunk;
+}
+
+static void *arena_alloc_oversize(struct mm_arena *arena, size_t size,
+                                  size_t alignment) {
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  void *ptr = mm_malloc(size, alignment);
+#else
+  void *ptr = mm_malloc(size, alignment, arena->cache_array,
+                        arena->cache_array_size);
+#endif
+  if (ptr == NULPTR) {
+    return NULPTR;
+  }
+  // the list node lives in the arena, so it goes away with the object
+  struct arena_oversize *node = (struct arena_oversize *)mm_arena_alloc(
+      arena, sizeof(struct arena_oversize), alignof(struct arena_oversize));
+  if (node == NULPTR) {
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+    mm_free(ptr);
+#else
+    mm_free(ptr, arena->cache_array, arena->cache_array_size);
+#endif
+    return NULPTR;
+  }
+  node->ptr = ptr;
+  node->prev = arena->oversize;
+  arena->oversize = node;
+  return ptr;
+}
+
+void *mm_arena_alloc_slow(struct mm_arena *arena, size_t size,
+                          size_t alignment) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    LOG("mm_arena: alignment %zu is not a power of two.\n", alignment);
+    return NULPTR;
+  }
+  if (size == 0) {
+    // a unique pointer, like mm_malloc gives
+    return mm_arena_alloc(arena, 1, alignment);
+  }
+  size_t space = arena->chunk_size - sizeof(struct arena_chunk);
+  if (arena->oversize_fallback && size > space / ARENA_OVERSIZE_FRACTION) {
+    return arena_alloc_oversize(arena, size, alignment);
+  }
+  if (size > ~(size_t)0 - sizeof(struct arena_chunk) - alignment - PAGE_SIZE) {
+    return NULPTR;
+  }
+  struct arena_chunk *chunk =
+      arena_chunk_get(arena, sizeof(struct arena_chunk) + alignment - 1 + size);
+  if (chunk == NULPTR) {
+    return NULPTR;
+  }
+  // what is left in the current chunk is given up
+  chunk->prev = arena->chunk;
+  arena->chunk = chunk;
+  if (arena->first == NULPTR) {
+    arena->first = chunk;
+  }
+  arena->cur = (char *)(chunk + 1);
+  arena->end = (char *)chunk + chunk->size;
+  return mm_arena_alloc(arena, size, alignment);
+}
+
+void mm_arena_reset(struct mm_arena *arena) {
+  arena_free_oversize(arena, (struct arena_oversize *)NULPTR);
+  if (arena->chunk != NULPTR) {
+    arena->first->prev = arena->spare;
+    arena->spare = arena->chunk;
+  }
+  arena->chunk = (struct arena_chunk *)NULPTR;
+  arena->first = (struct arena_chunk *)NULPTR;
+  arena->cur = (char *)NULPTR;
+  arena->end = (char *)NULPTR;
+}
+
+void mm_arena_restore(struct mm_arena *arena,
+                      const struct mm_arena_savepoint *savepoint) {
+  if (savepoint->chunk == NULPTR) {
+    mm_arena_reset(arena);
+    return;
+  }
+  arena_free_oversize(arena, savepoint->oversize);
+  if (arena->chunk != savepoint->chunk) {
+    // move the chunks filled since to the spare list
+    struct arena_chunk *oldest = arena->chunk;
+    while (oldest->prev != savepoint->chunk) {
+      oldest = oldest->prev;
+    }
+    oldest->prev = arena->spare;
+    arena->spare = arena->chunk;
+    arena->chunk = savepoint->chunk;
+    arena->end = (char *)savepoint->chunk + savepoint->chunk->size;
+  }
+  arena->cur = savepoint->cur;
+}
+
+void mm_arena_destroy(struct mm_arena *arena) {
+  mm_arena_reset(arena);
+  while (arena->spare != NULPTR) {
+    struct arena_chunk *chunk = arena->spare;
+    arena->spare = chunk->prev;
+    bulk_free(chunk, chunk->size);
+  }
+  arena->mapped_bytes = 0;
+}
@@ -0,0 +1,366 @@
+#include "guarded.h"
+#include "spinlock.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <unwind.h>
+
+#define NULPTR ((void *)0)
+// temp code
+extern void *bulk_alloc(size_t size);
+extern void bulk_free(void *ptr, size_t size);
+// bulk_protect makes the pages [ptr, ptr + size) of a bulk_alloc block
+// accessible or not, returning 0 on success. a page source that can not do it
+// need not define it.
+extern int bulk_protect(void *ptr, size_t size, bool accessible)
+    __attribute__((weak));
+
+// fills the bytes between an object and the end of its slot
+#define GUARDED_TAIL_BYTE 0xab
+// allocations between two looks at the sample rate while sampling is off
+#define GUARDED_RECHECK 4096
+
+enum guarded_pool_state {
+  GUARDED_POOL_UNINIT = 0,
+  GUARDED_POOL_READY,
+  // the page source can not protect pages, or is out of memory
+  GUARDED_POOL_FAILED,
+};
+
+char *guarded_pool_base;
+
+static struct {
+  struct guarded_slot *slots;
+  // slots never used so far are taken in order from next_unused, freed ones
+  // from a FIFO ring
+  size_t next_unused;
+  size_t ring[GUARDED_SLOTS_NUM];
+  size_t ring_head;
+  size_t ring_num;
+  struct guarded_stats stats;
+  int state;
+  struct spinlock lock;
+} guarded_pool = {};
+
+static size_t guarded_rate;
+__thread size_t guarded_countdown __attribute__((tls_model("initial-exec")));
+static __thread unsigned long long guarded_rng
+    __attribute__((tls_model("initial-exec")));
+static struct sigaction guarded_prev_action;
+
+static inline char *guarded_slot_page(size_t index) {
+  return guarded_pool_base + (2 * index + 1) * PAGE_SIZE;
+}
+
+void guarded_set_sample_rate(size_t rate) {
+  __atomic_store_n(&guarded_rate, rate, __ATOMIC_RELAXED);
+}
+
+// xorshift64, seeded per thread
+static unsigned long long guarded_random() {
+  if (guarded_rng == 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    guarded_rng = ((unsigned long long)ts.tv_nsec << 20) ^
+                  (unsigned long long)&guarded_rng ^ 0x9e3779b97f4a7c15ULL;
+  }
+  guarded_rng ^= guarded_rng << 13;
+  guarded_rng ^= guarded_rng >> 7;
+  guarded_rng ^= guarded_rng << 17;
+  return guarded_rng;
+}
+
+bool guarded_sample_slow() {
+  size_t rate = __atomic_load_n(&guarded_rate, __ATOMIC_RELAXED);
+  if (rate == 0) {
+    guarded_countdown = GUARDED_RECHECK;
+    return false;
+  }
+  // a new thread only draws its first countdown
+  bool first = guarded_countdown == 0;
+  // uniform in [1, 2 * rate - 1]: one in rate allocations on average
+  guarded_countdown = 1 + guarded_random() % (2 * rate - 1);
+  return !first;
+}
+
+/**
+async-signal-safe output for the reports: write(2) only.
+*/
+static void guarded_print(const char *str) {
+  size_t len = 0;
+  while (str[len]) {
+    len++;
+  }
+  ssize_t written = write(STDERR_FILENO, str, len);
+  (void)written;
+}
+
+static void guarded_print_num(unsigned long long value, unsigned int base) {
+  char buf[24];
+  size_t pos = sizeof(buf);
+  buf[--pos] = '\0';
+  do {
+    buf[--pos] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value);
+  if (base == 16) {
+    buf[--pos] = 'x';
+    buf[--pos] = '0';
+  }
+  guarded_print(buf + pos);
+}
+
+static void guarded_print_stack(const char *title,
+                                const struct guarded_stack *stack) {
+  guarded_print(title);
+  for (size_t i = 0; i < stack->depth; i++) {
+    guarded_print("    #");
+    guarded_print_num(i, 10);
+    guarded_print(" ");
+    guarded_print_num((unsigned long long)stack->frames[i], 16);
+    guarded_print("\n");
+  }
+}
+
+static void guarded_report(const char *what, const void *addr,
+                           struct guarded_slot *slot) {
+  guarded_print("mm: guarded: ");
+  guarded_print(what);
+  guarded_print(" at ");
+  guarded_print_num((unsigned long long)addr, 16);
+  if (slot && slot->state != GUARDED_SLOT_UNUSED) {
+    long long offset = (long long)((unsigned long long)addr -
+                                   (unsigned long long)slot->ptr);
+    guarded_print(", ");
+    if (offset < 0) {
+      guarded_print_num(-offset, 10);
+      guarded_print(" bytes before");
+    } else if ((unsigned long long)offset >= slot->size) {
+      guarded_print_num(offset - slot->size, 10);
+      guarded_print(" bytes past");
+    } else {
+      guarded_print_num(offset, 10);
+      guarded_print(" bytes into");
+    }
+    guarded_print(" the ");
+    guarded_print_num(slot->size, 10);
+    guarded_print("-byte object at ");
+    guarded_print_num((unsigned long long)slot->ptr, 16);
+    guarded_print("\n");
+    guarded_print_stack("  allocated at:\n", &slot->alloc_stack);
+    if (slot->state == GUARDED_SLOT_FREED) {
+      guarded_print_stack("  freed at:\n", &slot->free_stack);
+    }
+  } else {
+    guarded_print("\n");
+  }
+}
+
+/**
+find the slot an access to addr in the pool was meant for: the slot itself if
+addr is in one, otherwise the neighbour closer to addr in its guard page.
+*/
+static struct guarded_slot *guarded_slot_near(const void *addr,
+                                              const char **what) {
+  size_t offset =
+      (unsigned long long)addr - (unsigned long long)guarded_pool_base;
+  size_t page = offset / PAGE_SIZE;
+  if (page % 2) {
+    struct guarded_slot *slot = &guarded_pool.slots[page / 2];
+    *what = slot->state == GUARDED_SLOT_FREED ? "use-after-free"
+                                              : "wild access";
+    return slot;
+  }
+  *what = "heap-buffer-overflow";
+  bool left = offset % PAGE_SIZE < PAGE_SIZE / 2;
+  if ((left && page > 0) || page / 2 == GUARDED_SLOTS_NUM) {
+    return &guarded_pool.slots[page / 2 - 1];
+  }
+  if (page / 2 < GUARDED_SLOTS_NUM) {
+    return &guarded_pool.slots[page / 2];
+  }
+  return (struct guarded_slot *)NULPTR;
+}
+
+static void guarded_on_fault(int sig, siginfo_t *info, void *context) {
+  if (guarded_owns(info->si_addr)) {
+    const char *what;
+    struct guarded_slot *slot = guarded_slot_near(info->si_addr, &what);
+    guarded_report(what, info->si_addr, slot);
+  } else if (guarded_prev_action.sa_flags & SA_SIGINFO) {
+    guarded_prev_action.sa_sigaction(sig, info, context);
+    return;
+  } else if (guarded_prev_action.sa_handler != SIG_DFL &&
+             guarded_prev_action.sa_handler != SIG_IGN) {
+    guarded_prev_action.sa_handler(sig);
+    return;
+  }
+  // returning faults again, now with the handler the process had before
+  sigaction(SIGSEGV, &guarded_prev_action, (struct sigaction *)NULPTR);
+}
+
+// set the pool up. the caller holds its lock.
+static void guarded_pool_init() {
+  guarded_pool.state = GUARDED_POOL_FAILED;
+  if (!bulk_protect) {
+    return;
+  }
+  char *base = (char *)bulk_alloc(GUARDED_POOL_SIZE);
+  if (base == NULPTR) {
+    return;
+  }
+  struct guarded_slot *slots = (struct guarded_slot *)bulk_alloc(
+      sizeof(struct guarded_slot) * GUARDED_SLOTS_NUM);
+  if (slots == NULPTR || bulk_protect(base, GUARDED_POOL_SIZE, false) != 0) {
+    if (slots) {
+      bulk_free(slots, sizeof(struct guarded_slot) * GUARDED_SLOTS_NUM);
+    }
+    bulk_free(base, GUARDED_POOL_SIZE);
+    return;
+  }
+  guarded_pool.slots = slots;
+  __atomic_store_n(&guarded_pool_base, base, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < GUARDED_SLOTS_NUM; i++) {
+    if (pagemap_set(guarded_slot_page(i), PAGE_SIZE,
+                    PAGEMAP_OWNER_MAKE(&slots[i], PAGEMAP_GUARDED)) != 0) {
+      // the pool stays reserved, its registered slots are simply not used
+      return;
+    }
+  }
+  struct sigaction action = {};
+  action.sa_sigaction = guarded_on_fault;
+  action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &guarded_prev_action);
+  guarded_pool.state = GUARDED_POOL_READY;
+}
+
+struct guarded_unwind {
+  struct guarded_stack *stack;
+  // frames of the allocator itself to leave out
+  size_t skip;
+};
+
+static _Unwind_Reason_Code guarded_unwind_frame(struct _Unwind_Context *ctx,
+                                                void *arg) {
+  struct guarded_unwind *unwind = (struct guarded_unwind *)arg;
+  if (unwind->skip) {
+    unwind->skip--;
+    return _URC_NO_REASON;
+  }
+  struct guarded_stack *stack = unwind->stack;
+  if (stack->depth == GUARDED_STACK_DEPTH) {
+    return _URC_END_OF_STACK;
+  }
+  stack->frames[stack->depth++] = (void *)_Unwind_GetIP(ctx);
+  return _URC_NO_REASON;
+}
+
+static void guarded_capture(struct guarded_stack *stack) {
+  // this function and guarded_alloc or guarded_free
+  struct guarded_unwind unwind = {stack, 2};
+  stack->depth = 0;
+  _Unwind_Backtrace(guarded_unwind_frame, &unwind);
+}
+
+void *guarded_alloc(size_t size, size_t alignment) {
+  if (alignment == 0) {
+    alignment = 1;
+  }
+  if (size > GUARDED_SIZE_MAX || alignment > PAGE_SIZE) {
+    __atomic_fetch_add(&guarded_pool.stats.misses, 1, __ATOMIC_RELAXED);
+    return NULPTR;
+  }
+  spin_lock(&guarded_pool.lock);
+  if (guarded_pool.state == GUARDED_POOL_UNINIT) {
+    guarded_pool_init();
+  }
+  size_t index;
+  if (guarded_pool.state != GUARDED_POOL_READY) {
+    spin_unlock(&guarded_pool.lock);
+    return NULPTR;
+  }
+  if (guarded_pool.next_unused < GUARDED_SLOTS_NUM) {
+    index = guarded_pool.next_unused++;
+  } else if (guarded_pool.ring_num) {
+    index = guarded_pool.ring[guarded_pool.ring_head];
+    guarded_pool.ring_head = (guarded_pool.ring_head + 1) % GUARDED_SLOTS_NUM;
+    guarded_pool.ring_num--;
+  } else {
+    spin_unlock(&guarded_pool.lock);
+    __atomic_fetch_add(&guarded_pool.stats.misses, 1, __ATOMIC_RELAXED);
+    return NULPTR;
+  }
+  guarded_pool.stats.allocs++;
+  guarded_pool.stats.live++;
+  spin_unlock(&guarded_pool.lock);
+
+  struct guarded_slot *slot = &guarded_pool.slots[index];
+  char *page = guarded_slot_page(index);
+  bulk_protect(page, PAGE_SIZE, true);
+  // against the guard page that follows, as far as the alignment allows. an
+  // empty object takes a byte, so that it still lies in its slot.
+  char *ptr = (char *)((unsigned long long)(page + PAGE_SIZE -
+                                            (size ? size : 1)) &
+                       ~(unsigned long long)(alignment - 1));
+  for (char *tail = ptr + size; tail < page + PAGE_SIZE; tail++) {
+    *tail = (char)GUARDED_TAIL_BYTE;
+  }
+  slot->ptr = ptr;
+  slot->size = size;
+  guarded_capture(&slot->alloc_stack);
+  slot->free_stack.depth = 0;
+  __atomic_store_n(&slot->state, GUARDED_SLOT_LIVE, __ATOMIC_RELEASE);
+  return ptr;
+}
+
+struct guarded_slot *guarded_of(const void *ptr) {
+  void *owner = pagemap_get(ptr);
+  if (owner == NULPTR || PAGEMAP_OWNER_KIND(owner) != PAGEMAP_GUARDED) {
+    return (struct guarded_slot *)NULPTR;
+  }
+  return (struct guarded_slot *)PAGEMAP_OWNER_PTR(owner);
+}
+
+void guarded_free(struct guarded_slot *slot, void *ptr) {
+  if (ptr != slot->ptr || slot->state == GUARDED_SLOT_UNUSED) {
+    guarded_report("invalid free", ptr, slot);
+    abort();
+  }
+  enum guarded_slot_state live = GUARDED_SLOT_LIVE;
+  // of two threads freeing the object at once, the second one reports it
+  if (!__atomic_compare_exchange_n(&slot->state, &live, GUARDED_SLOT_FREED,
+                                   false, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    guarded_report("double free", ptr, slot);
+    abort();
+  }
+  size_t index = slot - guarded_pool.slots;
+  char *page = guarded_slot_page(index);
+  for (char *tail = (char *)ptr + slot->size; tail < page + PAGE_SIZE;
+       tail++) {
+    if (*tail != (char)GUARDED_TAIL_BYTE) {
+      guarded_report("heap-buffer-overflow", tail, slot);
+      abort();
+    }
+  }
+  guarded_capture(&slot->free_stack);
+  bulk_protect(page, PAGE_SIZE, false);
+  spin_lock(&guarded_pool.lock);
+  guarded_pool.ring[(guarded_pool.ring_head + guarded_pool.ring_num) %
+                    GUARDED_SLOTS_NUM] = index;
+  guarded_pool.ring_num++;
+  guarded_pool.stats.live--;
+  spin_unlock(&guarded_pool.lock);
+}
+
+void guarded_get_stats(struct guarded_stats *stats) {
+  spin_lock(&guarded_pool.lock);
+  *stats = guarded_pool.stats;
+  spin_unlock(&guarded_pool.lock);
+}
+
+void guarded_lock() { spin_lock(&guarded_pool.lock); }
+
+void guarded_unlock() { spin_unlock(&guarded_pool.lock); }
@@ -0,0 +1,147 @@
+#include "large.h"
+#include "memops.h"
+#include "pagemap.h"
+
+#define NULPTR ((void *)0)
+#define ALIGN_UP(v, alignment) (((v) + (alignment) - 1) & ~((alignment) - 1))
+// temp code
+// bulk_alloc must return memory aligned to PAGE_SIZE, see pagemap.h.
+// bulk_realloc resizes a mapping from bulk_alloc. with dest NULL it must not
+// move it; otherwise it moves the pages onto dest, a mapping of new_size bytes
+// from bulk_alloc that they replace. it returns the resized mapping, or NULL
+// (leaving both mappings untouched) if it fails.
+extern void *bulk_alloc(size_t size);
+extern void bulk_free(void *ptr, size_t size);
+extern void *bulk_realloc(void *ptr, size_t old_size, size_t new_size,
+                          void *dest);
+
+// number of live large objects and bytes mapped for them
+static size_t large_blocks_num;
+static size_t large_mapped_bytes;
+
+/**
+get the offset of an object from the start of its mapping: right after the
+block header, aligned. bulk_alloc only guarantees PAGE_SIZE alignment, so
+larger alignments reserve room to align the object at runtime.
+*/
+static size_t large_offset_max(size_t alignment) {
+  if (alignment <= PAGE_SIZE) {
+    return ALIGN_UP(sizeof(struct large_block), alignment);
+  }
+  return sizeof(struct large_block) + alignment - 1;
+}
+
+static void *large_object(struct large_block *block) {
+  return (void *)((unsigned long long)block + block->offset);
+}
+
+void *large_alloc(size_t size, size_t alignment) {
+  if (alignment < sizeof(void *)) {
+    alignment = sizeof(void *);
+  }
+  size_t offset_max = large_offset_max(alignment);
+  if (size > ~(size_t)0 - offset_max - PAGE_SIZE) {
+    return NULPTR;
+  }
+  size_t map_size = ALIGN_UP(offset_max + size, PAGE_SIZE);
+  struct large_block *block = (struct large_block *)bulk_alloc(map_size);
+  if (block == NULPTR) {
+    return NULPTR;
+  }
+  void *object = (void *)ALIGN_UP((unsigned long long)block +
+                                      sizeof(struct large_block),
+                                  alignment);
+  block->map_size = map_size;
+  block->size = size;
+  block->alignment = alignment;
+  block->offset = (unsigned long long)object - (unsigned long long)block;
+  // only the page of the first byte is registered, which is the one free()
+  // gets a pointer into
+  if (pagemap_set(object, 1, PAGEMAP_OWNER_MAKE(block, PAGEMAP_LARGE)) != 0) {
+    bulk_free(block, map_size);
+    return NULPTR;
+  }
+  __atomic_fetch_add(&large_blocks_num, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&large_mapped_bytes, map_size, __ATOMIC_RELAXED);
+  return object;
+}
+
+struct large_block *large_of(const void *ptr) {
+  void *owner = pagemap_get(ptr);
+  if (owner == NULPTR || PAGEMAP_OWNER_KIND(owner) != PAGEMAP_LARGE) {
+    return (struct large_block *)NULPTR;
+  }
+  return (struct large_block *)PAGEMAP_OWNER_PTR(owner);
+}
+
+void large_free(void *ptr) {
+  struct large_block *block = large_of(ptr);
+  if (block == NULPTR) {
+    LOG("large_free: %p is not a large object.\n", ptr);
+    return;
+  }
+  pagemap_set(ptr, 1, NULPTR);
+  __atomic_fetch_sub(&large_blocks_num, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_sub(&large_mapped_bytes, block->map_size, __ATOMIC_RELAXED);
+  bulk_free(block, block->map_size);
+}
+
+void large_get_stats(size_t *blocks_num, size_t *mapped_bytes) {
+  *blocks_num = __atomic_load_n(&large_blocks_num, __ATOMIC_RELAXED);
+  *mapped_bytes = __atomic_load_n(&large_mapped_bytes, __ATOMIC_RELAXED);
+}
+
+void *large_realloc(void *ptr, size_t size) {
+  struct large_block *block = large_of(ptr);
+  if (block == NULPTR) {
+    return NULPTR;
+  }
+  if (block->alignment > PAGE_SIZE) {
+    // moved pages keep the offset only modulo PAGE_SIZE, so the object could
+    // lose its alignment: allocate and copy instead
+    void *new_ptr = large_alloc(size, block->alignment);
+    if (new_ptr == NULPTR) {
+      return NULPTR;
+    }
+    size_t copy_size = size < block->size ? size : block->size;
+    mm_memcpy(new_ptr, ptr, copy_size);
+    large_free(ptr);
+    return new_ptr;
+  }
+  if (size > ~(size_t)0 - block->offset - PAGE_SIZE) {
+    return NULPTR;
+  }
+  size_t map_size = ALIGN_UP(block->offset + size, PAGE_SIZE);
+  size_t old_map_size = block->map_size;
+  if (map_size == old_map_size ||
+      bulk_realloc(block, old_map_size, map_size, NULPTR)) {
+    __atomic_fetch_add(&large_mapped_bytes, map_size - old_map_size,
+                       __ATOMIC_RELAXED);
+    block->map_size = map_size;
+    block->size = size;
+    return ptr;
+  }
+  // the object has to move: its new place is registered before the old one is
+  // given up, so a failure leaves the object as it was
+  struct large_block *new_block = (struct large_block *)bulk_alloc(map_size);
+  if (new_block == NULPTR) {
+    return NULPTR;
+  }
+  void *object = (void *)((unsigned long long)new_block + block->offset);
+  if (pagemap_set(object, 1, PAGEMAP_OWNER_MAKE(new_block, PAGEMAP_LARGE)) !=
+      0) {
+    bulk_free(new_block, map_size);
+    return NULPTR;
+  }
+  pagemap_set(ptr, 1, NULPTR);
+  if (bulk_realloc(block, old_map_size, map_size, new_block) == NULPTR) {
+    size_t copy_size = size < block->size ? size : block->size;
+    mm_memcpy(new_block, block, block->offset + copy_size);
+    bulk_free(block, old_map_size);
+  }
+  __atomic_fetch_add(&large_mapped_bytes, map_size - old_map_size,
+                     __ATOMIC_RELAXED);
+  new_block->map_size = map_size;
+  new_block->size = size;
+  return object;
+}
@@ -0,0 +1,351 @@
+#include "memops.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define MEMOPS_X86
+#endif
+
+// keep the compiler from turning the loops below back into calls to the very
+// libc functions they stand in for
+#if defined(__clang__)
+#define MEMOPS_NO_LIBCALL __attribute__((no_builtin))
+#elif defined(__GNUC__)
+#define MEMOPS_NO_LIBCALL                                                      \
+  __attribute__((optimize("no-tree-loop-distribute-patterns")))
+#else
+#define MEMOPS_NO_LIBCALL
+#endif
+
+typedef size_t mem_word;
+#define WORD_SIZE sizeof(mem_word)
+// a word with every byte set to 1
+#define WORD_ONES (~(mem_word)0 / 0xff)
+
+// unaligned word access: a single move where the cpu allows it
+static inline mem_word load_word(const unsigned char *p) {
+  mem_word w;
+  __builtin_memcpy(&w, p, WORD_SIZE);
+  return w;
+}
+
+static inline void store_word(unsigned char *p, mem_word w) {
+  __builtin_memcpy(p, &w, WORD_SIZE);
+}
+
+MEMOPS_NO_LIBCALL
+static void memcpy_word(void *dest, const void *src, size_t n) {
+  unsigned char *d = (unsigned char *)dest;
+  const unsigned char *s = (const unsigned char *)src;
+  while (n >= 4 * WORD_SIZE) {
+    mem_word w0 = load_word(s);
+    mem_word w1 = load_word(s + WORD_SIZE);
+    mem_word w2 = load_word(s + 2 * WORD_SIZE);
+    mem_word w3 = load_word(s + 3 * WORD_SIZE);
+    store_word(d, w0);
+    store_word(d + WORD_SIZE, w1);
+    store_word(d + 2 * WORD_SIZE, w2);
+    store_word(d + 3 * WORD_SIZE, w3);
+    d += 4 * WORD_SIZE;
+    s += 4 * WORD_SIZE;
+    n -= 4 * WORD_SIZE;
+  }
+  while (n >= WORD_SIZE) {
+    store_word(d, load_word(s));
+    d += WORD_SIZE;
+    s += WORD_SIZE;
+    n -= WORD_SIZE;
+  }
+  while (n--) {
+    *d++ = *s++;
+  }
+}
+
+MEMOPS_NO_LIBCALL
+static void memset_word(void *dest, int value, size_t n) {
+  unsigned char *d = (unsigned char *)dest;
+  mem_word w = (unsigned char)value * WORD_ONES;
+  while (n >= 4 * WORD_SIZE) {
+    store_word(d, w);
+    store_word(d + WORD_SIZE, w);
+    store_word(d + 2 * WORD_SIZE, w);
+    store_word(d + 3 * WORD_SIZE, w);
+    d += 4 * WORD_SIZE;
+    n -= 4 * WORD_SIZE;
+  }
+  while (n >= WORD_SIZE) {
+    store_word(d, w);
+    d += WORD_SIZE;
+    n -= WORD_SIZE;
+  }
+  while (n--) {
+    *d++ = (unsigned char)value;
+  }
+}
+
+MEMOPS_NO_LIBCALL
+static int memcmp_word(const void *ptr1, const void *ptr2, size_t n) {
+  const unsigned char *p1 = (const unsigned char *)ptr1;
+  const unsigned char *p2 = (const unsigned char *)ptr2;
+  // skip the equal words, the bytes of the first different one are compared
+  // below
+  while (n >= WORD_SIZE && load_word(p1) == load_word(p2)) {
+    p1 += WORD_SIZE;
+    p2 += WORD_SIZE;
+    n -= WORD_SIZE;
+  }
+  while (n--) {
+    if (*p1 != *p2) {
+      return *p1 - *p2;
+    }
+    p1++;
+    p2++;
+  }
+  return 0;
+}
+
+#ifdef MEMOPS_X86
+// SSE2 is part of x86-64, so these need no runtime check
+
+static void memcpy_sse2(void *dest, const void *src, size_t n) {
+  if (n < 16) {
+    memcpy_word(dest, src, n);
+    return;
+  }
+  unsigned char *d = (unsigned char *)dest;
+  const unsigned char *s = (const unsigned char *)src;
+  while (n >= 64) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)s);
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(s + 16));
+    __m128i v2 = _mm_loadu_si128((const __m128i *)(s + 32));
+    __m128i v3 = _mm_loadu_si128((const __m128i *)(s + 48));
+    _mm_storeu_si128((__m128i *)d, v0);
+    _mm_storeu_si128((__m128i *)(d + 16), v1);
+    _mm_storeu_si128((__m128i *)(d + 32), v2);
+    _mm_storeu_si128((__m128i *)(d + 48), v3);
+    d += 64;
+    s += 64;
+    n -= 64;
+  }
+  while (n >= 16) {
+    _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+    d += 16;
+    s += 16;
+    n -= 16;
+  }
+  if (n) {
+    // the last 16 bytes, overlapping the ones already copied
+    _mm_storeu_si128((__m128i *)(d + n - 16),
+                     _mm_loadu_si128((const __m128i *)(s + n - 16)));
+  }
+}
+
+static void memset_sse2(void *dest, int value, size_t n) {
+  if (n < 16) {
+    memset_word(dest, value, n);
+    return;
+  }
+  unsigned char *d = (unsigned char *)dest;
+  __m128i v = _mm_set1_epi8((char)value);
+  while (n >= 64) {
+    _mm_storeu_si128((__m128i *)d, v);
+    _mm_storeu_si128((__m128i *)(d + 16), v);
+    _mm_storeu_si128((__m128i *)(d + 32), v);
+    _mm_storeu_si128((__m128i *)(d + 48), v);
+    d += 64;
+    n -= 64;
+  }
+  while (n >= 16) {
+    _mm_storeu_si128((__m128i *)d, v);
+    d += 16;
+    n -= 16;
+  }
+  if (n) {
+    _mm_storeu_si128((__m128i *)(d + n - 16), v);
+  }
+}
+
+static int memcmp_sse2(const void *ptr1, const void *ptr2, size_t n) {
+  const unsigned char *p1 = (const unsigned char *)ptr1;
+  const unsigned char *p2 = (const unsigned char *)ptr2;
+  while (n >= 16) {
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p1),
+                                _mm_loadu_si128((const __m128i *)p2));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(eq);
+    if (mask != 0xffff) {
+      int i = __builtin_ctz(~mask);
+      return p1[i] - p2[i];
+    }
+    p1 += 16;
+    p2 += 16;
+    n -= 16;
+  }
+  return memcmp_word(p1, p2, n);
+}
+
+__attribute__((target("avx2")))
+static void memcpy_avx2(void *dest, const void *src, size_t n) {
+  if (n < 32) {
+    memcpy_sse2(dest, src, n);
+    return;
+  }
+  unsigned char *d = (unsigned char *)dest;
+  const unsigned char *s = (const unsigned char *)src;
+  while (n >= 128) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)s);
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+    __m256i v2 = _mm256_loadu_si256((const __m256i *)(s + 64));
+    __m256i v3 = _mm256_loadu_si256((const __m256i *)(s + 96));
+    _mm256_storeu_si256((__m256i *)d, v0);
+    _mm256_storeu_si256((__m256i *)(d + 32), v1);
+    _mm256_storeu_si256((__m256i *)(d + 64), v2);
+    _mm256_storeu_si256((__m256i *)(d + 96), v3);
+    d += 128;
+    s += 128;
+    n -= 128;
+  }
+  while (n >= 32) {
+    _mm256_storeu_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+    d += 32;
+    s += 32;
+    n -= 32;
+  }
+  if (n) {
+    _mm256_storeu_si256((__m256i *)(d + n - 32),
+                        _mm256_loadu_si256((const __m256i *)(s + n - 32)));
+  }
+}
+
+__attribute__((target("avx2")))
+static void memset_avx2(void *dest, int value, size_t n) {
+  if (n < 32) {
+    memset_sse2(dest, value, n);
+    return;
+  }
+  unsigned char *d = (unsigned char *)dest;
+  __m256i v = _mm256_set1_epi8((char)value);
+  while (n >= 128) {
+    _mm256_storeu_si256((__m256i *)d, v);
+    _mm256_storeu_si256((__m256i *)(d + 32), v);
+    _mm256_storeu_si256((__m256i *)(d + 64), v);
+    _mm256_storeu_si256((__m256i *)(d + 96), v);
+    d += 128;
+    n -= 128;
+  }
+  while (n >= 32) {
+    _mm256_storeu_si256((__m256i *)d, v);
+    d += 32;
+    n -= 32;
+  }
+  if (n) {
+    _mm256_storeu_si256((__m256i *)(d + n - 32), v);
+  }
+}
+
+__attribute__((target("avx2")))
+static int memcmp_avx2(const void *ptr1, const void *ptr2, size_t n) {
+  const unsigned char *p1 = (const unsigned char *)ptr1;
+  const unsigned char *p2 = (const unsigned char *)ptr2;
+  while (n >= 32) {
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p1),
+                                   _mm256_loadu_si256((const __m256i *)p2));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(eq);
+    if (mask != 0xffffffffU) {
+      int i = __builtin_ctz(~mask);
+      return p1[i] - p2[i];
+    }
+    p1 += 32;
+    p2 += 32;
+    n -= 32;
+  }
+  return memcmp_sse2(p1, p2, n);
+}
+#endif
+
+struct memops_kernels {
+  void (*copy)(void *dest, const void *src, size_t n);
+  void (*set)(void *dest, int value, size_t n);
+  int (*cmp)(const void *ptr1, const void *ptr2, size_t n);
+};
+
+// indexed by enum memops_isa
+static const struct memops_kernels memops_table[] = {
+    {memcpy_word, memset_word, memcmp_word},
+#ifdef MEMOPS_X86
+    {memcpy_sse2, memset_sse2, memcmp_sse2},
+    {memcpy_avx2, memset_avx2, memcmp_avx2},
+#endif
+};
+
+// the implementation in use, -1 until the first call
+static int memops_isa_current = -1;
+
+static bool memops_supported(enum memops_isa isa) {
+  switch (isa) {
+  case MEMOPS_WORD:
+    return true;
+#ifdef MEMOPS_X86
+  case MEMOPS_SSE2:
+    return true;
+  case MEMOPS_AVX2:
+    // also checks that the os saves the ymm registers
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+static const struct memops_kernels *memops_kernels() {
+  int isa = __atomic_load_n(&memops_isa_current, __ATOMIC_RELAXED);
+  if (isa < 0) {
+    // racing threads all pick the same one
+    isa = MEMOPS_AVX2;
+    while (!memops_supported((enum memops_isa)isa)) {
+      isa--;
+    }
+    __atomic_store_n(&memops_isa_current, isa, __ATOMIC_RELAXED);
+  }
+  return &memops_table[isa];
+}
+
+// below this many bytes vectors do not pay for the indirect call, e.g. for the
+// canary
+#define MEMOPS_SMALL 32
+
+void mm_memcpy(void *dest, const void *src, size_t n) {
+  if (n < MEMOPS_SMALL) {
+    memcpy_word(dest, src, n);
+    return;
+  }
+  memops_kernels()->copy(dest, src, n);
+}
+
+void mm_memset(void *dest, int value, size_t n) {
+  if (n < MEMOPS_SMALL) {
+    memset_word(dest, value, n);
+    return;
+  }
+  memops_kernels()->set(dest, value, n);
+}
+
+int mm_memcmp(const void *ptr1, const void *ptr2, size_t n) {
+  if (n < MEMOPS_SMALL) {
+    return memcmp_word(ptr1, ptr2, n);
+  }
+  return memops_kernels()->cmp(ptr1, ptr2, n);
+}
+
+enum memops_isa memops_get_isa() {
+  memops_kernels();
+  return (enum memops_isa)__atomic_load_n(&memops_isa_current,
+                                          __ATOMIC_RELAXED);
+}
+
+int memops_set_isa(enum memops_isa isa) {
+  if (!memops_supported(isa)) {
+    return -1;
+  }
+  __atomic_store_n(&memops_isa_current, (int)isa, __ATOMIC_RELAXED);
+  return 0;
+}
@@ -1,140 +1,428 @@
 #include "mm.h"
+#include "guarded.h"
+#include "large.h"
+#include "memops.h"
+#include "pagemap.h"
+#include "profile.h"
+#include "size_class.h"
 #include "slab.h"
+#include "stats.h"
+#include "tcache.h"
+#include <stdlib.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
 
+#define ALIGN_UP(v, alignment) (((v) + (alignment) - 1) & ~((alignment) - 1))
+
+#if MM_HARDENING == MM_HARDENING_FULL
 static char canary_value[] = "CANARYthisIsCanaryValue";
-static void mm_memcpy(void *dest, const void *src, size_t n) {
-  unsigned char *d = (unsigned char *)dest;
-  const unsigned char *s = (const unsigned char *)src;
-  for (size_t i = 0; i < n; i++) {
-    d[i] = s[i];
-  }
-}
-static void mm_memset(void *dest, int value, size_t n) {
-  unsigned char *d = (unsigned char *)dest;
-  for (size_t i = 0; i < n; i++) {
-    d[i] = (unsigned char)value;
-  }
-}
-static void default_ctor(void *ptr, size_t size) { mm_memset(ptr, 0, size); }
-static void default_dtor(void *ptr, size_t size) { mm_memset(ptr, 0, size); }
-#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
-#define MAX_SLAB_CACHES 10
-struct slab_cache global_slab_cache_array[MAX_SLAB_CACHES] = {
-    // object size: 8,16,32,64,128,256,512,1024,2048,4096
-    // alignment: 8 for all
-    // { 8, 8, SLAB_SIZE / 8, nullptr, nullptr, nullptr, default_ctor,
-    // default_dtor },
-    // { 16, 8, SLAB_SIZE / 16, nullptr, nullptr, nullptr, default_ctor,
-    // default_dtor },
-    // { 32, 8, SLAB_SIZE / 32, nullptr, nullptr, nullptr, default_ctor,
-    // default_dtor },
-    // { 64, 8, SLAB_SIZE / 64, nullptr, nullptr, nullptr, default_ctor,
-    // default_dtor },
-    // { 128, 8, SLAB_SIZE / 128, nullptr, nullptr, nullptr, default_ctor,
-    // default_dtor },
-    // { 256, 8, SLAB_SIZE / 256, nullptr, nullptr, nullptr, default_ctor,
-    // default_dtor },
-    // { 512, 8, SLAB_SIZE / 512, nullptr, nullptr, nullptr, default_ctor,
-    // default_dtor },
-    // { 1024, 8, SLAB_SIZE / 1024, nullptr, nullptr, nullptr, default_ctor,
-    // default_dtor },
-    // { 2048, 8, SLAB_SIZE / 2048, nullptr, nullptr, nullptr, default_ctor,
-    // default_dtor },
-    // { 4096, 8, SLAB_SIZE / 4096, nullptr, nullptr, nullptr, default_ctor,
-    // default_dtor }
-};
-#endif
-#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
-void *direct_malloc(size_t size, size_t alignment)
-#else
-void *direct_malloc(size_t size, size_t alignment,
-                    struct slab_cache *cache_array, size_t cache_array_size)
+static_assert(sizeof(canary_value) == MM_CANARY_SIZE, "canary size");
+#elif MM_HARDENING == MM_HARDENING_FAST
+// the per-process canary, set on its first use and never changed after
+static unsigned long long canary_value;
+
+static unsigned long long mm_canary_init() {
+  unsigned long long value = 0;
+  if (getrandom(&value, sizeof(value), GRND_NONBLOCK) != sizeof(value)) {
+    // no entropy yet: mix the clock with the address space layout
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    value = ((unsigned long long)ts.tv_nsec << 32) ^ ts.tv_sec ^
+            (unsigned long long)&value;
+    value *= 0x9e3779b97f4a7c15ULL;
+  }
+  // a zero first byte stops string functions from reading the rest of it
+  value &= ~0xffULL;
+  if (value == 0) {
+    value = 0x5bd1e99500ULL;
+  }
+  unsigned long long expected = 0;
+  if (!__atomic_compare_exchange_n(&canary_value, &expected, value, false,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    // another thread set it first
+    return expected;
+  }
+  return value;
+}
+
+static inline unsigned long long mm_canary() {
+  unsigned long long value = __atomic_load_n(&canary_value, __ATOMIC_RELAXED);
+  if (__builtin_expect(value == 0, 0)) {
+    value = mm_canary_init();
+  }
+  return value;
+}
 #endif
-{
-  struct slab_cache *cache_array_ptr =
+// number of per-cpu shards given to new slab caches, 0 or 1 if unsharded
+static size_t mm_shards_num;
+void mm_set_shards_num(size_t shards_num) { mm_shards_num = shards_num; }
+// whether new slab caches take their slabs from huge page regions
+static bool mm_hugepages;
+void mm_set_hugepages(bool enabled) { mm_hugepages = enabled; }
+// the freelist representation of new slab caches
+static enum slab_freelist_kind mm_freelist = SLAB_FREELIST_LINKED;
+void mm_set_freelist(enum slab_freelist_kind kind) { mm_freelist = kind; }
+void mm_set_guarded_sample_rate(size_t rate) {
+  guarded_set_sample_rate(rate);
+}
+void mm_set_profile_rate(size_t rate) { profile_set_rate(rate); }
+void mm_profile_dump(mm_stats_write_fn write, void *arg) {
+  profile_dump(write, arg);
+}
+
+/**
+init a slab cache created by the allocator itself, sharding it if asked to.
+*/
+static void mm_cache_init(struct slab_cache *cache, size_t size,
+                          size_t alignment) {
+  // no hooks: objects are zeroed only by mm_calloc, and only when needed
+  slab_cache_init(cache, size, alignment, 0, 0);
+  if (slab_cache_set_freelist(cache, mm_freelist) != 0) {
+    LOG("objects too small for the freelist, keeping the index array.\n");
+  }
+  slab_cache_set_huge(cache, mm_hugepages);
+  if (mm_shards_num > 1 && slab_cache_shard(cache, mm_shards_num) != 0) {
+    LOG("failed to shard a slab cache, using it unsharded.\n");
+  }
+}
+
 #ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
-      global_slab_cache_array;
+// one slab cache per size class, see size_class.h
+#define MAX_SLAB_CACHES SIZE_CLASSES_NUM
+struct slab_cache global_slab_cache_array[MAX_SLAB_CACHES];
+static int global_slab_cache_ready;
+static struct spinlock global_slab_cache_lock = SPINLOCK_INIT;
+static_assert(MAX_SLAB_CACHES <= TCACHE_BINS_NUM,
+              "every global slab cache needs a thread cache bin");
+
+/**
+init the slab caches of all size classes. runs once, on the first allocation.
+the caches are never moved or reordered afterwards.
+*/
+static void global_caches_init() {
+  spin_lock(&global_slab_cache_lock);
+  if (!global_slab_cache_ready) {
+    for (size_t i = 0; i < MAX_SLAB_CACHES; i++) {
+      mm_cache_init(&global_slab_cache_array[i], size_classes.sizes[i],
+                    size_classes.alignments[i]);
+    }
+    __atomic_store_n(&global_slab_cache_ready, 1, __ATOMIC_RELEASE);
+  }
+  spin_unlock(&global_slab_cache_lock);
+}
+// index of the cache of a slab in the cache array, which its counters use
+#define MM_CACHE_INDEX(slab)                                                   \
+  ((size_t)(slab_top_cache(slab) - global_slab_cache_array))
 #else
-      cache_array;
+static inline size_t mm_cache_index(struct slab *slab,
+                                    struct slab_cache *cache_array) {
+  size_t index = slab_top_cache(slab) - cache_array;
+  return index < STATS_CLASSES_NUM ? index : STATS_NONE;
+}
+#define MM_CACHE_INDEX(slab) mm_cache_index(slab, cache_array)
 #endif
-  size_t cache_array_size_val =
+/**
+alloc size bytes aligned to alignment from the slab caches. *clean tells
+whether the object is known to be all zero.
+*/
 #ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
-      MAX_SLAB_CACHES;
+void *direct_malloc(size_t size, size_t alignment, bool *clean)
 #else
-      cache_array_size;
+void *direct_malloc(size_t size, size_t alignment, bool *clean,
+                    struct slab_cache *cache_array, size_t cache_array_size)
 #endif
+{
   if (alignment == 0) {
     LOG("warning: passed alignment=0 while mm_alloc-ing. If you do not need "
         "alignment, pass alignment=1.\n Now automatically setting it to 1.\n")
     alignment = 1;
   }
-  void *res =
-      slab_alloc(size, alignment, cache_array_ptr, cache_array_size_val);
-  if (!res) {
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  if (!__atomic_load_n(&global_slab_cache_ready, __ATOMIC_ACQUIRE)) {
+    global_caches_init();
+  }
+  size_t index = size_class_of(size, alignment);
+  if (index == SIZE_CLASSES_NUM) {
+    LOG("%zu bytes aligned to %zu are too large for the slab caches.\n", size,
+        alignment);
+    return (void *)0;
+  }
+  struct slab_cache *cache = &global_slab_cache_array[index];
+  // served by the calling thread's cache whenever possible
+  return tcache_alloc(cache, index, clean);
+#else
+  struct slab_cache *cache =
+      slab_find_cache(size, alignment, cache_array, cache_array_size);
+  if (!cache) {
     LOG("first attempt allocing failed. trying to create a new cache...\n");
-    // trying to create a slab cache meeting the requirements
-    struct slab_cache *temp_cache;
-    for (size_t i = 0; i < cache_array_size_val; i++) {
-      if (cache_array_ptr[i].object_size == 0) {
-        temp_cache = &cache_array_ptr[i];
+    // trying to create a slab cache meeting the requirements.
+    // caches are never reordered: slabs point back to their cache, and
+    // slab_alloc picks the best fit, so the array needn't be sorted.
+    struct slab_cache *temp_cache = (struct slab_cache *)0;
+    for (size_t i = 0; i < cache_array_size; i++) {
+      if (cache_array[i].object_size == 0) {
+        temp_cache = &cache_array[i];
         break;
       }
     }
-    // ascending sort by the object_size
-    // bubble sort
-    for (size_t i = 0; i < cache_array_size_val - 1; i++) {
-      for (size_t j = 0; j < cache_array_size_val - i - 1; j++) {
-        if (cache_array_ptr[j].object_size >
-            cache_array_ptr[j + 1].object_size) {
-          struct slab_cache temp = cache_array_ptr[j];
-          cache_array_ptr[j] = cache_array_ptr[j + 1];
-          cache_array_ptr[j + 1] = temp;
-        }
-      }
+    if (!temp_cache) {
+      LOG("no free slot left in the slab cache array.\n");
+      return (void *)0;
     }
-    slab_cache_init(temp_cache, size, alignment, default_ctor, default_dtor);
-    // alloc again
-    return slab_alloc(size, alignment, cache_array_ptr, cache_array_size_val);
-  } else {
-    return res;
+    mm_cache_init(temp_cache, size, alignment);
+    cache = temp_cache;
   }
+  return slab_cache_alloc_clean(cache, clean);
+#endif
 }
 
-static int mm_memcmp(const void *ptr1, const void *ptr2, size_t n) {
-  const unsigned char *p1 = (const unsigned char *)ptr1;
-  const unsigned char *p2 = (const unsigned char *)ptr2;
-  for (size_t i = 0; i < n; i++) {
-    if (p1[i] != p2[i]) {
-      return p1[i] - p2[i];
-    }
+#if MM_HARDENING != MM_HARDENING_OFF
+/**
+report an overwritten canary, or another sign of a corrupted heap, and abort:
+the heap can not be trusted any more. only write() is used, which needs no
+memory.
+*/
+#define MM_CANARY_MISMATCH                                                     \
+  "mm: memory corruption detected: canary value mismatch\n"
+#define MM_SIZE_MISMATCH                                                       \
+  "mm: memory corruption detected: sized free with the wrong size\n"
+__attribute__((noreturn, cold)) static void
+mm_corrupted(void *ptr, const char *msg) {
+  LOG("Memory corruption detected at %p.\n", ptr);
+  ssize_t written = write(STDERR_FILENO, msg, __builtin_strlen(msg));
+  (void)written;
+  abort();
+}
+#endif
+
+// write the canary right after the size bytes of the object at ptr
+static inline void mm_set_canary(void *ptr, size_t size) {
+#if MM_HARDENING == MM_HARDENING_FULL
+  mm_memcpy((char *)ptr + size, canary_value, sizeof(canary_value));
+#elif MM_HARDENING == MM_HARDENING_FAST
+  unsigned long long value = mm_canary();
+  __builtin_memcpy((char *)ptr + size, &value, sizeof(value));
+#else
+  (void)ptr;
+  (void)size;
+#endif
+}
+
+static inline void mm_check_canary(void *ptr, size_t size) {
+#if MM_HARDENING == MM_HARDENING_FULL
+  char *canary_ptr = (char *)ptr + size;
+  if (mm_memcmp(canary_ptr, canary_value, sizeof(canary_value)) != 0) {
+    mm_corrupted(ptr, MM_CANARY_MISMATCH);
+  }
+#elif MM_HARDENING == MM_HARDENING_FAST
+  unsigned long long value;
+  __builtin_memcpy(&value, (char *)ptr + size, sizeof(value));
+  if (__builtin_expect(value != mm_canary(), 0)) {
+    mm_corrupted(ptr, MM_CANARY_MISMATCH);
+  }
+#else
+  (void)ptr;
+  (void)size;
+#endif
+}
+
+/**
+get the size the user asked for when allocating the slab object at ptr, from
+its trailer. without hardening, it is the size of the object.
+*/
+static inline size_t mm_slab_size_of(struct slab *slab, void *ptr) {
+  size_t alloc_size = slab->cache->object_size;
+#if MM_HARDENING != MM_HARDENING_OFF
+  return *(size_t *)((size_t)ptr + alloc_size - sizeof(size_t));
+#else
+  (void)ptr;
+  return alloc_size;
+#endif
+}
+
+static inline void mm_slab_set_size(struct slab *slab, void *ptr, size_t size) {
+#if MM_HARDENING != MM_HARDENING_OFF
+  size_t alloc_size = slab->cache->object_size;
+  *(size_t *)((size_t)ptr + alloc_size - sizeof(size_t)) = size;
+#else
+  (void)slab;
+  (void)ptr;
+  (void)size;
+#endif
+}
+
+/**
+get the size the user asked for when allocating ptr: slab objects store it in
+their trailer, large objects in their block (which also holds the canary).
+*/
+static size_t mm_requested_size(void *ptr) {
+  struct slab *slab = slab_of(ptr);
+  if (slab) {
+    return mm_slab_size_of(slab, ptr);
+  }
+  struct large_block *block = large_of(ptr);
+  if (block) {
+    return block->size - MM_CANARY_SIZE;
+  }
+  struct guarded_slot *slot = guarded_of(ptr);
+  if (slot) {
+    return slot->size;
   }
   return 0;
 }
+
+size_t mm_usable_size(void *ptr) { return mm_requested_size(ptr); }
+
+/**
+check that size bytes aligned to alignment can be served at all: adding the
+canary, the size trailer and the alignment padding must not wrap around.
+*/
+static inline bool mm_size_ok(size_t size, size_t alignment) {
+  return size <= ~(size_t)0 - MM_HARDENING_OVERHEAD - alignment;
+}
+
+/**
+check whether size bytes aligned to alignment have to go to the large object
+allocator, counting the canary and size trailer of slab objects.
+*/
+static bool mm_is_large(size_t size, size_t alignment) {
+  if (!mm_size_ok(size, alignment)) {
+    return true;
+  }
+  return size_class_of(size + MM_HARDENING_OVERHEAD,
+                       alignment ? alignment : 1) == SIZE_CLASSES_NUM;
+}
+
+// number of mm_realloc calls that kept the object where it was
+static size_t mm_realloc_in_place_num;
+size_t mm_realloc_in_place_count() {
+  return __atomic_load_n(&mm_realloc_in_place_num, __ATOMIC_RELAXED);
+}
+
+/**
+check whether a slab object of cache at ptr can be resized to size bytes
+aligned to alignment without moving: the new size with its canary and trailer
+must fit, and must not belong to a smaller size class, or shrinking would keep
+a block far larger than needed.
+*/
+static bool mm_fits_in_place(struct slab_cache *cache, void *ptr, size_t size,
+                             size_t alignment) {
+  if ((unsigned long long)ptr & (alignment - 1)) {
+    return false;
+  }
+  // mm_is_large also rejects the sizes that would wrap around
+  if (mm_is_large(size, alignment)) {
+    return false;
+  }
+  size_t size_with_canary = size + MM_HARDENING_OVERHEAD;
+  if (size_with_canary > cache->object_size) {
+    return false;
+  }
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  return size_classes.sizes[size_class_of(size_with_canary, alignment)] ==
+         cache->object_size;
+#else
+  return true;
+#endif
+}
+
 #ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
 void mm_free(void *ptr)
 #else
 void mm_free(void *ptr, struct slab_cache *cache_array, size_t cache_array_size)
 #endif
 {
-// check for canary value
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+  (void)cache_array_size;
+#endif
+  // look the owner up once and use it for both the canary check and the free
+  void *owner = pagemap_get(ptr);
+  if (owner && PAGEMAP_OWNER_KIND(owner) == PAGEMAP_LARGE) {
+    struct large_block *block = (struct large_block *)PAGEMAP_OWNER_PTR(owner);
+    mm_check_canary(ptr, block->size - MM_CANARY_SIZE);
+    stats_count_free(STATS_LARGE, block->size - MM_CANARY_SIZE);
+    if (profile_has_live()) {
+      profile_free(ptr, (struct slab *)0);
+    }
+    large_free(ptr);
+    return;
+  }
+  if (owner && PAGEMAP_OWNER_KIND(owner) == PAGEMAP_GUARDED) {
+    // guarded objects have no canary: the guard pages catch overflows
+    guarded_free((struct guarded_slot *)PAGEMAP_OWNER_PTR(owner), ptr);
+    return;
+  }
+  struct slab *slab = (struct slab *)owner;
+  if (!slab) {
+    LOG("mm_free: %p was not allocated by mm_malloc.\n", ptr);
+    return;
+  }
+  // check for canary value
+  size_t needed_size = mm_slab_size_of(slab, ptr);
+  mm_check_canary(ptr, needed_size);
+  size_t index = MM_CACHE_INDEX(slab);
+  stats_count_free(index, needed_size);
+  if (__builtin_expect(profile_slab_sampled(slab), 0)) {
+    profile_free(ptr, slab);
+  }
 #ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
-  size_t alloc_size =
-      get_slab_obj_size(ptr, global_slab_cache_array, MAX_SLAB_CACHES);
+  tcache_free(index, ptr);
 #else
-  size_t alloc_size = get_slab_obj_size(ptr, cache_array, cache_array_size);
+  slab_free_to(slab, ptr);
 #endif
-  size_t needed_size = *(size_t *)((size_t)ptr + alloc_size - sizeof(size_t));
-  char *canary_ptr = (char *)ptr + needed_size;
-  if (mm_memcmp(canary_ptr, canary_value, sizeof(canary_value)) != 0) {
-    LOG("Memory corruption detected: canary value mismatch on free().\n");
-    // In a real system, you might want to handle this more gracefully.
-  }
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+void mm_free_sized(void *ptr, size_t size, size_t alignment)
+#else
+void mm_free_sized(void *ptr, size_t size, size_t alignment,
+                   struct slab_cache *cache_array, size_t cache_array_size)
+#endif
+{
 #ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
-  slab_free(ptr, global_slab_cache_array, MAX_SLAB_CACHES);
+  size_t index = mm_size_ok(size, alignment)
+                     ? size_class_of(size + MM_HARDENING_OVERHEAD,
+                                     alignment ? alignment : 1)
+                     : SIZE_CLASSES_NUM;
+  // like sized operator delete, the size is trusted: a slab object goes to the
+  // thread cache without a page map lookup. large, guarded and, while some are
+  // sampled by the profiler, all objects take mm_free.
+  if (index != SIZE_CLASSES_NUM && ptr && !guarded_owns(ptr) &&
+      !profile_has_live()) {
+#if MM_HARDENING == MM_HARDENING_FULL
+    // check the size against the page map before the trailer is read
+    void *owner = pagemap_get(ptr);
+    if (!owner || PAGEMAP_OWNER_KIND(owner) != PAGEMAP_SLAB ||
+        MM_CACHE_INDEX((struct slab *)owner) != index) {
+      mm_corrupted(ptr, MM_SIZE_MISMATCH);
+    }
+#endif
+    size_t alloc_size = size_classes.sizes[index];
+#if MM_HARDENING != MM_HARDENING_OFF
+    size_t needed_size = *(size_t *)((size_t)ptr + alloc_size - sizeof(size_t));
+#if MM_HARDENING == MM_HARDENING_FULL
+    if (needed_size != size) {
+      mm_corrupted(ptr, MM_SIZE_MISMATCH);
+    }
+#endif
+    mm_check_canary(ptr, needed_size);
+    stats_count_free(index, needed_size);
 #else
-  slab_free(ptr, cache_array, cache_array_size);
+    stats_count_free(index, alloc_size);
+#endif
+    tcache_free(index, ptr);
+    return;
+  }
+  mm_free(ptr);
+#else
+  // the slab of ptr has to be looked up anyway to free it
+  (void)size;
+  (void)alignment;
+  mm_free(ptr, cache_array, cache_array_size);
 #endif
 }
+
 void *mm_realloc(void *ptr, size_t size, size_t alignment
 #ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
                  ,
@@ -145,57 +433,518 @@ void *mm_realloc(void *ptr, size_t size, size_t alignment
 #define NULL (void *)0
 #endif
   if (!ptr) {
-    return direct_malloc(size, alignment
+    return mm_malloc(size, alignment
 #ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
-                         ,
-                         cache_array, cache_array_size
+                     ,
+                     cache_array, cache_array_size
 #endif
     );
+  }
+  if (alignment == 0) {
+    alignment = 1;
+  }
+  if (!mm_size_ok(size, alignment)) {
+    LOG("mm_realloc: %zu bytes aligned to %zu are too large.\n", size,
+        alignment);
+    return NULL;
+  }
+  struct slab *slab = slab_of(ptr);
+  if (slab && mm_fits_in_place(slab->cache, ptr, size, alignment)) {
+    // same size class: move the canary and the size trailer, keep the block
+    size_t old_size = mm_slab_size_of(slab, ptr);
+    mm_check_canary(ptr, old_size);
+    mm_set_canary(ptr, size);
+    mm_slab_set_size(slab, ptr, size);
+    stats_count_resize(MM_CACHE_INDEX(slab), old_size,
+                       mm_slab_size_of(slab, ptr));
+    __atomic_fetch_add(&mm_realloc_in_place_num, 1, __ATOMIC_RELAXED);
+    return ptr;
+  }
+  struct large_block *block = large_of(ptr);
+  if (block && mm_is_large(size, alignment) && alignment <= block->alignment) {
+    // large to large: resize the mapping, which moves pages instead of
+    // copying bytes
+    size_t old_size = block->size - MM_CANARY_SIZE;
+    mm_check_canary(ptr, old_size);
+    char *new_ptr = (char *)large_realloc(ptr, size + MM_CANARY_SIZE);
+    if (!new_ptr) {
+      return NULL;
+    }
+    stats_count_resize(STATS_LARGE, old_size, size);
+    mm_set_canary(new_ptr, size);
+    if (new_ptr == ptr) {
+      __atomic_fetch_add(&mm_realloc_in_place_num, 1, __ATOMIC_RELAXED);
+    } else if (profile_has_live()) {
+      profile_move(ptr, new_ptr);
+    }
+    return new_ptr;
   } else {
     // simple implementation: alloc new memory and copy old data
-    void *new_ptr = direct_malloc(size, alignment
+    void *new_ptr = mm_malloc(size, alignment
 #ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
-                                  ,
-                                  cache_array, cache_array_size
+                              ,
+                              cache_array, cache_array_size
 #endif
     );
     if (!new_ptr) {
       return NULL;
     }
-// copy old data
-// see the old size and copy min(old_size, new_size) bytes
-#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
-    size_t old_size =
-        get_alloced_size(ptr, global_slab_cache_array, MAX_SLAB_CACHES);
-#else
-    size_t old_size = get_alloced_size(ptr, cache_array, cache_array_size);
-#endif
-
+    // copy old data
+    // see the old size and copy min(old_size, new_size) bytes
+    size_t old_size = mm_requested_size(ptr);
     mm_memcpy(new_ptr, ptr, old_size < size ? old_size : size);
-    mm_free(ptr);
+    mm_free(ptr
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+            ,
+            cache_array, cache_array_size
+#endif
+    );
     return new_ptr;
   }
 }
 
+/**
+alloc an object with its canary and size trailer. *clean tells whether its
+first size bytes are known to be zero.
+*/
+static void *mm_alloc(size_t size, size_t alignment, bool *clean
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+                      ,
+                      struct slab_cache *cache_array, size_t cache_array_size
+#endif
+) {
+  if (!mm_size_ok(size, alignment)) {
+    LOG("mm_alloc: %zu bytes aligned to %zu are too large.\n", size,
+        alignment);
+    return (void *)0;
+  }
+  if (guarded_sample()) {
+    void *ptr = guarded_alloc(size, alignment);
+    if (ptr) {
+      *clean = false;
+      return ptr;
+    }
+  }
+  if (mm_is_large(size, alignment)) {
+    // large objects keep their size in their block, only the canary follows.
+    // they are fresh pages from the page source, so they are zero.
+    char *ptr = (char *)large_alloc(size + MM_CANARY_SIZE, alignment);
+    if (ptr) {
+      mm_set_canary(ptr, size);
+      stats_count_alloc(STATS_LARGE, size);
+      if (profile_sample(size)) {
+        profile_record(ptr, size, (struct slab *)0);
+      }
+    }
+    *clean = true;
+    return ptr;
+  }
+  size_t size_with_canary = size + MM_HARDENING_OVERHEAD;
+  void *mem = direct_malloc(size_with_canary, alignment, clean
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+                            ,
+                            cache_array, cache_array_size
+#endif
+  );
+  if (!mem) {
+    return mem;
+  }
+  struct slab *slab = slab_of(mem);
+  mm_set_canary(mem, size);
+  // store the size requested by user at the end of the allocated block
+  mm_slab_set_size(slab, mem, size);
+  stats_count_alloc(MM_CACHE_INDEX(slab), mm_slab_size_of(slab, mem));
+  if (profile_sample(size)) {
+    profile_record(mem, size, slab);
+  }
+  return mem;
+}
+
 void *mm_malloc(size_t size, size_t alignment
 #ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
                 ,
                 struct slab_cache *cache_array, size_t cache_array_size
 #endif
 ) {
-  size_t size_with_canary = size + sizeof(canary_value) + sizeof(size_t);
-  void *mem = direct_malloc(size_with_canary, alignment);
-  char *ptr = (char *)mem;
-  mm_memcpy(ptr + size, canary_value, sizeof(canary_value));
+  bool clean;
+  return mm_alloc(size, alignment, &clean
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+                  ,
+                  cache_array, cache_array_size
+#endif
+  );
+}
+
+void *mm_calloc(size_t num, size_t size, size_t alignment
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+                ,
+                struct slab_cache *cache_array, size_t cache_array_size
+#endif
+) {
+  if (size && num > ~(size_t)0 / size) {
+    LOG("mm_calloc: %zu * %zu bytes overflow.\n", num, size);
+    return (void *)0;
+  }
+  bool clean;
+  void *ptr = mm_alloc(num * size, alignment, &clean
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+                       ,
+                       cache_array, cache_array_size
+#endif
+  );
+  // objects never handed out since their pages were mapped are still zero
+  if (ptr && !clean) {
+    mm_memset(ptr, 0, num * size);
+  }
+  return ptr;
+}
 
 #ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
-  size_t alloced_size =
-      get_slab_obj_size(mem, global_slab_cache_array, MAX_SLAB_CACHES);
+size_t mm_trim()
 #else
-  size_t alloced_size = get_slab_obj_size(mem, cache_array, cache_array_size);
+size_t mm_trim(struct slab_cache *cache_array, size_t cache_array_size)
 #endif
-  // store the size requested by user at the end of the allocated block
-  size_t *size_ptr = (size_t *)(ptr + alloced_size - sizeof(size_t));
-  *size_ptr = size;
-  return mem;
+{
+  size_t released = 0;
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  if (!__atomic_load_n(&global_slab_cache_ready, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  // objects parked in the calling thread's cache keep their slabs busy
+  tcache_flush();
+  for (size_t i = 0; i < MAX_SLAB_CACHES; i++) {
+    released += slab_cache_shrink(&global_slab_cache_array[i]);
+  }
+#else
+  for (size_t i = 0; i < cache_array_size; i++) {
+    if (cache_array[i].object_size != 0) {
+      released += slab_cache_shrink(&cache_array[i]);
+    }
+  }
+#endif
+  return released;
 }
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+size_t mm_decay()
+#else
+size_t mm_decay(struct slab_cache *cache_array, size_t cache_array_size)
+#endif
+{
+  size_t released = 0;
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  if (!__atomic_load_n(&global_slab_cache_ready, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  for (size_t i = 0; i < MAX_SLAB_CACHES; i++) {
+    released += slab_cache_decay(&global_slab_cache_array[i]);
+  }
+#else
+  for (size_t i = 0; i < cache_array_size; i++) {
+    if (cache_array[i].object_size != 0) {
+      released += slab_cache_decay(&cache_array[i]);
+    }
+  }
+#endif
+  return released;
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+void mm_stats_get(struct mm_stats *stats)
+#else
+void mm_stats_get(struct mm_stats *stats, struct slab_cache *cache_array,
+                  size_t cache_array_size)
+#endif
+{
+  mm_memset(stats, 0, sizeof(struct mm_stats));
+  stats_collect(stats);
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  struct slab_cache *cache_array = global_slab_cache_array;
+  size_t cache_array_size = MAX_SLAB_CACHES;
+  bool ready = __atomic_load_n(&global_slab_cache_ready, __ATOMIC_ACQUIRE);
+#else
+  bool ready = true;
+#endif
+  stats->classes_num = cache_array_size < STATS_CLASSES_NUM
+                           ? cache_array_size
+                           : STATS_CLASSES_NUM;
+  struct mm_class_stats *total = &stats->total;
+  for (size_t i = 0; i < stats->classes_num; i++) {
+    struct mm_class_stats *cls = &stats->classes[i];
+    struct slab_cache *cache = &cache_array[i];
+    if (ready && cache->object_size != 0) {
+      struct slab_cache_stats slab_stats;
+      slab_cache_get_stats(cache, &slab_stats);
+      cls->object_size = cache->object_size;
+      cls->bytes_reserved = slab_stats.bytes_reserved;
+      cls->slabs_created = slab_stats.slabs_created;
+      cls->slabs_released = slab_stats.slabs_released;
+      cls->slabs_partial = slab_stats.slabs_partial;
+      cls->slabs_full = slab_stats.slabs_full;
+      cls->slabs_empty = slab_stats.slabs_empty;
+    }
+    cls->bytes_allocated = cls->live_objects * cls->object_size;
+    total->allocs += cls->allocs;
+    total->frees += cls->frees;
+    total->live_objects += cls->live_objects;
+    total->bytes_requested += cls->bytes_requested;
+    total->bytes_allocated += cls->bytes_allocated;
+    total->bytes_reserved += cls->bytes_reserved;
+    total->slabs_created += cls->slabs_created;
+    total->slabs_released += cls->slabs_released;
+    total->slabs_partial += cls->slabs_partial;
+    total->slabs_full += cls->slabs_full;
+    total->slabs_empty += cls->slabs_empty;
+  }
+  // large objects take whole pages: what is mapped is what they are given
+  size_t blocks_num;
+  large_get_stats(&blocks_num, &stats->large.bytes_reserved);
+  stats->large.bytes_allocated = stats->large.bytes_reserved;
+  total->allocs += stats->large.allocs;
+  total->frees += stats->large.frees;
+  total->live_objects += stats->large.live_objects;
+  total->bytes_requested += stats->large.bytes_requested;
+  total->bytes_allocated += stats->large.bytes_allocated;
+  total->bytes_reserved += stats->large.bytes_reserved;
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+void mm_stats_dump(enum mm_stats_format format, mm_stats_write_fn write,
+                   void *arg)
+#else
+void mm_stats_dump(enum mm_stats_format format, mm_stats_write_fn write,
+                   void *arg, struct slab_cache *cache_array,
+                   size_t cache_array_size)
+#endif
+{
+  struct mm_stats stats;
+  mm_stats_get(&stats
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+               ,
+               cache_array, cache_array_size
+#endif
+  );
+  stats_format(&stats, format, write, arg);
+}
+
+struct mm_walk_state {
+  mm_heap_slab_fn slab_fn;
+  mm_heap_object_fn object_fn;
+  void *arg;
+  // the slab whose objects are being walked
+  struct mm_heap_slab current;
+};
+
+static void mm_walk_slab(void *arg, struct slab *slab) {
+  struct mm_walk_state *state = (struct mm_walk_state *)arg;
+  struct slab_cache *cache = slab->cache;
+  state->current.slab = slab;
+  state->current.start = slab;
+  state->current.size = cache->slab_size;
+  state->current.objects_num = cache->objects_num_per_slab;
+  state->current.objects_live = (size_t)slab->active;
+  if (state->slab_fn) {
+    state->slab_fn(state->arg, &state->current);
+  }
+}
+
+static void mm_walk_object(void *arg, struct slab *slab, void *obj) {
+  struct mm_walk_state *state = (struct mm_walk_state *)arg;
+  size_t size = mm_slab_size_of(slab, obj);
+  // the trailer of an object held by a thread cache may be stale, or zero if
+  // the object was never handed out
+  size_t size_max = slab->cache->object_size - MM_HARDENING_OVERHEAD;
+  state->object_fn(state->arg, &state->current, obj,
+                   size > size_max ? size_max : size);
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+int mm_heap_walk(mm_heap_slab_fn slab_fn, mm_heap_object_fn object_fn,
+                 void *arg)
+#else
+int mm_heap_walk(mm_heap_slab_fn slab_fn, mm_heap_object_fn object_fn,
+                 void *arg, struct slab_cache *cache_array,
+                 size_t cache_array_size)
+#endif
+{
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  if (!__atomic_load_n(&global_slab_cache_ready, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  // objects parked in the calling thread's cache are free, not in use
+  tcache_flush();
+  struct slab_cache *cache_array = global_slab_cache_array;
+  size_t cache_array_size = MAX_SLAB_CACHES;
+#endif
+  struct mm_walk_state state;
+  mm_memset(&state, 0, sizeof(state));
+  state.slab_fn = slab_fn;
+  state.object_fn = object_fn;
+  state.arg = arg;
+  for (size_t i = 0; i < cache_array_size; i++) {
+    if (cache_array[i].object_size == 0) {
+      continue;
+    }
+    state.current.cache_index = i;
+    if (slab_cache_walk(&cache_array[i], mm_walk_slab,
+                        object_fn ? mm_walk_object : (slab_walk_object_fn)0,
+                        &state) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void mm_frag_slab(void *arg, const struct mm_heap_slab *slab) {
+  struct mm_frag_report *report = (struct mm_frag_report *)arg;
+  if (slab->cache_index >= report->classes_num) {
+    return;
+  }
+  struct mm_frag_class *cls = &report->classes[slab->cache_index];
+  cls->slabs++;
+  cls->objects_live += slab->objects_live;
+  if (slab->objects_live == 0) {
+    cls->slabs_empty++;
+  } else {
+    // bucket i holds the occupancies in (i / buckets, (i + 1) / buckets]
+    cls->occupancy[(slab->objects_live * MM_FRAG_BUCKETS - 1) /
+                   slab->objects_num]++;
+  }
+}
+
+static void mm_frag_object(void *arg, const struct mm_heap_slab *slab,
+                           void *ptr, size_t size) {
+  (void)ptr;
+  struct mm_frag_report *report = (struct mm_frag_report *)arg;
+  if (slab->cache_index < report->classes_num) {
+    report->classes[slab->cache_index].bytes_requested += size;
+  }
+}
+
+static void mm_frag_add(struct mm_frag_class *to,
+                        const struct mm_frag_class *from) {
+  to->slabs += from->slabs;
+  to->slabs_empty += from->slabs_empty;
+  for (int i = 0; i < MM_FRAG_BUCKETS; i++) {
+    to->occupancy[i] += from->occupancy[i];
+  }
+  to->objects_live += from->objects_live;
+  to->bytes_reserved += from->bytes_reserved;
+  to->bytes_requested += from->bytes_requested;
+  to->bytes_padding += from->bytes_padding;
+  to->bytes_hardening += from->bytes_hardening;
+  to->bytes_free += from->bytes_free;
+  to->bytes_slab_overhead += from->bytes_slab_overhead;
+  to->bytes_reclaimable += from->bytes_reclaimable;
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+int mm_frag_get(struct mm_frag_report *report)
+#else
+int mm_frag_get(struct mm_frag_report *report, struct slab_cache *cache_array,
+                size_t cache_array_size)
+#endif
+{
+  mm_memset(report, 0, sizeof(struct mm_frag_report));
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  struct slab_cache *cache_array = global_slab_cache_array;
+  size_t cache_array_size = MAX_SLAB_CACHES;
+  report->classes_num = MAX_SLAB_CACHES;
+  if (mm_heap_walk(mm_frag_slab, mm_frag_object, report) != 0) {
+    return -1;
+  }
+#else
+  report->classes_num = cache_array_size < STATS_CLASSES_NUM
+                            ? cache_array_size
+                            : STATS_CLASSES_NUM;
+  if (mm_heap_walk(mm_frag_slab, mm_frag_object, report, cache_array,
+                   cache_array_size) != 0) {
+    return -1;
+  }
+#endif
+#if MM_HARDENING == MM_HARDENING_OFF
+  // objects keep no trailer: what was asked for is known only from the
+  // counters, which miss the objects cached by other threads
+  struct mm_stats stats;
+  mm_memset(&stats, 0, sizeof(stats));
+  stats_collect(&stats);
+#endif
+  for (size_t i = 0; i < report->classes_num && i < cache_array_size; i++) {
+    struct mm_frag_class *cls = &report->classes[i];
+    struct slab_cache *cache = &cache_array[i];
+    if (cache->object_size == 0) {
+      continue;
+    }
+    size_t stride = ALIGN_UP(cache->object_size, cache->alignment);
+    size_t per_slab = cache->objects_num_per_slab;
+    cls->object_size = cache->object_size;
+    cls->slab_size = cache->slab_size;
+    cls->objects_per_slab = per_slab;
+    size_t bytes_live = cls->objects_live * stride;
+#if MM_HARDENING == MM_HARDENING_OFF
+    cls->bytes_requested = stats.classes[i].bytes_requested < bytes_live
+                               ? stats.classes[i].bytes_requested
+                               : bytes_live;
+#endif
+    cls->bytes_reserved = cls->slabs * cache->slab_size;
+    cls->bytes_hardening = cls->objects_live * MM_HARDENING_OVERHEAD;
+    cls->bytes_padding =
+        bytes_live - cls->bytes_requested - cls->bytes_hardening;
+    cls->bytes_free = (cls->slabs * per_slab - cls->objects_live) * stride;
+    cls->bytes_slab_overhead =
+        cls->slabs * (cache->slab_size - per_slab * stride);
+    size_t slabs_needed = (cls->objects_live + per_slab - 1) / per_slab;
+    cls->bytes_reclaimable = (cls->slabs - slabs_needed) * cache->slab_size;
+    mm_frag_add(&report->total, cls);
+  }
+  return 0;
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+int mm_frag_dump(enum mm_stats_format format, mm_stats_write_fn write,
+                 void *arg)
+#else
+int mm_frag_dump(enum mm_stats_format format, mm_stats_write_fn write,
+                 void *arg, struct slab_cache *cache_array,
+                 size_t cache_array_size)
+#endif
+{
+  struct mm_frag_report report;
+  if (mm_frag_get(&report
+#ifdef NO_GLOBAL_SLAB_CACHE_ARRAY
+                  ,
+                  cache_array, cache_array_size
+#endif
+                  ) != 0) {
+    return -1;
+  }
+  stats_format_frag(&report, format, write, arg);
+  return 0;
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+void mm_prefork() {
+  spin_lock(&global_slab_cache_lock);
+  if (__atomic_load_n(&global_slab_cache_ready, __ATOMIC_ACQUIRE)) {
+    for (size_t i = 0; i < MAX_SLAB_CACHES; i++) {
+      slab_cache_lock_all(&global_slab_cache_array[i]);
+    }
+  }
+  stats_lock_all();
+  guarded_lock();
+  profile_lock();
+}
+
+void mm_postfork() {
+  // spin locks have no owner, so the child may release the parent's locks
+  profile_unlock();
+  guarded_unlock();
+  stats_unlock_all();
+  if (__atomic_load_n(&global_slab_cache_ready, __ATOMIC_ACQUIRE)) {
+    for (size_t i = MAX_SLAB_CACHES; i-- > 0;) {
+      slab_cache_unlock_all(&global_slab_cache_array[i]);
+    }
+  }
+  spin_unlock(&global_slab_cache_lock);
+}
+#endif
@@ -0,0 +1,107 @@
+#include "pagemap.h"
+
+#define NULPTR ((void *)0)
+#define PAGEMAP_LEVEL_BITS 12
+#define PAGEMAP_LEVEL_LEN (1UL << PAGEMAP_LEVEL_BITS)
+#define PAGEMAP_LEVEL_MASK (PAGEMAP_LEVEL_LEN - 1)
+// number of page-number bits covered by the three levels
+#define PAGEMAP_BITS (PAGEMAP_LEVEL_BITS * 3)
+// temp code
+extern void *bulk_alloc(size_t size);
+extern void bulk_free(void *ptr, size_t size);
+
+struct pagemap_leaf {
+  void *owners[PAGEMAP_LEVEL_LEN];
+};
+struct pagemap_mid {
+  struct pagemap_leaf *leaves[PAGEMAP_LEVEL_LEN];
+};
+static struct pagemap_mid *pagemap_root[PAGEMAP_LEVEL_LEN];
+
+/**
+alloc a zeroed radix node and publish it in *slot. if another thread won the
+race, the node it installed is returned instead.
+*/
+static void *pagemap_node_get(void **slot, size_t node_size) {
+  void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (node) {
+    return node;
+  }
+  node = bulk_alloc(node_size);
+  if (node == NULPTR) {
+    return NULPTR;
+  }
+  for (size_t i = 0; i < node_size / sizeof(void *); i++) {
+    ((void **)node)[i] = NULPTR;
+  }
+  void *expected = NULPTR;
+  if (!__atomic_compare_exchange_n(slot, &expected, node, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    bulk_free(node, node_size);
+    return expected;
+  }
+  return node;
+}
+
+static struct pagemap_leaf *pagemap_leaf_of(unsigned long long page,
+                                            bool create) {
+  size_t root_index = (page >> (PAGEMAP_LEVEL_BITS * 2)) & PAGEMAP_LEVEL_MASK;
+  size_t mid_index = (page >> PAGEMAP_LEVEL_BITS) & PAGEMAP_LEVEL_MASK;
+  struct pagemap_mid *mid;
+  struct pagemap_leaf *leaf;
+  if (create) {
+    mid = (struct pagemap_mid *)pagemap_node_get(
+        (void **)&pagemap_root[root_index], sizeof(struct pagemap_mid));
+    if (mid == NULPTR) {
+      return (struct pagemap_leaf *)NULPTR;
+    }
+    leaf = (struct pagemap_leaf *)pagemap_node_get(
+        (void **)&mid->leaves[mid_index], sizeof(struct pagemap_leaf));
+  } else {
+    mid = __atomic_load_n(&pagemap_root[root_index], __ATOMIC_ACQUIRE);
+    if (mid == NULPTR) {
+      return (struct pagemap_leaf *)NULPTR;
+    }
+    leaf = __atomic_load_n(&mid->leaves[mid_index], __ATOMIC_ACQUIRE);
+  }
+  return leaf;
+}
+
+int pagemap_set(const void *addr, size_t size, void *owner) {
+  unsigned long long first = (unsigned long long)addr >> PAGE_SHIFT;
+  unsigned long long last =
+      ((unsigned long long)addr + size - 1) >> PAGE_SHIFT;
+  if (size == 0) {
+    return 0;
+  }
+  if ((last >> PAGEMAP_BITS) != 0) {
+    LOG("pagemap: address %p is out of the mapped range.\n", addr);
+    return -1;
+  }
+  for (unsigned long long page = first; page <= last; page++) {
+    struct pagemap_leaf *leaf = pagemap_leaf_of(page, owner != NULPTR);
+    if (leaf == NULPTR) {
+      if (owner == NULPTR) {
+        // nothing was registered for this page
+        continue;
+      }
+      return -1;
+    }
+    __atomic_store_n(&leaf->owners[page & PAGEMAP_LEVEL_MASK], owner,
+                     __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+void *pagemap_get(const void *addr) {
+  unsigned long long page = (unsigned long long)addr >> PAGE_SHIFT;
+  if ((page >> PAGEMAP_BITS) != 0) {
+    return NULPTR;
+  }
+  struct pagemap_leaf *leaf = pagemap_leaf_of(page, false);
+  if (leaf == NULPTR) {
+    return NULPTR;
+  }
+  return __atomic_load_n(&leaf->owners[page & PAGEMAP_LEVEL_MASK],
+                         __ATOMIC_ACQUIRE);
+}
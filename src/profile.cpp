@@ -0,0 +1,433 @@
+#include "profile.h"
+#include "spinlock.h"
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <unwind.h>
+
+#define NULPTR ((void *)0)
+// temp code
+extern void *bulk_alloc(size_t size);
+extern void bulk_free(void *ptr, size_t size);
+
+// bytes between two looks at the rate while the profiler is off
+#define PROFILE_RECHECK (4LL << 20)
+// open addressing tables, kept at most three quarters full
+#define PROFILE_BUCKETS_TABLE (PROFILE_BUCKETS_MAX * 4 / 3 + 1)
+#define PROFILE_SAMPLES_TABLE (PROFILE_SAMPLES_MAX * 2)
+static_assert((PROFILE_SAMPLES_TABLE & (PROFILE_SAMPLES_TABLE - 1)) == 0,
+              "the sample table is indexed with a mask");
+
+// the sampled objects of one call site
+struct profile_bucket {
+  unsigned long long hash;
+  size_t depth;
+  void *frames[PROFILE_STACK_DEPTH];
+  size_t alloc_count;
+  size_t alloc_bytes;
+  size_t live_count;
+  size_t live_bytes;
+};
+
+struct profile_sample {
+  // NULL for an unused entry
+  void *ptr;
+  size_t size;
+  struct profile_bucket *bucket;
+};
+
+static struct {
+  struct profile_bucket *buckets;
+  struct profile_sample *samples;
+  struct profile_stats stats;
+  // the tables could not be mapped
+  bool failed;
+  struct spinlock lock;
+} profile = {};
+
+static size_t profile_rate;
+size_t profile_live;
+__thread long long profile_countdown __attribute__((tls_model("initial-exec")));
+// the countdown was drawn from the rate, so reaching 0 is a sample
+static __thread bool profile_armed __attribute__((tls_model("initial-exec")));
+// the thread is recording a sample: allocations made by the unwinder are not
+static __thread bool profile_busy __attribute__((tls_model("initial-exec")));
+static __thread unsigned long long profile_rng
+    __attribute__((tls_model("initial-exec")));
+
+void profile_set_rate(size_t rate) {
+  __atomic_store_n(&profile_rate, rate, __ATOMIC_RELAXED);
+}
+
+// xorshift64, seeded per thread
+static unsigned long long profile_random() {
+  if (profile_rng == 0) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    profile_rng = ((unsigned long long)ts.tv_nsec << 20) ^
+                  (unsigned long long)&profile_rng ^ 0x9e3779b97f4a7c15ULL;
+  }
+  profile_rng ^= profile_rng << 13;
+  profile_rng ^= profile_rng >> 7;
+  profile_rng ^= profile_rng << 17;
+  return profile_rng;
+}
+
+// bytes to the next sample: exponential with mean rate, at least 1
+static long long profile_next(size_t rate) {
+  // uniform in (0, 1]
+  double u = ((profile_random() >> 11) + 1) * (1.0 / 9007199254740992.0);
+  double bytes = -log(u) * (double)rate;
+  if (bytes >= 9e18) {
+    bytes = 9e18;
+  }
+  return (long long)bytes + 1;
+}
+
+bool profile_sample_slow() {
+  if (profile_busy) {
+    return false;
+  }
+  size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+  bool hit = profile_armed && rate != 0;
+  profile_armed = rate != 0;
+  profile_countdown = rate ? profile_next(rate) : PROFILE_RECHECK;
+  return hit;
+}
+
+struct profile_unwind {
+  struct profile_bucket *stack;
+  // frames of the profiler itself to leave out
+  size_t skip;
+};
+
+static _Unwind_Reason_Code profile_unwind_frame(struct _Unwind_Context *ctx,
+                                                void *arg) {
+  struct profile_unwind *unwind = (struct profile_unwind *)arg;
+  if (unwind->skip) {
+    unwind->skip--;
+    return _URC_NO_REASON;
+  }
+  struct profile_bucket *stack = unwind->stack;
+  if (stack->depth == PROFILE_STACK_DEPTH) {
+    return _URC_END_OF_STACK;
+  }
+  void *ip = (void *)_Unwind_GetIP(ctx);
+  if (ip == NULPTR) {
+    return _URC_END_OF_STACK;
+  }
+  stack->frames[stack->depth++] = ip;
+  return _URC_NO_REASON;
+}
+
+static unsigned long long profile_hash(const struct profile_bucket *stack) {
+  // FNV-1a over the frame addresses
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < stack->depth; i++) {
+    hash ^= (unsigned long long)stack->frames[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static inline size_t profile_ptr_slot(const void *ptr) {
+  unsigned long long key = (unsigned long long)ptr * 0x9e3779b97f4a7c15ULL;
+  return (size_t)(key >> 32) & (PROFILE_SAMPLES_TABLE - 1);
+}
+
+// map the tables. the caller holds the lock.
+static bool profile_init() {
+  if (profile.failed) {
+    return false;
+  }
+  if (profile.buckets != NULPTR) {
+    return true;
+  }
+  // bulk_alloc hands out zeroed memory
+  profile.buckets = (struct profile_bucket *)bulk_alloc(
+      sizeof(struct profile_bucket) * PROFILE_BUCKETS_TABLE);
+  profile.samples = (struct profile_sample *)bulk_alloc(
+      sizeof(struct profile_sample) * PROFILE_SAMPLES_TABLE);
+  if (profile.buckets == NULPTR || profile.samples == NULPTR) {
+    LOG("profile: failed to map the tables, sampling stops.\n");
+    if (profile.buckets) {
+      bulk_free(profile.buckets,
+                sizeof(struct profile_bucket) * PROFILE_BUCKETS_TABLE);
+    }
+    if (profile.samples) {
+      bulk_free(profile.samples,
+                sizeof(struct profile_sample) * PROFILE_SAMPLES_TABLE);
+    }
+    profile.buckets = (struct profile_bucket *)NULPTR;
+    profile.samples = (struct profile_sample *)NULPTR;
+    profile.failed = true;
+    return false;
+  }
+  return true;
+}
+
+// find or add the bucket of stack. the caller holds the lock.
+static struct profile_bucket *
+profile_bucket_get(const struct profile_bucket *stack) {
+  size_t i = stack->hash % PROFILE_BUCKETS_TABLE;
+  for (;; i = (i + 1) % PROFILE_BUCKETS_TABLE) {
+    struct profile_bucket *bucket = &profile.buckets[i];
+    if (bucket->depth == 0) {
+      break;
+    }
+    if (bucket->hash == stack->hash && bucket->depth == stack->depth) {
+      size_t j = 0;
+      while (j < stack->depth && bucket->frames[j] == stack->frames[j]) {
+        j++;
+      }
+      if (j == stack->depth) {
+        return bucket;
+      }
+    }
+  }
+  if (profile.stats.buckets == PROFILE_BUCKETS_MAX) {
+    return (struct profile_bucket *)NULPTR;
+  }
+  struct profile_bucket *bucket = &profile.buckets[i];
+  *bucket = *stack;
+  profile.stats.buckets++;
+  return bucket;
+}
+
+// find the entry of ptr. the caller holds the lock.
+static struct profile_sample *profile_sample_find(const void *ptr) {
+  for (size_t i = profile_ptr_slot(ptr);;
+       i = (i + 1) & (PROFILE_SAMPLES_TABLE - 1)) {
+    struct profile_sample *sample = &profile.samples[i];
+    if (sample->ptr == ptr || sample->ptr == NULPTR) {
+      return sample;
+    }
+  }
+}
+
+/**
+remove an entry, shifting the entries after it back so that no probe
+sequence is broken. the caller holds the lock.
+*/
+static void profile_sample_remove(struct profile_sample *sample) {
+  size_t hole = sample - profile.samples;
+  size_t i = hole;
+  for (;;) {
+    i = (i + 1) & (PROFILE_SAMPLES_TABLE - 1);
+    struct profile_sample *next = &profile.samples[i];
+    if (next->ptr == NULPTR) {
+      break;
+    }
+    // an entry can fill the hole if its home slot is not between the hole
+    // and where it sits
+    size_t home = profile_ptr_slot(next->ptr);
+    if (((i - home) & (PROFILE_SAMPLES_TABLE - 1)) >=
+        ((i - hole) & (PROFILE_SAMPLES_TABLE - 1))) {
+      profile.samples[hole] = *next;
+      hole = i;
+    }
+  }
+  profile.samples[hole].ptr = NULPTR;
+}
+
+void profile_record(void *ptr, size_t size, struct slab *slab) {
+  // this function and the allocator function that called it
+  struct profile_bucket stack;
+  struct profile_unwind unwind = {&stack, 2};
+  stack.depth = 0;
+  profile_busy = true;
+  _Unwind_Backtrace(profile_unwind_frame, &unwind);
+  profile_busy = false;
+  if (stack.depth == 0) {
+    return;
+  }
+  stack.hash = profile_hash(&stack);
+  stack.alloc_count = stack.alloc_bytes = 0;
+  stack.live_count = stack.live_bytes = 0;
+
+  spin_lock(&profile.lock);
+  if (!profile_init()) {
+    spin_unlock(&profile.lock);
+    return;
+  }
+  profile.stats.samples++;
+  struct profile_bucket *bucket = profile_bucket_get(&stack);
+  if (bucket == NULPTR || profile.stats.live == PROFILE_SAMPLES_MAX) {
+    profile.stats.dropped++;
+    spin_unlock(&profile.lock);
+    return;
+  }
+  bucket->alloc_count++;
+  bucket->alloc_bytes += size;
+  bucket->live_count++;
+  bucket->live_bytes += size;
+  struct profile_sample *sample = profile_sample_find(ptr);
+  sample->ptr = ptr;
+  sample->size = size;
+  sample->bucket = bucket;
+  profile.stats.live++;
+  __atomic_store_n(&profile_live, profile.stats.live, __ATOMIC_RELAXED);
+  if (slab) {
+    __atomic_fetch_add(&slab->sampled, 1, __ATOMIC_RELAXED);
+  }
+  spin_unlock(&profile.lock);
+}
+
+void profile_free(void *ptr, struct slab *slab) {
+  spin_lock(&profile.lock);
+  if (profile.samples == NULPTR) {
+    spin_unlock(&profile.lock);
+    return;
+  }
+  struct profile_sample *sample = profile_sample_find(ptr);
+  if (sample->ptr == ptr) {
+    sample->bucket->live_count--;
+    sample->bucket->live_bytes -= sample->size;
+    profile_sample_remove(sample);
+    profile.stats.live--;
+    __atomic_store_n(&profile_live, profile.stats.live, __ATOMIC_RELAXED);
+    if (slab) {
+      __atomic_fetch_sub(&slab->sampled, 1, __ATOMIC_RELAXED);
+    }
+  }
+  spin_unlock(&profile.lock);
+}
+
+void profile_move(void *old_ptr, void *new_ptr) {
+  spin_lock(&profile.lock);
+  if (profile.samples == NULPTR) {
+    spin_unlock(&profile.lock);
+    return;
+  }
+  struct profile_sample *sample = profile_sample_find(old_ptr);
+  if (sample->ptr == old_ptr) {
+    struct profile_sample moved = *sample;
+    profile_sample_remove(sample);
+    moved.ptr = new_ptr;
+    *profile_sample_find(new_ptr) = moved;
+  }
+  spin_unlock(&profile.lock);
+}
+
+void profile_get_stats(struct profile_stats *stats) {
+  spin_lock(&profile.lock);
+  *stats = profile.stats;
+  spin_unlock(&profile.lock);
+}
+
+void profile_lock() { spin_lock(&profile.lock); }
+
+void profile_unlock() { spin_unlock(&profile.lock); }
+
+/**
+a small buffered writer like the one of mm_stats_dump, so dumping needs
+neither libc nor memory.
+*/
+struct profile_writer {
+  mm_stats_write_fn write;
+  void *arg;
+  size_t len;
+  char buf[256];
+};
+
+static void out_flush(struct profile_writer *w) {
+  if (w->len) {
+    w->write(w->arg, w->buf, w->len);
+    w->len = 0;
+  }
+}
+
+static void out_char(struct profile_writer *w, char c) {
+  if (w->len == sizeof(w->buf)) {
+    out_flush(w);
+  }
+  w->buf[w->len++] = c;
+}
+
+static void out_str(struct profile_writer *w, const char *s) {
+  while (*s) {
+    out_char(w, *s++);
+  }
+}
+
+static void out_num(struct profile_writer *w, unsigned long long v,
+                    unsigned int base) {
+  char digits[24];
+  int n = 0;
+  do {
+    digits[n++] = "0123456789abcdef"[v % base];
+    v /= base;
+  } while (v);
+  while (n) {
+    out_char(w, digits[--n]);
+  }
+}
+
+// "live_count: live_bytes [alloc_count: alloc_bytes] @"
+static void out_counts(struct profile_writer *w,
+                       const struct profile_bucket *b) {
+  out_num(w, b->live_count, 10);
+  out_str(w, ": ");
+  out_num(w, b->live_bytes, 10);
+  out_str(w, " [");
+  out_num(w, b->alloc_count, 10);
+  out_str(w, ": ");
+  out_num(w, b->alloc_bytes, 10);
+  out_str(w, "] @");
+}
+
+void profile_dump(mm_stats_write_fn write, void *arg) {
+  struct profile_writer w;
+  w.write = write;
+  w.arg = arg;
+  w.len = 0;
+  // the buckets are only ever added, so they are copied one at a time and
+  // written without the lock
+  struct profile_bucket total = {};
+  spin_lock(&profile.lock);
+  size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+  for (size_t i = 0; profile.buckets && i < PROFILE_BUCKETS_TABLE; i++) {
+    total.live_count += profile.buckets[i].live_count;
+    total.live_bytes += profile.buckets[i].live_bytes;
+    total.alloc_count += profile.buckets[i].alloc_count;
+    total.alloc_bytes += profile.buckets[i].alloc_bytes;
+  }
+  spin_unlock(&profile.lock);
+  out_str(&w, "heap profile: ");
+  out_counts(&w, &total);
+  out_str(&w, " heap_v2/");
+  out_num(&w, rate, 10);
+  out_char(&w, '\n');
+  for (size_t i = 0; i < PROFILE_BUCKETS_TABLE; i++) {
+    struct profile_bucket bucket;
+    spin_lock(&profile.lock);
+    if (profile.buckets == NULPTR) {
+      spin_unlock(&profile.lock);
+      break;
+    }
+    bucket = profile.buckets[i];
+    spin_unlock(&profile.lock);
+    if (bucket.depth == 0) {
+      continue;
+    }
+    out_counts(&w, &bucket);
+    for (size_t j = 0; j < bucket.depth; j++) {
+      out_str(&w, " 0x");
+      out_num(&w, (unsigned long long)bucket.frames[j], 16);
+    }
+    out_char(&w, '\n');
+  }
+  // pprof maps the addresses to binaries with the memory map
+  out_str(&w, "\nMAPPED_LIBRARIES:\n");
+  out_flush(&w);
+  int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  ssize_t len;
+  while ((len = read(fd, w.buf, sizeof(w.buf))) > 0) {
+    write(arg, w.buf, (size_t)len);
+  }
+  close(fd);
+}
@@ -0,0 +1,132 @@
+#include "region.h"
+
+#define NULPTR ((void *)0)
+#define ALIGN_UP(v, alignment) (((v) + (alignment) - 1) & ~((alignment) - 1))
+// temp code
+// bulk_alloc_huge hands out REGION_SIZE aligned, zero-filled memory in
+// multiples of REGION_SIZE, backed by huge pages where the system allows.
+// a page source without huge pages need not define them, regions are then
+// simply never used; neither are they if it defines only one of the two.
+extern void *bulk_alloc_huge(size_t size) __attribute__((weak));
+extern void bulk_free_huge(void *ptr, size_t size) __attribute__((weak));
+
+// slots take whole pages, so every slab starts page aligned like one from
+// bulk_alloc, even if its size is not a multiple of pages: caches aligned
+// above PAGE_SIZE size their slabs for the worst case padding
+static inline size_t region_slot_size(size_t slab_size) {
+  return ALIGN_UP(slab_size, PAGE_SIZE);
+}
+
+static inline void *region_slot(struct slab_region *region, size_t slot,
+                                size_t slab_size) {
+  return (void *)((unsigned long long)region + PAGE_SIZE +
+                  slot * region_slot_size(slab_size));
+}
+
+static struct slab_region *region_create(size_t slab_size) {
+  if (!bulk_alloc_huge || !bulk_free_huge) {
+    return (struct slab_region *)NULPTR;
+  }
+  struct slab_region *region =
+      (struct slab_region *)bulk_alloc_huge(REGION_SIZE);
+  if (region == NULPTR) {
+    return (struct slab_region *)NULPTR;
+  }
+  // the memory is zero, so are the bitmaps
+  region->slots_num = (REGION_SIZE - PAGE_SIZE) / region_slot_size(slab_size);
+  return region;
+}
+
+// get the first free slot of region, which has one
+static size_t region_find_slot(struct slab_region *region) {
+  for (size_t i = 0;; i++) {
+    if (~region->used[i]) {
+      return i * 64 + __builtin_ctzll(~region->used[i]);
+    }
+  }
+}
+
+static void region_unlink(struct region_pool *pool,
+                          struct slab_region *region) {
+  if (region->prev) {
+    region->prev->next = region->next;
+  } else {
+    pool->regions = region->next;
+  }
+  if (region->next) {
+    region->next->prev = region->prev;
+  }
+}
+
+static void region_push_front(struct region_pool *pool,
+                              struct slab_region *region) {
+  region->prev = (struct slab_region *)NULPTR;
+  region->next = pool->regions;
+  if (pool->regions) {
+    pool->regions->prev = region;
+  }
+  pool->regions = region;
+}
+
+void *region_alloc_slab(struct region_pool *pool, size_t slab_size,
+                        bool *fresh) {
+  if (region_slot_size(slab_size) > REGION_SIZE - PAGE_SIZE) {
+    return NULPTR;
+  }
+  spin_lock(&pool->lock);
+  struct slab_region *region = pool->regions;
+  while (region && region->slots_used == region->slots_num) {
+    region = region->next;
+  }
+  if (region == NULPTR) {
+    region = region_create(slab_size);
+    if (region == NULPTR) {
+      spin_unlock(&pool->lock);
+      return NULPTR;
+    }
+    region_push_front(pool, region);
+    pool->regions_num++;
+  }
+  size_t slot = region_find_slot(region);
+  unsigned long long bit = 1ULL << (slot % 64);
+  region->used[slot / 64] |= bit;
+  *fresh = !(region->dirty[slot / 64] & bit);
+  region->dirty[slot / 64] |= bit;
+  region->slots_used++;
+  pool->slots_used++;
+  spin_unlock(&pool->lock);
+  return region_slot(region, slot, slab_size);
+}
+
+void region_free_slab(struct region_pool *pool, void *slab, size_t slab_size) {
+  struct slab_region *region =
+      (struct slab_region *)((unsigned long long)slab & ~(REGION_SIZE - 1));
+  size_t slot =
+      ((unsigned long long)slab - (unsigned long long)region - PAGE_SIZE) /
+      region_slot_size(slab_size);
+  spin_lock(&pool->lock);
+  region->used[slot / 64] &= ~(1ULL << (slot % 64));
+  region->slots_used--;
+  pool->slots_used--;
+  if (region->slots_used == 0) {
+    region_unlink(pool, region);
+    pool->regions_num--;
+    spin_unlock(&pool->lock);
+    bulk_free_huge(region, REGION_SIZE);
+    return;
+  }
+  // the next slab is taken from the region that just got a free slot, so
+  // partly used regions fill up before new ones are reserved
+  region_unlink(pool, region);
+  region_push_front(pool, region);
+  spin_unlock(&pool->lock);
+}
+
+void region_pool_stats(struct region_pool *pool, size_t slab_size,
+                       size_t *regions_num, size_t *bytes_unused) {
+  spin_lock(&pool->lock);
+  *regions_num = pool->regions_num;
+  *bytes_unused = pool->regions_num * REGION_SIZE -
+                  pool->slots_used * region_slot_size(slab_size);
+  spin_unlock(&pool->lock);
+}
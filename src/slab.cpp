@@ -1,63 +1,329 @@
 #include "slab.h"
+#include "pagemap.h"
+#include <sched.h>
 
 #define NULPTR ((void *)0)
 #define ALIGN_UP(v, alignment) (((v) + (alignment) - 1) & ~((alignment) - 1))
 // temp code
+// bulk_alloc must return memory aligned to PAGE_SIZE, see pagemap.h, and
+// filled with zeros, like fresh pages from mmap
 extern void *bulk_alloc(size_t size);
 extern void bulk_free(void *ptr, size_t size);
 
+/**
+get the size of the metadata at the start of a slab of objects_num objects:
+struct slab and the freelist array or the bitmap.
+*/
+static size_t slab_metadata_size(enum slab_freelist_kind kind,
+                                 size_t objects_num) {
+  switch (kind) {
+  case SLAB_FREELIST_INDEX:
+    return sizeof(struct slab) + sizeof(short) * objects_num;
+  case SLAB_FREELIST_BITMAP:
+    return sizeof(struct slab) +
+           sizeof(unsigned long long) * ((objects_num + 63) / 64);
+  default:
+    return sizeof(struct slab);
+  }
+}
+
+/**
+get the size of a slab holding objects_num objects: the slab metadata, the
+padding up to the aligned objects area and the objects themselves.
+bulk_alloc returns page aligned memory, so the padding is known exactly for
+alignments up to PAGE_SIZE.
+*/
+static size_t slab_layout_size(enum slab_freelist_kind kind,
+                               size_t aligned_object_size, size_t alignment,
+                               size_t objects_num) {
+  size_t metadata_size = slab_metadata_size(kind, objects_num);
+  size_t objects_total_size = aligned_object_size * objects_num;
+  if (alignment <= PAGE_SIZE) {
+    return ALIGN_UP(metadata_size, alignment) + objects_total_size;
+  }
+  // The maximum padding needed is (alignment - 1).
+  return metadata_size + (alignment - 1) + objects_total_size;
+}
+
+/**
+get how many objects fit into a slab of slab_size bytes, at most
+SLAB_OBJECTS_MAX for a SLAB_FREELIST_INDEX. returns 0 if not even one does.
+*/
+static size_t slab_objects_fit(enum slab_freelist_kind kind, size_t slab_size,
+                               size_t aligned_object_size, size_t alignment) {
+  // with an index array every object needs (aligned_object_size +
+  // sizeof(short)) bytes, because the freelist has one "short" for each
+  size_t per_object = aligned_object_size;
+  if (kind == SLAB_FREELIST_INDEX) {
+    per_object += sizeof(short);
+  }
+  size_t objects_num = (slab_size - sizeof(struct slab)) / per_object;
+  if (kind == SLAB_FREELIST_INDEX && objects_num > SLAB_OBJECTS_MAX) {
+    objects_num = SLAB_OBJECTS_MAX;
+  }
+  // the padding of the objects area, or the bitmap, may cost objects
+  while (objects_num > 0 &&
+         slab_layout_size(kind, aligned_object_size, alignment, objects_num) >
+             slab_size) {
+    objects_num--;
+  }
+  return objects_num;
+}
+
+/**
+pick the slab size of a cache: the fewest pages, in powers of two up to
+SLAB_PAGES_MAX, whose tail, the bytes left after the last object, is at most
+SLAB_WASTE_MAX_PERCENT of the slab. if none is that good, the one with the
+smallest share of tail is taken. sets *objects_num to the objects it holds.
+*/
+static size_t slab_size_pick(enum slab_freelist_kind kind,
+                             size_t aligned_object_size, size_t alignment,
+                             size_t *objects_num) {
+  size_t best_size = 0;
+  size_t best_waste = 0;
+  *objects_num = 0;
+  for (size_t pages = 1; pages <= SLAB_PAGES_MAX; pages *= 2) {
+    size_t slab_size = pages * PAGE_SIZE;
+    size_t num =
+        slab_objects_fit(kind, slab_size, aligned_object_size, alignment);
+    if (num == 0) {
+      continue;
+    }
+    size_t waste = slab_size - slab_layout_size(kind, aligned_object_size,
+                                                alignment, num);
+    // compare the shares waste / slab_size without dividing
+    if (best_size == 0 || waste * best_size < best_waste * slab_size) {
+      best_size = slab_size;
+      best_waste = waste;
+      *objects_num = num;
+    }
+    if (waste * 100 <= slab_size * SLAB_WASTE_MAX_PERCENT) {
+      break;
+    }
+  }
+  if (best_size == 0) {
+    // too large even for the largest slab: a slab of one object
+    *objects_num = 1;
+    best_size = slab_layout_size(kind, aligned_object_size, alignment, 1);
+  }
+  return best_size;
+}
+
+/**
+get the number of colors of cache: how many color_step shifts of the objects
+area fit into what its slabs leave unused, plus the unshifted one.
+*/
+static size_t slab_colors_max(struct slab_cache *cache) {
+  size_t aligned_object_size = ALIGN_UP(cache->object_size, cache->alignment);
+  size_t used =
+      slab_layout_size(cache->freelist_kind, aligned_object_size,
+                       cache->alignment, cache->objects_num_per_slab);
+  if (cache->alignment > PAGE_SIZE) {
+    // the padding of the objects area is only known at runtime
+    return 1;
+  }
+  return (cache->slab_size - used) / cache->color_step + 1;
+}
+
+/**
+set the slab size, objects per slab and colors of cache for its object layout
+and freelist kind.
+*/
+static void slab_cache_layout(struct slab_cache *cache) {
+  size_t alignment = cache->alignment;
+  size_t aligned_object_size = ALIGN_UP(cache->object_size, alignment);
+  cache->slab_size =
+      slab_size_pick(cache->freelist_kind, aligned_object_size, alignment,
+                     &cache->objects_num_per_slab);
+  if (alignment <= PAGE_SIZE) {
+    // the page source hands out whole pages: the rest of the last one is
+    // free to color the slabs with
+    cache->slab_size = ALIGN_UP(cache->slab_size, PAGE_SIZE);
+  } else {
+    // the padding is only known at runtime, so the slab is as large as the
+    // worst case needs
+    cache->slab_size =
+        slab_layout_size(cache->freelist_kind, aligned_object_size, alignment,
+                         cache->objects_num_per_slab);
+  }
+  cache->colors_num = slab_colors_max(cache);
+}
+
 void slab_cache_init(struct slab_cache *cache, size_t object_size,
                      size_t alignment, void (*ctor)(void *, size_t),
                      void (*dtor)(void *, size_t)) {
   cache->object_size = object_size;
   cache->alignment = alignment;
-  size_t aligned_object_size = ALIGN_UP(object_size, alignment);
-  // calculate how many objects can fit in one slab
-  // because we need one "short" for each object in the freelist
-  // that equals every object needs (aligned_object_size + sizeof(short)) bytes
-
-  cache->objects_num_per_slab =
-      (SLAB_SIZE - sizeof(struct slab)) / (aligned_object_size + sizeof(short));
+  cache->freelist_kind = SLAB_FREELIST_INDEX;
+  // a step of the alignment keeps the objects aligned
+  cache->color_step = alignment > SLAB_CACHE_LINE ? alignment : SLAB_CACHE_LINE;
+  slab_cache_layout(cache);
   cache->slabs_full = (struct slab *)NULPTR;
   cache->slabs_partial = (struct slab *)NULPTR;
   cache->slabs_empty = (struct slab *)NULPTR;
   cache->ctor = ctor;
   cache->dtor = dtor;
+  spin_init(&cache->lock);
+  cache->shards = (struct slab_cache *)NULPTR;
+  cache->shards_num = 0;
+  cache->parent = (struct slab_cache *)NULPTR;
+  cache->color_next = 0;
+  cache->huge = false;
+  cache->regions = REGION_POOL_INIT;
+  cache->slabs_empty_num = 0;
+  cache->empty_slabs_max = SLAB_EMPTY_MAX_DEFAULT;
+  cache->decay_epochs = SLAB_DECAY_EPOCHS_DEFAULT;
+  cache->epoch = 0;
+  cache->slabs_created = 0;
+  cache->slabs_released = 0;
+  cache->remote_free = NULPTR;
 }
 
-struct slab *create_slab(struct slab_cache *cache) {
-  size_t aligned_object_size = ALIGN_UP(cache->object_size, cache->alignment);
+int slab_cache_shard(struct slab_cache *cache, size_t shards_num) {
+  struct slab_cache *shards = (struct slab_cache *)bulk_alloc(
+      sizeof(struct slab_cache) * shards_num);
+  if (shards == NULPTR) {
+    return -1;
+  }
+  for (size_t i = 0; i < shards_num; i++) {
+    slab_cache_init(&shards[i], cache->object_size, cache->alignment,
+                    cache->ctor, cache->dtor);
+    shards[i].parent = cache;
+    shards[i].freelist_kind = cache->freelist_kind;
+    shards[i].slab_size = cache->slab_size;
+    shards[i].objects_num_per_slab = cache->objects_num_per_slab;
+    shards[i].empty_slabs_max = cache->empty_slabs_max;
+    shards[i].decay_epochs = cache->decay_epochs;
+    shards[i].colors_num = cache->colors_num;
+    // shards start at different colors, like the slabs of one cache
+    shards[i].color_next = i;
+  }
+  cache->shards = shards;
+  cache->shards_num = shards_num;
+  return 0;
+}
+
+static struct slab_cache *slab_cache_current_shard(struct slab_cache *cache) {
+  int cpu = sched_getcpu();
+  if (cpu < 0) {
+    cpu = 0;
+  }
+  return &cache->shards[(size_t)cpu % cache->shards_num];
+}
+
+// get the cache whose settings and regions a cache or shard uses
+static inline struct slab_cache *slab_cache_top(struct slab_cache *cache) {
+  return cache->parent ? cache->parent : cache;
+}
+
+/**
+get the memory of a new slab of cache: from its huge page regions if it uses
+them and they can give one, otherwise from bulk_alloc. *fresh tells whether
+the memory is still zero.
+*/
+static void *slab_pages_alloc(struct slab_cache *cache, bool *in_region,
+                              bool *fresh) {
+  struct slab_cache *top = slab_cache_top(cache);
+  *fresh = true;
+  if (top->huge) {
+    void *mem = region_alloc_slab(&top->regions, cache->slab_size, fresh);
+    if (mem) {
+      *in_region = true;
+      return mem;
+    }
+  }
+  *in_region = false;
+  return bulk_alloc(cache->slab_size);
+}
+
+static void slab_pages_free(struct slab_cache *cache, void *mem,
+                            bool in_region) {
+  if (in_region) {
+    region_free_slab(&slab_cache_top(cache)->regions, mem, cache->slab_size);
+  } else {
+    bulk_free(mem, cache->slab_size);
+  }
+}
+
+// the link of a block in a free list, of a slab or a remote one, is stored in
+// its first bytes. blocks need not be pointer aligned, so it is accessed with
+// memcpy.
+static void *block_next(void *block) {
+  void *next;
+  __builtin_memcpy(&next, block, sizeof(void *));
+  return next;
+}
+static void block_set_next(void *block, void *next) {
+  __builtin_memcpy(block, &next, sizeof(void *));
+}
 
+struct slab *create_slab(struct slab_cache *cache) {
   // 1. Calculate required size
   // We need space for the slab metadata, all the objects, AND the padding
-  // needed for alignment. The maximum padding needed is (alignment - 1).
-  size_t objects_total_size = aligned_object_size * cache->objects_num_per_slab;
-  size_t freelist_array_size = sizeof(short) * cache->objects_num_per_slab;
-  size_t metadata_size = sizeof(struct slab) + freelist_array_size;
-  size_t slab_size =
-      metadata_size + objects_total_size + (cache->alignment - 1);
-
-  void *slab_mem = bulk_alloc(slab_size);
+  // needed for alignment.
+  size_t metadata_size =
+      slab_metadata_size(cache->freelist_kind, cache->objects_num_per_slab);
+  size_t slab_size = cache->slab_size;
+
+  bool in_region;
+  bool fresh;
+  void *slab_mem = slab_pages_alloc(cache, &in_region, &fresh);
   if (slab_mem == NULPTR) {
     return (struct slab *)NULPTR;
   }
 
   struct slab *new_slab = (struct slab *)slab_mem;
+  // register the pages so that slab_of() can find this slab from any object
+  if (pagemap_set(slab_mem, slab_size, new_slab) != 0) {
+    pagemap_set(slab_mem, slab_size, NULPTR);
+    slab_pages_free(cache, slab_mem, in_region);
+    return (struct slab *)NULPTR;
+  }
+  new_slab->cache = cache;
 
   // 2. Calculate the aligned starting address for the objects area.
   // This is the first address after the slab metadata that is a multiple of
   // `cache->alignment`.
   void *objects_start = (void *)ALIGN_UP(
       (unsigned long long)slab_mem + metadata_size, cache->alignment);
+  // 3. Shift it by the color of this slab.
+  if (cache->colors_num > 1) {
+    size_t color = __atomic_fetch_add(&cache->color_next, 1, __ATOMIC_RELAXED) %
+                   cache->colors_num;
+    objects_start = (void *)((unsigned long long)objects_start +
+                             color * cache->color_step);
+  }
   new_slab->mem_ptr = objects_start;
 
-  // setting up freelist pointer
-  new_slab->freelist =
-      (short *)((unsigned long long)slab_mem + sizeof(struct slab));
   new_slab->active = 0;
+  // a slot of a region may have held a slab before: none of it is zero then
+  new_slab->clean = fresh ? 0 : (int)cache->objects_num_per_slab;
+  new_slab->in_region = in_region;
+  new_slab->sampled = 0;
+  new_slab->cursor = 0;
   // initialize freelist
-  for (short i = 0; i < cache->objects_num_per_slab; i++) {
-    new_slab->freelist[i] = i;
+  void *metadata = (void *)((unsigned long long)slab_mem + sizeof(struct slab));
+  size_t objects_num = cache->objects_num_per_slab;
+  switch (cache->freelist_kind) {
+  case SLAB_FREELIST_INDEX:
+    new_slab->freelist = (short *)metadata;
+    for (size_t i = 0; i < objects_num; i++) {
+      new_slab->freelist[i] = (short)i;
+    }
+    break;
+  case SLAB_FREELIST_LINKED:
+    // the blocks are handed out in order from cursor until the first free
+    new_slab->free_head = NULPTR;
+    break;
+  case SLAB_FREELIST_BITMAP:
+    new_slab->bitmap = (unsigned long long *)metadata;
+    for (size_t i = 0; i < objects_num / 64; i++) {
+      new_slab->bitmap[i] = ~0ULL;
+    }
+    if (objects_num % 64) {
+      new_slab->bitmap[objects_num / 64] = (1ULL << (objects_num % 64)) - 1;
+    }
+    break;
   }
 
   new_slab->next = (struct slab *)NULPTR;
@@ -66,60 +332,321 @@ struct slab *create_slab(struct slab_cache *cache) {
   return new_slab;
 }
 
+/**
+take a free block from slab, which has one, and tell in *fresh whether it was
+never handed out before.
+*/
+static void *slab_take_block(struct slab *slab, struct slab_cache *cache,
+                             bool *fresh) {
+  size_t aligned_object_size = ALIGN_UP(cache->object_size, cache->alignment);
+  size_t index = 0;
+  switch (cache->freelist_kind) {
+  case SLAB_FREELIST_INDEX:
+    // Get the index of the next free object from the freelist.
+    // The freelist is used as a stack, 'active' points to the top.
+    index = (size_t)slab->freelist[slab->active];
+    break;
+  case SLAB_FREELIST_LINKED:
+    if (slab->free_head) {
+      void *block = slab->free_head;
+      slab->free_head = block_next(block);
+      slab->active++;
+      // the block held the link, so it is not zero any more
+      *fresh = false;
+      return block;
+    }
+    index = slab->cursor++;
+    break;
+  case SLAB_FREELIST_BITMAP: {
+    unsigned int word = slab->cursor;
+    while (slab->bitmap[word] == 0) {
+      word++;
+    }
+    index = word * 64 + __builtin_ctzll(slab->bitmap[word]);
+    // clear the lowest set bit
+    slab->bitmap[word] &= slab->bitmap[word] - 1;
+    slab->cursor = word;
+    break;
+  }
+  }
+  slab->active++;
+  *fresh = index >= (size_t)slab->clean;
+  if (*fresh) {
+    // the objects below index, if any were skipped, count as used too
+    slab->clean = (int)index + 1;
+  }
+  return (void *)((unsigned long long)slab->mem_ptr +
+                  index * aligned_object_size);
+}
+
 void *alloc_memory_block(struct slab *slab, struct slab_cache *cache) {
   // The slab is full, cannot allocate.
-  if (slab->active >= cache->objects_num_per_slab) {
+  if (slab->active >= (int)cache->objects_num_per_slab) {
     return NULPTR;
   }
-  // Get the index of the next free object from the freelist.
-  // The freelist is used as a stack, 'active' points to the top.
-  short index = slab->freelist[slab->active];
-  slab->active++;
-  size_t aligned_object_size = ALIGN_UP(cache->object_size, cache->alignment);
-  void *block_ptr =
-      (void *)((unsigned long long)slab->mem_ptr + index * aligned_object_size);
-  if (cache->ctor) {
-    cache->ctor(block_ptr, cache->object_size);
-  }
-  return block_ptr;
+  bool fresh;
+  return slab_take_block(slab, cache, &fresh);
 }
 
 void free_memory_block(struct slab *slab, struct slab_cache *cache, void *ptr) {
+  slab->active--;
+  if (cache->freelist_kind == SLAB_FREELIST_LINKED) {
+    block_set_next(ptr, slab->free_head);
+    slab->free_head = ptr;
+    return;
+  }
   size_t aligned_object_size = ALIGN_UP(cache->object_size, cache->alignment);
-  short index =
-      (short)(((unsigned long long)ptr - (unsigned long long)slab->mem_ptr) /
-              aligned_object_size);
+  size_t index = ((unsigned long long)ptr - (unsigned long long)slab->mem_ptr) /
+                 aligned_object_size;
+  if (cache->freelist_kind == SLAB_FREELIST_INDEX) {
+    // Push the freed index back onto the freelist stack.
+    slab->freelist[slab->active] = (short)index;
+    return;
+  }
+  slab->bitmap[index / 64] |= 1ULL << (index % 64);
+  if (index / 64 < slab->cursor) {
+    slab->cursor = index / 64;
+  }
+}
 
-  // Push the freed index back onto the freelist stack.
-  slab->active--;
-  slab->freelist[slab->active] = index;
+// unlink slab from the list whose head is *head
+static void slab_list_remove(struct slab **head, struct slab *slab) {
+  if (*head == slab) {
+    *head = slab->next;
+  }
+  PTRLIST_DROP(slab);
+}
 
-  if (cache->dtor) {
-    cache->dtor(ptr, cache->object_size);
+// empty slabs are kept newest first: the hottest one is reused first and the
+// coldest ones are released first
+static void slab_empty_push(struct slab_cache *cache, struct slab *slab) {
+  slab->empty_epoch = cache->epoch;
+  slab->prev = (struct slab *)NULPTR;
+  slab->next = cache->slabs_empty;
+  if (cache->slabs_empty) {
+    cache->slabs_empty->prev = slab;
   }
+  cache->slabs_empty = slab;
+  cache->slabs_empty_num++;
 }
 
-void *slab_alloc(size_t size, size_t alignment, struct slab_cache *cache_array,
-                 size_t cache_array_size) {
-  // find a suitable slab cache
+static void slab_empty_remove(struct slab_cache *cache, struct slab *slab) {
+  slab_list_remove(&cache->slabs_empty, slab);
+  cache->slabs_empty_num--;
+}
+
+/**
+detach the empty slabs beyond the first keep ones, and those older than
+max_age epochs, from cache. the caller holds the lock of cache.
+returns the detached slabs, linked through next.
+*/
+static struct slab *slab_detach_empty(struct slab_cache *cache, size_t keep,
+                                      unsigned int max_age) {
+  struct slab *slab = cache->slabs_empty;
+  size_t index = 0;
+  // the list is sorted newest first, so everything after the first slab to
+  // go goes too
+  while (slab && index < keep && cache->epoch - slab->empty_epoch <= max_age) {
+    slab = slab->next;
+    index++;
+  }
+  if (slab == NULPTR) {
+    return (struct slab *)NULPTR;
+  }
+  if (slab->prev) {
+    slab->prev->next = (struct slab *)NULPTR;
+  } else {
+    cache->slabs_empty = (struct slab *)NULPTR;
+  }
+  slab->prev = (struct slab *)NULPTR;
+  cache->slabs_released += cache->slabs_empty_num - index;
+  cache->slabs_empty_num = index;
+  return slab;
+}
+
+/**
+give detached slabs back to the page source. no lock is needed: the slabs hold
+no objects, so nobody looks them up any more.
+*/
+static size_t slab_release(struct slab_cache *cache, struct slab *slab) {
+  size_t released = 0;
+  while (slab) {
+    struct slab *next = slab->next;
+    pagemap_set(slab, cache->slab_size, NULPTR);
+    slab_pages_free(cache, slab, slab->in_region);
+    released += cache->slab_size;
+    slab = next;
+  }
+  return released;
+}
+
+/**
+move a slab that had active_before objects in use, and now fewer, to the list
+it belongs to. the caller holds the lock of the slab's cache.
+*/
+static void slab_relist(struct slab *slab, int active_before) {
+  struct slab_cache *cache = slab->cache;
+  // If the slab is now completely empty, move it to the empty list.
+  if (slab->active == 0) {
+    if (active_before == (int)cache->objects_num_per_slab) {
+      slab_list_remove(&cache->slabs_full, slab);
+    } else {
+      slab_list_remove(&cache->slabs_partial, slab);
+    }
+    LOG("[LOG] slab moved to empty\n");
+    slab_empty_push(cache, slab);
+  }
+  // If the slab was full and now has a free spot, move it to partial.
+  else if (active_before == (int)cache->objects_num_per_slab) {
+    slab_list_remove(&cache->slabs_full, slab);
+    PTRLIST_INSERT(&cache->slabs_partial, slab);
+  }
+}
+
+/**
+put a block back to its slab and move the slab to the list it now belongs to.
+the caller holds the lock of the slab's cache.
+*/
+static void slab_put_block(struct slab *slab, void *ptr) {
+  int active_before = slab->active;
+  free_memory_block(slab, slab->cache, ptr);
+  slab_relist(slab, active_before);
+}
+
+/**
+put num blocks of the same slab back, fixing up the lists once.
+the caller holds the lock of the slab's cache.
+*/
+static void slab_put_blocks(struct slab *slab, void **objs, size_t num) {
+  int active_before = slab->active;
+  for (size_t i = 0; i < num; i++) {
+    free_memory_block(slab, slab->cache, objs[i]);
+  }
+  slab_relist(slab, active_before);
+}
+
+/**
+take up to num free blocks from a slab of cache in one go, and tell for each in
+clean (if not NULL) whether it was never handed out before.
+returns the number of blocks taken. the caller holds the lock of cache.
+*/
+static size_t slab_take_blocks(struct slab *slab, struct slab_cache *cache,
+                               void **objs, size_t num, bool *clean) {
+  size_t available = cache->objects_num_per_slab - slab->active;
+  if (num > available) {
+    num = available;
+  }
+  for (size_t i = 0; i < num; i++) {
+    bool fresh;
+    objs[i] = slab_take_block(slab, cache, &fresh);
+    if (clean) {
+      clean[i] = fresh && !cache->ctor;
+    }
+  }
+  return num;
+}
+
+/**
+push the chain of blocks first..last, which are linked through block_next(),
+onto the remote free list of cache with a single CAS.
+*/
+static void slab_push_remote(struct slab_cache *cache, void *first,
+                             void *last) {
+  void *head = __atomic_load_n(&cache->remote_free, __ATOMIC_RELAXED);
+  do {
+    block_set_next(last, head);
+  } while (!__atomic_compare_exchange_n(&cache->remote_free, &head, first,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+/**
+take the whole remote free list of cache and put the blocks back to their
+slabs. the caller holds the lock of cache.
+the blocks keep their slabs from becoming empty, so none of these slabs can be
+stolen by another shard while the blocks wait in the list.
+*/
+static void slab_drain_remote(struct slab_cache *cache) {
+  if (__atomic_load_n(&cache->remote_free, __ATOMIC_RELAXED) == NULPTR) {
+    return;
+  }
+  void *block = __atomic_exchange_n(&cache->remote_free, NULPTR,
+                                    __ATOMIC_ACQUIRE);
+  while (block) {
+    void *next = block_next(block);
+    slab_put_block(slab_of(block), block);
+    block = next;
+  }
+}
+
+struct slab_cache *slab_find_cache(size_t size, size_t alignment,
+                                   struct slab_cache *cache_array,
+                                   size_t cache_array_size) {
+  // find the smallest slab cache that fits
   struct slab_cache *target_cache = (struct slab_cache *)NULPTR;
   for (size_t i = 0; i < cache_array_size; i++) {
-    // Find the first cache that is large enough. Assumes cache_array is sorted
-    // by size.
     if (cache_array[i].object_size >= size &&
-        cache_array[i].alignment >= alignment) {
+        cache_array[i].alignment >= alignment &&
+        (target_cache == NULPTR ||
+         cache_array[i].object_size < target_cache->object_size)) {
       target_cache = &cache_array[i];
-      break;
+      if (target_cache->object_size == size) {
+        break;
+      }
     }
   }
-  if (target_cache == NULPTR) {
-    // No suitable cache found. In a real system, you might create a new cache
-    // or fallback to a different allocator. Here we just fail.
+  return target_cache;
+}
+
+/**
+take an empty slab from another shard of the same cache. the caller holds the
+lock of shard. the other shards are only try-locked, so two shards stealing from
+each other can not deadlock.
+*/
+static struct slab *slab_steal_empty(struct slab_cache *shard) {
+  struct slab_cache *parent = shard->parent;
+  if (parent == NULPTR) {
+    return (struct slab *)NULPTR;
+  }
+  size_t self = shard - parent->shards;
+  for (size_t i = 1; i < parent->shards_num; i++) {
+    struct slab_cache *victim =
+        &parent->shards[(self + i) % parent->shards_num];
+    if (!spin_trylock(&victim->lock)) {
+      continue;
+    }
+    struct slab *slab = victim->slabs_empty;
+    if (slab) {
+      slab_empty_remove(victim, slab);
+    }
+    spin_unlock(&victim->lock);
+    if (slab) {
+      // an empty slab has no live objects, so nobody is freeing into it
+      slab->cache = shard;
+      return slab;
+    }
+  }
+  return (struct slab *)NULPTR;
+}
+
+void *slab_cache_alloc(struct slab_cache *cache) {
+  return slab_cache_alloc_clean(cache, (bool *)NULPTR);
+}
+
+void *slab_cache_alloc_clean(struct slab_cache *cache, bool *clean) {
+  void *obj;
+  if (slab_cache_alloc_bulk(cache, &obj, 1, clean) == 0) {
     return NULPTR;
   }
+  return obj;
+}
 
+/**
+get a slab of cache to allocate from, making sure it is on the partial list.
+the caller holds the lock of cache.
+*/
+static struct slab *slab_cache_pick(struct slab_cache *target_cache) {
   struct slab *target_slab = (struct slab *)NULPTR;
-
   // 1. Try to use a partially full slab first.
   if (target_cache->slabs_partial) {
     target_slab = target_cache->slabs_partial;
@@ -128,131 +655,450 @@ void *slab_alloc(size_t size, size_t alignment, struct slab_cache *cache_array,
   else if (target_cache->slabs_empty) {
     target_slab = target_cache->slabs_empty;
     // This slab was empty, now it will be partial. Move it.
-    PTRLIST_DROP(target_slab);
-    target_cache->slabs_empty = target_slab->next;
+    slab_empty_remove(target_cache, target_slab);
+    PTRLIST_INSERT(&target_cache->slabs_partial, target_slab);
+  }
+  // 3. If no partial and no empty slabs, steal an empty slab from another
+  // shard.
+  else if ((target_slab = slab_steal_empty(target_cache)) != NULPTR) {
     PTRLIST_INSERT(&target_cache->slabs_partial, target_slab);
   }
-  // 3. If no partial and no empty slabs, create a new one.
+  // 4. If there is none either, create a new one.
   else {
     target_slab = create_slab(target_cache);
     if (target_slab == NULPTR) {
-      return NULPTR; // Out of memory
+      return (struct slab *)NULPTR; // Out of memory
     }
+    target_cache->slabs_created++;
     // The new slab is immediately partial because we are about to allocate from
     // it.
     PTRLIST_INSERT(&target_cache->slabs_partial, target_slab);
   }
+  return target_slab;
+}
 
-  void *block_ptr = alloc_memory_block(target_slab, target_cache);
+size_t slab_cache_alloc_bulk(struct slab_cache *target_cache, void **objs,
+                             size_t num, bool *clean) {
+  if (target_cache->shards) {
+    target_cache = slab_cache_current_shard(target_cache);
+  }
+  size_t got = 0;
+  spin_lock(&target_cache->lock);
+  // blocks freed by other threads are reused first
+  slab_drain_remote(target_cache);
+  while (got < num) {
+    struct slab *target_slab = slab_cache_pick(target_cache);
+    if (target_slab == NULPTR) {
+      break;
+    }
+    got += slab_take_blocks(target_slab, target_cache, objs + got, num - got,
+                            clean ? clean + got : (bool *)NULPTR);
+    // After allocation, check if the slab has become full.
+    if (target_slab->active == (int)target_cache->objects_num_per_slab) {
+      slab_list_remove(&target_cache->slabs_partial, target_slab);
+      PTRLIST_INSERT(&target_cache->slabs_full, target_slab);
+    }
+  }
+  spin_unlock(&target_cache->lock);
 
-  // After allocation, check if the slab has become full.
-  if (target_slab->active == target_cache->objects_num_per_slab) {
-    PTRLIST_DROP(target_slab);
-    target_cache->slabs_partial = target_slab->next;
-    PTRLIST_INSERT(&target_cache->slabs_full, target_slab);
+  // run the ctor outside of the lock
+  if (target_cache->ctor) {
+    for (size_t i = 0; i < got; i++) {
+      target_cache->ctor(objs[i], target_cache->object_size);
+    }
   }
+  return got;
+}
 
-  return block_ptr;
+void *slab_alloc(size_t size, size_t alignment, struct slab_cache *cache_array,
+                 size_t cache_array_size) {
+  struct slab_cache *target_cache =
+      slab_find_cache(size, alignment, cache_array, cache_array_size);
+  if (target_cache == NULPTR) {
+    // No suitable cache found. In a real system, you might create a new cache
+    // or fallback to a different allocator. Here we just fail.
+    return NULPTR;
+  }
+  return slab_cache_alloc(target_cache);
+}
+
+size_t slab_alloc_bulk(size_t size, size_t alignment,
+                       struct slab_cache *cache_array, size_t cache_array_size,
+                       void **objs, size_t num) {
+  struct slab_cache *target_cache =
+      slab_find_cache(size, alignment, cache_array, cache_array_size);
+  if (target_cache == NULPTR) {
+    return 0;
+  }
+  return slab_cache_alloc_bulk(target_cache, objs, num, (bool *)NULPTR);
+}
+
+struct slab *slab_of(const void *ptr) {
+  void *owner = pagemap_get(ptr);
+  if (PAGEMAP_OWNER_KIND(owner) != PAGEMAP_SLAB) {
+    return (struct slab *)NULPTR;
+  }
+  return (struct slab *)owner;
 }
 
 size_t get_slab_obj_size(void *ptr, struct slab_cache *cache_array,
                          size_t cache_array_size) {
-  // A simple, but inefficient way to find the slab.
-  // A better way is to store a pointer to the slab or cache in the object's
-  // metadata or use page alignment tricks to find the slab metadata.
-  for (size_t i = 0; i < cache_array_size; i++) {
-    struct slab_cache *cache = &cache_array[i];
-    size_t aligned_object_size = ALIGN_UP(cache->object_size, cache->alignment);
-    size_t objects_total_size =
-        aligned_object_size * cache->objects_num_per_slab;
-
-    // --- Search in partial slabs ---
-    struct slab *slab = cache->slabs_partial;
-    while (slab) {
-      unsigned long long objects_start = (unsigned long long)slab->mem_ptr;
-      unsigned long long objects_end = objects_start + objects_total_size;
-      if ((unsigned long long)ptr >= objects_start &&
-          (unsigned long long)ptr < objects_end) {
-        return cache->object_size;
+  (void)cache_array;
+  (void)cache_array_size;
+  struct slab *slab = slab_of(ptr);
+  if (slab == NULPTR) {
+    return 0; // Not found
+  }
+  return slab->cache->object_size;
+}
+
+// check whether ptr lies in the memory of slab
+static bool slab_contains(struct slab *slab, const void *ptr) {
+  return (unsigned long long)ptr - (unsigned long long)slab <
+         slab->cache->slab_size;
+}
+
+/**
+free num blocks of one cache, the first of which lives in slab, under a single
+lock. the lists are fixed up once per run of blocks from the same slab.
+*/
+static void slab_free_run(struct slab *slab, void **objs, size_t num) {
+  struct slab_cache *cache = slab->cache;
+  // the dtor has to finish before the block can be handed out again
+  if (cache->dtor) {
+    for (size_t i = 0; i < num; i++) {
+      cache->dtor(objs[i], cache->object_size);
+    }
+  }
+  if (cache->object_size >= sizeof(void *)) {
+    // frees to another cpu's shard, or while somebody holds the lock, go to
+    // the remote free list instead of waiting for the lock
+    bool foreign =
+        cache->parent && cache != slab_cache_current_shard(cache->parent);
+    if (foreign || !spin_trylock(&cache->lock)) {
+      for (size_t i = 0; i + 1 < num; i++) {
+        block_set_next(objs[i], objs[i + 1]);
       }
-      slab = PTRLIST_NEXT(slab);
+      slab_push_remote(cache, objs[0], objs[num - 1]);
+      return;
+    }
+  } else {
+    // the block is too small to hold the link of the remote free list
+    spin_lock(&cache->lock);
+  }
+  size_t i = 0;
+  while (i < num) {
+    if (i > 0) {
+      slab = slab_of(objs[i]);
     }
+    size_t end = i + 1;
+    while (end < num && slab_contains(slab, objs[end])) {
+      end++;
+    }
+    slab_put_blocks(slab, objs + i, end - i);
+    i = end;
+  }
+  slab_drain_remote(cache);
+  // keep the number of empty slabs under the high watermark
+  struct slab *extra = (struct slab *)NULPTR;
+  if (cache->slabs_empty_num > cache->empty_slabs_max) {
+    extra = slab_detach_empty(cache, cache->empty_slabs_max, ~0U);
+  }
+  spin_unlock(&cache->lock);
+  slab_release(cache, extra);
+}
 
-    // --- Search in full slabs ---
-    slab = cache->slabs_full;
-    while (slab) {
-      unsigned long long objects_start = (unsigned long long)slab->mem_ptr;
-      unsigned long long objects_end = objects_start + objects_total_size;
-      if ((unsigned long long)ptr >= objects_start &&
-          (unsigned long long)ptr < objects_end) {
-        return cache->object_size;
+void slab_free_to(struct slab *slab, void *ptr) {
+  slab_free_run(slab, &ptr, 1);
+}
+
+void slab_free_bulk(void **objs, size_t num) {
+  size_t i = 0;
+  while (i < num) {
+    struct slab *slab = slab_of(objs[i]);
+    if (slab == NULPTR) {
+      LOG("[LOG] slab_free_bulk: %p was not allocated from a slab\n", objs[i]);
+      i++;
+      continue;
+    }
+    // gather the run of blocks from the same cache, looking up only the ones
+    // outside the current slab
+    struct slab_cache *cache = slab->cache;
+    struct slab *last = slab;
+    size_t end = i + 1;
+    while (end < num) {
+      if (!slab_contains(last, objs[end])) {
+        struct slab *next = slab_of(objs[end]);
+        if (next == NULPTR || next->cache != cache) {
+          break;
+        }
+        last = next;
       }
-      slab = PTRLIST_NEXT(slab);
+      end++;
     }
+    slab_free_run(slab, objs + i, end - i);
+    i = end;
   }
-  return 0; // Not found
 }
-void slab_free(void *ptr, struct slab_cache *cache_array,
-               size_t cache_array_size) {
-  // A simple, but inefficient way to find the slab.
-  // A better way is to store a pointer to the slab or cache in the object's
-  // metadata or use page alignment tricks to find the slab metadata.
-  for (size_t i = 0; i < cache_array_size; i++) {
-    struct slab_cache *cache = &cache_array[i];
-    size_t aligned_object_size = ALIGN_UP(cache->object_size, cache->alignment);
-    size_t objects_total_size =
-        aligned_object_size * cache->objects_num_per_slab;
-
-    // --- Search in partial slabs ---
-    struct slab *slab = cache->slabs_partial;
-    while (slab) {
-      unsigned long long objects_start = (unsigned long long)slab->mem_ptr;
-      unsigned long long objects_end = objects_start + objects_total_size;
-      if ((unsigned long long)ptr >= objects_start &&
-          (unsigned long long)ptr < objects_end) {
-        int active_before = slab->active;
-        free_memory_block(slab, cache, ptr);
-        // If the slab was full and now has a free spot, move it to partial.
-        // (This case is handled below, as it must have been in the full list
-        // before)
-
-        // If the slab is now completely empty, move it to the empty list.
-        if (slab->active == 0) {
-          PTRLIST_DROP(slab);
-          LOG("[LOG] slab moved to empty\n");
-          if (cache->slabs_partial == slab) {
-            cache->slabs_partial = slab->next;
-          }
-          PTRLIST_INSERT(&cache->slabs_empty, slab);
-        }
-        return;
+
+int slab_cache_set_freelist(struct slab_cache *cache,
+                            enum slab_freelist_kind kind) {
+  if (kind == SLAB_FREELIST_LINKED &&
+      ALIGN_UP(cache->object_size, cache->alignment) < sizeof(void *)) {
+    return -1;
+  }
+  cache->freelist_kind = kind;
+  slab_cache_layout(cache);
+  for (size_t i = 0; i < cache->shards_num; i++) {
+    slab_cache_set_freelist(&cache->shards[i], kind);
+  }
+  return 0;
+}
+
+void slab_cache_set_coloring(struct slab_cache *cache, bool enabled) {
+  cache->colors_num = enabled ? slab_colors_max(cache) : 1;
+  for (size_t i = 0; i < cache->shards_num; i++) {
+    slab_cache_set_coloring(&cache->shards[i], enabled);
+  }
+}
+
+void slab_cache_set_huge(struct slab_cache *cache, bool enabled) {
+  slab_cache_top(cache)->huge = enabled;
+}
+
+void slab_cache_set_reclaim(struct slab_cache *cache, size_t empty_slabs_max,
+                            unsigned int decay_epochs) {
+  cache->empty_slabs_max = empty_slabs_max;
+  cache->decay_epochs = decay_epochs;
+  for (size_t i = 0; i < cache->shards_num; i++) {
+    slab_cache_set_reclaim(&cache->shards[i], empty_slabs_max, decay_epochs);
+  }
+}
+
+/**
+release the empty slabs of cache (one shard, or an unsharded cache) beyond keep
+or older than max_age epochs, optionally advancing the epoch first.
+*/
+static size_t slab_cache_reclaim(struct slab_cache *cache, size_t keep,
+                                 unsigned int max_age, bool tick) {
+  spin_lock(&cache->lock);
+  // blocks waiting in the remote free list may be all that keeps a slab busy
+  slab_drain_remote(cache);
+  if (tick) {
+    cache->epoch++;
+  }
+  struct slab *extra = slab_detach_empty(cache, keep, max_age);
+  spin_unlock(&cache->lock);
+  return slab_release(cache, extra);
+}
+
+size_t slab_cache_shrink(struct slab_cache *cache) {
+  if (cache->shards == NULPTR) {
+    return slab_cache_reclaim(cache, 0, 0, false);
+  }
+  size_t released = 0;
+  for (size_t i = 0; i < cache->shards_num; i++) {
+    released += slab_cache_reclaim(&cache->shards[i], 0, 0, false);
+  }
+  return released;
+}
+
+size_t slab_cache_decay(struct slab_cache *cache) {
+  if (cache->shards == NULPTR) {
+    return slab_cache_reclaim(cache, ~(size_t)0, cache->decay_epochs, true);
+  }
+  size_t released = 0;
+  for (size_t i = 0; i < cache->shards_num; i++) {
+    released += slab_cache_reclaim(&cache->shards[i], ~(size_t)0,
+                                   cache->shards[i].decay_epochs, true);
+  }
+  return released;
+}
+
+void slab_cache_lock_all(struct slab_cache *cache) {
+  // shards are locked in order, and nothing waits on a second lock while
+  // holding one (stealing only tries), so this cannot deadlock
+  spin_lock(&cache->lock);
+  for (size_t i = 0; i < cache->shards_num; i++) {
+    spin_lock(&cache->shards[i].lock);
+  }
+  // taken after the cache locks, like when a slab is created
+  spin_lock(&cache->regions.lock);
+}
+
+void slab_cache_unlock_all(struct slab_cache *cache) {
+  spin_unlock(&cache->regions.lock);
+  for (size_t i = 0; i < cache->shards_num; i++) {
+    spin_unlock(&cache->shards[i].lock);
+  }
+  spin_unlock(&cache->lock);
+}
+
+// add the counts of one shard, or of an unsharded cache, to stats
+static void slab_cache_add_stats(struct slab_cache *cache,
+                                 struct slab_cache_stats *stats) {
+  spin_lock(&cache->lock);
+  stats->slabs_created += cache->slabs_created;
+  stats->slabs_released += cache->slabs_released;
+  for (struct slab *slab = cache->slabs_partial; slab; slab = slab->next) {
+    stats->slabs_partial++;
+    stats->objects_active += slab->active;
+  }
+  for (struct slab *slab = cache->slabs_full; slab; slab = slab->next) {
+    stats->slabs_full++;
+    stats->objects_active += slab->active;
+  }
+  stats->slabs_empty += cache->slabs_empty_num;
+  spin_unlock(&cache->lock);
+}
+
+void slab_cache_get_stats(struct slab_cache *cache,
+                          struct slab_cache_stats *stats) {
+  *stats = {};
+  if (cache->shards == NULPTR) {
+    slab_cache_add_stats(cache, stats);
+  } else {
+    for (size_t i = 0; i < cache->shards_num; i++) {
+      slab_cache_add_stats(&cache->shards[i], stats);
+    }
+  }
+  size_t regions_unused;
+  region_pool_stats(&cache->regions, cache->slab_size, &stats->regions_num,
+                    &regions_unused);
+  stats->bytes_reserved =
+      (stats->slabs_partial + stats->slabs_full + stats->slabs_empty) *
+          cache->slab_size +
+      regions_unused;
+}
+
+/**
+set in used one bit for each object of slab that is in use, which is every
+object but those its freelist holds. the caller holds the lock of the slab's
+cache.
+*/
+static void slab_used_bits(struct slab *slab, unsigned long long *used) {
+  struct slab_cache *cache = slab->cache;
+  size_t objects_num = cache->objects_num_per_slab;
+  size_t words = (objects_num + 63) / 64;
+  switch (cache->freelist_kind) {
+  case SLAB_FREELIST_INDEX:
+    for (size_t i = 0; i < words; i++) {
+      used[i] = ~0ULL;
+    }
+    // the free indexes are the ones above the top of the stack
+    for (size_t i = (size_t)slab->active; i < objects_num; i++) {
+      size_t index = (size_t)slab->freelist[i];
+      used[index / 64] &= ~(1ULL << (index % 64));
+    }
+    break;
+  case SLAB_FREELIST_LINKED: {
+    // the objects below cursor were handed out, unless they are on the list
+    size_t cursor = slab->cursor;
+    for (size_t i = 0; i < words; i++) {
+      if (i * 64 + 64 <= cursor) {
+        used[i] = ~0ULL;
+      } else if (i * 64 < cursor) {
+        used[i] = (1ULL << (cursor - i * 64)) - 1;
+      } else {
+        used[i] = 0;
       }
-      slab = PTRLIST_NEXT(slab);
-    }
-
-    // --- Search in full slabs ---
-    slab = cache->slabs_full;
-    while (slab) {
-      unsigned long long objects_start = (unsigned long long)slab->mem_ptr;
-      unsigned long long objects_end = objects_start + objects_total_size;
-      if ((unsigned long long)ptr >= objects_start &&
-          (unsigned long long)ptr < objects_end) {
-        int active_before = slab->active;
-        free_memory_block(slab, cache, ptr);
-        // If the slab was full and now has a free spot, move it to partial.
-        if (active_before == cache->objects_num_per_slab) {
-          PTRLIST_DROP(slab);
-          if (cache->slabs_full == slab) {
-            cache->slabs_full = slab->next;
-          }
-          PTRLIST_INSERT(&cache->slabs_partial, slab);
-        }
-        return;
+    }
+    size_t aligned_object_size = ALIGN_UP(cache->object_size, cache->alignment);
+    for (void *block = slab->free_head; block; block = block_next(block)) {
+      size_t index =
+          ((unsigned long long)block - (unsigned long long)slab->mem_ptr) /
+          aligned_object_size;
+      used[index / 64] &= ~(1ULL << (index % 64));
+    }
+    break;
+  }
+  case SLAB_FREELIST_BITMAP:
+    for (size_t i = 0; i < words; i++) {
+      used[i] = ~slab->bitmap[i];
+    }
+    break;
+  }
+  if (objects_num % 64) {
+    used[words - 1] &= (1ULL << (objects_num % 64)) - 1;
+  }
+}
+
+static void slab_walk_list(struct slab *list, slab_walk_slab_fn slab_fn,
+                           slab_walk_object_fn object_fn, void *arg,
+                           unsigned long long *used) {
+  for (struct slab *slab = list; slab; slab = slab->next) {
+    if (slab_fn) {
+      slab_fn(arg, slab);
+    }
+    if (!object_fn || slab->active == 0) {
+      continue;
+    }
+    struct slab_cache *cache = slab->cache;
+    size_t aligned_object_size = ALIGN_UP(cache->object_size, cache->alignment);
+    size_t words = (cache->objects_num_per_slab + 63) / 64;
+    slab_used_bits(slab, used);
+    for (size_t i = 0; i < words; i++) {
+      for (unsigned long long bits = used[i]; bits; bits &= bits - 1) {
+        size_t index = i * 64 + __builtin_ctzll(bits);
+        object_fn(arg, slab,
+                  (void *)((unsigned long long)slab->mem_ptr +
+                           index * aligned_object_size));
       }
-      slab = PTRLIST_NEXT(slab);
     }
   }
 }
+
+// walk one shard, or an unsharded cache
+static void slab_cache_walk_one(struct slab_cache *cache,
+                                slab_walk_slab_fn slab_fn,
+                                slab_walk_object_fn object_fn, void *arg,
+                                unsigned long long *used) {
+  spin_lock(&cache->lock);
+  // freed objects must not be reported as in use
+  slab_drain_remote(cache);
+  slab_walk_list(cache->slabs_partial, slab_fn, object_fn, arg, used);
+  slab_walk_list(cache->slabs_full, slab_fn, object_fn, arg, used);
+  slab_walk_list(cache->slabs_empty, slab_fn, object_fn, arg, used);
+  spin_unlock(&cache->lock);
+}
+
+int slab_cache_walk(struct slab_cache *cache, slab_walk_slab_fn slab_fn,
+                    slab_walk_object_fn object_fn, void *arg) {
+  // one bit per object of a slab, taken before any lock
+  unsigned long long *used = (unsigned long long *)NULPTR;
+  size_t used_size = ALIGN_UP(
+      (cache->objects_num_per_slab + 63) / 64 * sizeof(unsigned long long),
+      PAGE_SIZE);
+  if (object_fn) {
+    used = (unsigned long long *)bulk_alloc(used_size);
+    if (used == NULPTR) {
+      return -1;
+    }
+  }
+  if (cache->shards == NULPTR) {
+    slab_cache_walk_one(cache, slab_fn, object_fn, arg, used);
+  } else {
+    for (size_t i = 0; i < cache->shards_num; i++) {
+      slab_cache_walk_one(&cache->shards[i], slab_fn, object_fn, arg, used);
+    }
+  }
+  if (used) {
+    bulk_free(used, used_size);
+  }
+  return 0;
+}
+
+void slab_free(void *ptr, struct slab_cache *cache_array,
+               size_t cache_array_size) {
+  (void)cache_array;
+  (void)cache_array_size;
+  struct slab *slab = slab_of(ptr);
+  if (slab == NULPTR) {
+    LOG("[LOG] slab_free: %p was not allocated from a slab\n", ptr);
+    return;
+  }
+  slab_free_to(slab, ptr);
+}
 size_t get_alloced_size(void *ptr, struct slab_cache *cache_array,
                         size_t cache_array_size) {
   size_t alloc_size = get_slab_obj_size(ptr, cache_array, cache_array_size);
@@ -0,0 +1,483 @@
+#include "stats.h"
+#include "spinlock.h"
+#include <pthread.h>
+
+#define NULPTR ((void *)0)
+// temp code
+extern void *bulk_alloc(size_t size);
+extern void bulk_free(void *ptr, size_t size);
+
+struct stats_counters {
+  size_t allocs;
+  size_t frees;
+  // requested bytes of all allocations and of all frees
+  size_t bytes_alloced;
+  size_t bytes_freed;
+};
+
+struct stats_thread {
+  // the last entry counts large objects
+  struct stats_counters classes[STATS_CLASSES_NUM + 1];
+  struct stats_thread *prev;
+  struct stats_thread *next;
+};
+
+enum stats_state {
+  STATS_UNINIT = 0,
+  // the counters are being set up, counts go to the shared ones
+  STATS_INITING,
+  STATS_ACTIVE,
+  // the thread is exiting, its counters are folded into the shared ones
+  STATS_DISABLED,
+};
+
+static __thread struct stats_thread *stats_tls
+    __attribute__((tls_model("initial-exec")));
+static __thread int stats_state __attribute__((tls_model("initial-exec")));
+
+// threads whose counters are alive, and the counts of all others
+static struct stats_thread *stats_threads;
+static struct stats_counters stats_shared[STATS_CLASSES_NUM + 1];
+static struct spinlock stats_lock = SPINLOCK_INIT;
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+// only the owning thread writes its counters; readers load them concurrently,
+// so the accesses are atomic, but relaxed: a plain add and store
+static inline void counter_add(size_t *counter, size_t value) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                   __ATOMIC_RELAXED);
+}
+
+static inline size_t counter_get(const size_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void stats_fold(struct stats_counters *to,
+                       const struct stats_counters *from) {
+  __atomic_fetch_add(&to->allocs, counter_get(&from->allocs),
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->frees, counter_get(&from->frees), __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->bytes_alloced, counter_get(&from->bytes_alloced),
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&to->bytes_freed, counter_get(&from->bytes_freed),
+                     __ATOMIC_RELAXED);
+}
+
+static void stats_destroy(void *arg) {
+  struct stats_thread *st = (struct stats_thread *)arg;
+  // counts made by later thread-exit code go to the shared counters
+  stats_state = STATS_DISABLED;
+  stats_tls = (struct stats_thread *)NULPTR;
+  spin_lock(&stats_lock);
+  for (int i = 0; i <= STATS_CLASSES_NUM; i++) {
+    stats_fold(&stats_shared[i], &st->classes[i]);
+  }
+  if (st->prev) {
+    st->prev->next = st->next;
+  } else {
+    stats_threads = st->next;
+  }
+  if (st->next) {
+    st->next->prev = st->prev;
+  }
+  spin_unlock(&stats_lock);
+  bulk_free(st, sizeof(struct stats_thread));
+}
+
+static void stats_key_init() {
+  pthread_key_create(&stats_key, stats_destroy);
+}
+
+static struct stats_counters *stats_get(size_t cls) {
+  if (cls > STATS_CLASSES_NUM) {
+    return (struct stats_counters *)NULPTR;
+  }
+  if (stats_state == STATS_ACTIVE) {
+    return &stats_tls->classes[cls];
+  }
+  if (stats_state == STATS_UNINIT) {
+    // pthread functions may allocate, which must not recurse into here
+    stats_state = STATS_INITING;
+    struct stats_thread *st =
+        (struct stats_thread *)bulk_alloc(sizeof(struct stats_thread));
+    if (st == NULPTR) {
+      stats_state = STATS_UNINIT;
+      return &stats_shared[cls];
+    }
+    // bulk_alloc memory is zero, so are the counters
+    pthread_once(&stats_key_once, stats_key_init);
+    pthread_setspecific(stats_key, st);
+    spin_lock(&stats_lock);
+    st->prev = (struct stats_thread *)NULPTR;
+    st->next = stats_threads;
+    if (stats_threads) {
+      stats_threads->prev = st;
+    }
+    stats_threads = st;
+    spin_unlock(&stats_lock);
+    stats_tls = st;
+    stats_state = STATS_ACTIVE;
+    return &st->classes[cls];
+  }
+  return &stats_shared[cls];
+}
+
+// the shared counters are written by many threads
+static inline bool stats_is_shared(const struct stats_counters *c) {
+  return c >= stats_shared && c <= &stats_shared[STATS_CLASSES_NUM];
+}
+
+static void stats_add(size_t cls, size_t allocs, size_t frees,
+                      size_t bytes_alloced, size_t bytes_freed) {
+  struct stats_counters *c = stats_get(cls);
+  if (c == NULPTR) {
+    return;
+  }
+  if (stats_is_shared(c)) {
+    __atomic_fetch_add(&c->allocs, allocs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->frees, frees, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->bytes_alloced, bytes_alloced, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->bytes_freed, bytes_freed, __ATOMIC_RELAXED);
+    return;
+  }
+  counter_add(&c->allocs, allocs);
+  counter_add(&c->frees, frees);
+  counter_add(&c->bytes_alloced, bytes_alloced);
+  counter_add(&c->bytes_freed, bytes_freed);
+}
+
+void stats_count_alloc(size_t cls, size_t size) {
+  stats_add(cls, 1, 0, size, 0);
+}
+
+void stats_count_free(size_t cls, size_t size) {
+  stats_add(cls, 0, 1, 0, size);
+}
+
+void stats_count_resize(size_t cls, size_t old_size, size_t new_size) {
+  stats_add(cls, 0, 0, new_size, old_size);
+}
+
+void stats_lock_all() { spin_lock(&stats_lock); }
+
+void stats_unlock_all() { spin_unlock(&stats_lock); }
+
+static void stats_apply(struct mm_class_stats *stats,
+                        const struct stats_counters *c) {
+  stats->allocs = c->allocs;
+  stats->frees = c->frees;
+  // a free counted by one thread may be read before the alloc counted by
+  // another, so the differences are clamped
+  stats->live_objects = c->allocs > c->frees ? c->allocs - c->frees : 0;
+  stats->bytes_requested = c->bytes_alloced > c->bytes_freed
+                               ? c->bytes_alloced - c->bytes_freed
+                               : 0;
+}
+
+void stats_collect(struct mm_stats *stats) {
+  struct stats_counters sums[STATS_CLASSES_NUM + 1] = {};
+  spin_lock(&stats_lock);
+  for (int i = 0; i <= STATS_CLASSES_NUM; i++) {
+    stats_fold(&sums[i], &stats_shared[i]);
+  }
+  for (struct stats_thread *st = stats_threads; st; st = st->next) {
+    for (int i = 0; i <= STATS_CLASSES_NUM; i++) {
+      stats_fold(&sums[i], &st->classes[i]);
+    }
+  }
+  spin_unlock(&stats_lock);
+  for (int i = 0; i < STATS_CLASSES_NUM; i++) {
+    stats_apply(&stats->classes[i], &sums[i]);
+  }
+  stats_apply(&stats->large, &sums[STATS_LARGE]);
+}
+
+/**
+a small buffered writer, so dumping needs neither libc nor memory.
+*/
+struct stats_writer {
+  mm_stats_write_fn write;
+  void *arg;
+  size_t len;
+  char buf[256];
+};
+
+static void out_flush(struct stats_writer *w) {
+  if (w->len) {
+    w->write(w->arg, w->buf, w->len);
+    w->len = 0;
+  }
+}
+
+static void out_char(struct stats_writer *w, char c) {
+  if (w->len == sizeof(w->buf)) {
+    out_flush(w);
+  }
+  w->buf[w->len++] = c;
+}
+
+static void out_str(struct stats_writer *w, const char *s) {
+  while (*s) {
+    out_char(w, *s++);
+  }
+}
+
+// print v right aligned in width columns
+static void out_uint(struct stats_writer *w, size_t v, int width) {
+  char digits[24];
+  int n = 0;
+  do {
+    digits[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v);
+  for (int i = n; i < width; i++) {
+    out_char(w, ' ');
+  }
+  while (n) {
+    out_char(w, digits[--n]);
+  }
+}
+
+static void out_text_line(struct stats_writer *w, const char *name,
+                          size_t index, const struct mm_class_stats *s) {
+  if (name) {
+    out_str(w, name);
+  } else {
+    out_uint(w, index, 5);
+  }
+  out_uint(w, s->object_size, 7);
+  out_uint(w, s->allocs, 12);
+  out_uint(w, s->frees, 12);
+  out_uint(w, s->live_objects, 10);
+  out_uint(w, s->bytes_requested, 12);
+  out_uint(w, s->bytes_allocated, 12);
+  out_uint(w, s->bytes_reserved, 12);
+  out_uint(w, s->slabs_partial, 6);
+  out_uint(w, s->slabs_full, 6);
+  out_uint(w, s->slabs_empty, 6);
+  out_uint(w, s->slabs_created, 9);
+  out_uint(w, s->slabs_released, 9);
+  out_char(w, '\n');
+}
+
+static void out_json_field(struct stats_writer *w, const char *name, size_t v,
+                           bool last) {
+  out_char(w, '"');
+  out_str(w, name);
+  out_str(w, "\":");
+  out_uint(w, v, 0);
+  if (!last) {
+    out_char(w, ',');
+  }
+}
+
+static void out_json_object(struct stats_writer *w,
+                            const struct mm_class_stats *s) {
+  out_char(w, '{');
+  out_json_field(w, "object_size", s->object_size, false);
+  out_json_field(w, "allocs", s->allocs, false);
+  out_json_field(w, "frees", s->frees, false);
+  out_json_field(w, "live_objects", s->live_objects, false);
+  out_json_field(w, "bytes_requested", s->bytes_requested, false);
+  out_json_field(w, "bytes_allocated", s->bytes_allocated, false);
+  out_json_field(w, "bytes_reserved", s->bytes_reserved, false);
+  out_json_field(w, "slabs_created", s->slabs_created, false);
+  out_json_field(w, "slabs_released", s->slabs_released, false);
+  out_json_field(w, "slabs_partial", s->slabs_partial, false);
+  out_json_field(w, "slabs_full", s->slabs_full, false);
+  out_json_field(w, "slabs_empty", s->slabs_empty, true);
+  out_char(w, '}');
+}
+
+// classes never used are left out of the dump
+static bool stats_used(const struct mm_class_stats *s) {
+  return s->allocs || s->bytes_reserved || s->slabs_created;
+}
+
+void stats_format(const struct mm_stats *stats, enum mm_stats_format format,
+                  mm_stats_write_fn write, void *arg) {
+  struct stats_writer w;
+  w.write = write;
+  w.arg = arg;
+  w.len = 0;
+  if (format == MM_STATS_JSON) {
+    out_str(&w, "{\"classes\":[");
+    bool first = true;
+    for (size_t i = 0; i < stats->classes_num; i++) {
+      if (!stats_used(&stats->classes[i])) {
+        continue;
+      }
+      if (!first) {
+        out_char(&w, ',');
+      }
+      first = false;
+      out_str(&w, "{\"index\":");
+      out_uint(&w, i, 0);
+      out_str(&w, ",\"stats\":");
+      out_json_object(&w, &stats->classes[i]);
+      out_char(&w, '}');
+    }
+    out_str(&w, "],\"large\":");
+    out_json_object(&w, &stats->large);
+    out_str(&w, ",\"total\":");
+    out_json_object(&w, &stats->total);
+    out_str(&w, "}\n");
+  } else {
+    out_str(&w, "class   size      allocs       frees      live   requested"
+                "   allocated    reserved  part  full empty  created "
+                "released\n");
+    for (size_t i = 0; i < stats->classes_num; i++) {
+      if (stats_used(&stats->classes[i])) {
+        out_text_line(&w, (const char *)NULPTR, i, &stats->classes[i]);
+      }
+    }
+    out_text_line(&w, "large", 0, &stats->large);
+    out_text_line(&w, "total", 0, &stats->total);
+    if (stats->total.bytes_allocated > stats->total.bytes_requested) {
+      // internal fragmentation in tenths of a percent
+      size_t waste =
+          stats->total.bytes_allocated - stats->total.bytes_requested;
+      size_t permille = waste * 1000 / stats->total.bytes_allocated;
+      out_str(&w, "internal fragmentation: ");
+      out_uint(&w, permille / 10, 0);
+      out_char(&w, '.');
+      out_uint(&w, permille % 10, 0);
+      out_str(&w, "% of allocated bytes\n");
+    }
+  }
+  out_flush(&w);
+}
+
+static void out_frag_line(struct stats_writer *w, const char *name,
+                          size_t index, const struct mm_frag_class *c) {
+  if (name) {
+    out_str(w, name);
+  } else {
+    out_uint(w, index, 5);
+  }
+  out_uint(w, c->object_size, 7);
+  out_uint(w, c->slabs, 7);
+  out_uint(w, c->slabs_empty, 6);
+  out_uint(w, c->objects_live, 9);
+  out_uint(w, c->bytes_reserved, 12);
+  out_uint(w, c->bytes_requested, 12);
+  out_uint(w, c->bytes_padding, 10);
+  out_uint(w, c->bytes_hardening, 10);
+  out_uint(w, c->bytes_free, 12);
+  out_uint(w, c->bytes_slab_overhead, 10);
+  out_uint(w, c->bytes_reclaimable, 12);
+  out_char(w, '\n');
+}
+
+static void out_occupancy_line(struct stats_writer *w, const char *name,
+                               size_t index, const struct mm_frag_class *c) {
+  if (name) {
+    out_str(w, name);
+  } else {
+    out_uint(w, index, 5);
+  }
+  out_uint(w, c->object_size, 7);
+  for (int i = 0; i < MM_FRAG_BUCKETS; i++) {
+    out_uint(w, c->occupancy[i], 7);
+  }
+  out_char(w, '\n');
+}
+
+static void out_frag_json(struct stats_writer *w,
+                          const struct mm_frag_class *c) {
+  out_char(w, '{');
+  out_json_field(w, "object_size", c->object_size, false);
+  out_json_field(w, "slab_size", c->slab_size, false);
+  out_json_field(w, "objects_per_slab", c->objects_per_slab, false);
+  out_json_field(w, "slabs", c->slabs, false);
+  out_json_field(w, "slabs_empty", c->slabs_empty, false);
+  out_str(w, "\"occupancy\":[");
+  for (int i = 0; i < MM_FRAG_BUCKETS; i++) {
+    if (i) {
+      out_char(w, ',');
+    }
+    out_uint(w, c->occupancy[i], 0);
+  }
+  out_str(w, "],");
+  out_json_field(w, "objects_live", c->objects_live, false);
+  out_json_field(w, "bytes_reserved", c->bytes_reserved, false);
+  out_json_field(w, "bytes_requested", c->bytes_requested, false);
+  out_json_field(w, "bytes_padding", c->bytes_padding, false);
+  out_json_field(w, "bytes_hardening", c->bytes_hardening, false);
+  out_json_field(w, "bytes_free", c->bytes_free, false);
+  out_json_field(w, "bytes_slab_overhead", c->bytes_slab_overhead, false);
+  out_json_field(w, "bytes_reclaimable", c->bytes_reclaimable, true);
+  out_char(w, '}');
+}
+
+// print part / whole as a percentage with one decimal
+static void out_percent(struct stats_writer *w, size_t part, size_t whole) {
+  size_t permille = whole ? part * 1000 / whole : 0;
+  out_uint(w, permille / 10, 0);
+  out_char(w, '.');
+  out_uint(w, permille % 10, 0);
+  out_char(w, '%');
+}
+
+void stats_format_frag(const struct mm_frag_report *report,
+                       enum mm_stats_format format, mm_stats_write_fn write,
+                       void *arg) {
+  struct stats_writer w;
+  w.write = write;
+  w.arg = arg;
+  w.len = 0;
+  if (format == MM_STATS_JSON) {
+    out_str(&w, "{\"classes\":[");
+    bool first = true;
+    for (size_t i = 0; i < report->classes_num; i++) {
+      if (report->classes[i].slabs == 0) {
+        continue;
+      }
+      if (!first) {
+        out_char(&w, ',');
+      }
+      first = false;
+      out_str(&w, "{\"index\":");
+      out_uint(&w, i, 0);
+      out_str(&w, ",\"frag\":");
+      out_frag_json(&w, &report->classes[i]);
+      out_char(&w, '}');
+    }
+    out_str(&w, "],\"total\":");
+    out_frag_json(&w, &report->total);
+    out_str(&w, "}\n");
+    out_flush(&w);
+    return;
+  }
+  out_str(&w, "class   size  slabs empty     live    reserved   requested"
+              "   padding hardening        free  overhead reclaimable\n");
+  // caches without slabs are left out
+  for (size_t i = 0; i < report->classes_num; i++) {
+    if (report->classes[i].slabs) {
+      out_frag_line(&w, (const char *)NULPTR, i, &report->classes[i]);
+    }
+  }
+  out_frag_line(&w, "total", 0, &report->total);
+  out_str(&w, "\nslabs in use by occupancy, up to\n");
+  out_str(&w, "class   size    10%    20%    30%    40%    50%    60%    70%"
+              "    80%    90%   100%\n");
+  for (size_t i = 0; i < report->classes_num; i++) {
+    if (report->classes[i].slabs > report->classes[i].slabs_empty) {
+      out_occupancy_line(&w, (const char *)NULPTR, i, &report->classes[i]);
+    }
+  }
+  out_occupancy_line(&w, "total", 0, &report->total);
+  const struct mm_frag_class *total = &report->total;
+  out_str(&w, "\nreclaimable: ");
+  out_percent(&w, total->bytes_reclaimable, total->bytes_reserved);
+  out_str(&w, ", free objects: ");
+  out_percent(&w, total->bytes_free, total->bytes_reserved);
+  out_str(&w, ", padding: ");
+  out_percent(&w, total->bytes_padding, total->bytes_reserved);
+  out_str(&w, ", hardening: ");
+  out_percent(&w, total->bytes_hardening, total->bytes_reserved);
+  out_str(&w, " of reserved bytes\n");
+  out_flush(&w);
+}
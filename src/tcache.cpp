@@ -0,0 +1,132 @@
+#include "tcache.h"
+#include "slab.h"
+#include <pthread.h>
+
+#define NULPTR ((void *)0)
+// temp code
+extern void *bulk_alloc(size_t size);
+extern void bulk_free(void *ptr, size_t size);
+
+enum tcache_state {
+  TCACHE_UNINIT = 0,
+  // the thread cache is being set up, allocations go to the slab caches
+  TCACHE_INITING,
+  TCACHE_ACTIVE,
+  // the thread is exiting, its cache is gone for good
+  TCACHE_DISABLED,
+};
+
+static __thread struct tcache *tcache_tls
+    __attribute__((tls_model("initial-exec")));
+static __thread int tcache_state __attribute__((tls_model("initial-exec")));
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static void tcache_flush_bin(struct tcache_bin *bin, int num) {
+  // flush the coldest objects, which sit at the bottom of the LIFO
+  for (int i = 0; i < num; i++) {
+    bin->objs[i] = (void *)((unsigned long long)bin->objs[i] & ~TCACHE_CLEAN);
+  }
+  slab_free_bulk(bin->objs, num);
+  for (int i = num; i < bin->count; i++) {
+    bin->objs[i - num] = bin->objs[i];
+  }
+  bin->count -= num;
+}
+
+static void tcache_destroy(void *arg) {
+  struct tcache *tc = (struct tcache *)arg;
+  for (int i = 0; i < TCACHE_BINS_NUM; i++) {
+    tcache_flush_bin(&tc->bins[i], tc->bins[i].count);
+  }
+  // frees made by later thread-exit code go straight to the slab caches
+  tcache_state = TCACHE_DISABLED;
+  tcache_tls = (struct tcache *)NULPTR;
+  bulk_free(tc, sizeof(struct tcache));
+}
+
+static void tcache_key_init() {
+  pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+static struct tcache *tcache_get() {
+  if (tcache_state == TCACHE_ACTIVE) {
+    return tcache_tls;
+  }
+  if (tcache_state != TCACHE_UNINIT) {
+    return (struct tcache *)NULPTR;
+  }
+  // pthread functions may allocate, which must not recurse into here
+  tcache_state = TCACHE_INITING;
+  struct tcache *tc = (struct tcache *)bulk_alloc(sizeof(struct tcache));
+  if (tc == NULPTR) {
+    tcache_state = TCACHE_UNINIT;
+    return (struct tcache *)NULPTR;
+  }
+  for (int i = 0; i < TCACHE_BINS_NUM; i++) {
+    tc->bins[i].count = 0;
+  }
+  pthread_once(&tcache_key_once, tcache_key_init);
+  // register the cache so that it is flushed when the thread exits
+  pthread_setspecific(tcache_key, tc);
+  tcache_tls = tc;
+  tcache_state = TCACHE_ACTIVE;
+  return tc;
+}
+
+void *tcache_alloc(struct slab_cache *cache, size_t index, bool *clean) {
+  bool obj_clean;
+  struct tcache *tc = tcache_get();
+  if (tc == NULPTR || index >= TCACHE_BINS_NUM) {
+    void *obj = slab_cache_alloc_clean(cache, &obj_clean);
+    if (clean) {
+      *clean = obj_clean;
+    }
+    return obj;
+  }
+  struct tcache_bin *bin = &tc->bins[index];
+  if (bin->count == 0) {
+    // refill half of the bin, remembering which objects are still zero
+    bool clean_objs[TCACHE_BATCH];
+    bin->count =
+        (int)slab_cache_alloc_bulk(cache, bin->objs, TCACHE_BATCH, clean_objs);
+    for (int i = 0; i < bin->count; i++) {
+      if (clean_objs[i]) {
+        bin->objs[i] =
+            (void *)((unsigned long long)bin->objs[i] | TCACHE_CLEAN);
+      }
+    }
+    if (bin->count == 0) {
+      return NULPTR; // Out of memory
+    }
+  }
+  unsigned long long tagged = (unsigned long long)bin->objs[--bin->count];
+  if (clean) {
+    *clean = tagged & TCACHE_CLEAN;
+  }
+  return (void *)(tagged & ~TCACHE_CLEAN);
+}
+
+void tcache_free(size_t index, void *ptr) {
+  struct tcache *tc = tcache_get();
+  if (tc == NULPTR || index >= TCACHE_BINS_NUM) {
+    slab_free_to(slab_of(ptr), ptr);
+    return;
+  }
+  struct tcache_bin *bin = &tc->bins[index];
+  if (bin->count == TCACHE_BIN_CAP) {
+    tcache_flush_bin(bin, TCACHE_BATCH);
+  }
+  bin->objs[bin->count++] = ptr;
+}
+
+void tcache_flush() {
+  struct tcache *tc = tcache_get();
+  if (tc == NULPTR) {
+    return;
+  }
+  for (int i = 0; i < TCACHE_BINS_NUM; i++) {
+    tcache_flush_bin(&tc->bins[i], tc->bins[i].count);
+  }
+}
@@ -1,18 +1,86 @@
+#include "allocator.h"
+#include "arena.h"
+#include "guarded.h"
+#include "large.h"
+#include "memops.h"
 #include "mm.h"
+#include "object_cache.h"
+#include "profile.h"
+#include "size_class.h"
 #include "slab.h"
+#include "tcache.h"
 #include <assert.h>
+#include <errno.h>
+#include <list>
+#include <malloc.h>
+#include <map>
+#include <new>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 // Mock implementations for bulk allocation for testing purposes
-void *bulk_alloc(size_t size) { return malloc(size); }
+// bulk_alloc has to hand out page aligned, zeroed memory, like mmap does.
+// out of memory paths are tested by setting bulk_alloc_countdown: bulk_alloc
+// fails after that many more calls, until it is set back to -1.
+static int bulk_alloc_countdown = -1;
+
+void *bulk_alloc(size_t size) {
+  if (bulk_alloc_countdown == 0) {
+    return NULL;
+  }
+  if (bulk_alloc_countdown > 0) {
+    bulk_alloc_countdown--;
+  }
+  size = (size + 4095) & ~(size_t)4095;
+  void *ptr = aligned_alloc(4096, size);
+  if (ptr) {
+    memset(ptr, 0, size);
+  }
+  return ptr;
+}
 
 void bulk_free(void *ptr, size_t size) {
   (void)size; // size is unused in this mock
   free(ptr);
 }
 
+// a real page source moves the pages with mremap instead of copying. only
+// shrinking works in place here, the tail is simply kept.
+void *bulk_realloc(void *ptr, size_t old_size, size_t new_size, void *dest) {
+  if (!dest) {
+    return new_size <= old_size ? ptr : NULL;
+  }
+  memcpy(dest, ptr, old_size < new_size ? old_size : new_size);
+  free(ptr);
+  return dest;
+}
+
+// huge blocks for the slab regions are aligned to their 2 MB
+void *bulk_alloc_huge(size_t size) {
+  void *ptr = aligned_alloc(REGION_SIZE, size);
+  if (ptr) {
+    memset(ptr, 0, size);
+  }
+  return ptr;
+}
+
+void bulk_free_huge(void *ptr, size_t size) {
+  (void)size;
+  free(ptr);
+}
+
+// guard pages of the guarded pool
+int bulk_protect(void *ptr, size_t size, bool accessible) {
+  return mprotect(ptr, size, accessible ? PROT_READ | PROT_WRITE : PROT_NONE);
+}
+
 // --- Test Helper Functions ---
 void ctor_test(void *ptr, size_t size) {
   printf("CTOR called for object at %p, size %zu\n", ptr, size);
@@ -172,6 +240,624 @@ void test_multiple_caches() {
   printf("Multiple caches test PASSED.\n");
 }
 
+void test_slab_lookup() {
+  printf("\n--- Test: O(1) Pointer to Slab Lookup ---\n");
+  const int NUM_CACHES = 2;
+  struct slab_cache caches[NUM_CACHES];
+  // unsorted on purpose: slab_alloc picks the best fit
+  slab_cache_init(&caches[0], 256, 8, NULL, NULL);
+  slab_cache_init(&caches[1], 64, 8, NULL, NULL);
+
+  // spread objects over many slabs of both caches
+  const size_t NUM_OBJS = 2000;
+  void **ptrs = (void **)malloc(sizeof(void *) * NUM_OBJS);
+  assert(ptrs != NULL);
+  for (size_t i = 0; i < NUM_OBJS; ++i) {
+    ptrs[i] = slab_alloc(i % 2 ? 200 : 40, 8, caches, NUM_CACHES);
+    assert(ptrs[i] != NULL);
+  }
+  for (size_t i = 0; i < NUM_OBJS; ++i) {
+    struct slab *slab = slab_of(ptrs[i]);
+    assert(slab != NULL);
+    assert(slab->cache == &caches[i % 2 ? 0 : 1]);
+    assert(get_slab_obj_size(ptrs[i], caches, NUM_CACHES) ==
+           (i % 2 ? 256u : 64u));
+  }
+  // a pointer that is not from a slab is not found
+  int on_stack;
+  assert(slab_of(&on_stack) == NULL);
+  assert(get_slab_obj_size(&on_stack, caches, NUM_CACHES) == 0);
+
+  // free in an interleaved order, every slab must end up empty
+  for (size_t i = 0; i < NUM_OBJS; i += 2) {
+    slab_free(ptrs[i], caches, NUM_CACHES);
+  }
+  for (size_t i = 1; i < NUM_OBJS; i += 2) {
+    slab_free(ptrs[i], caches, NUM_CACHES);
+  }
+  for (int i = 0; i < NUM_CACHES; ++i) {
+    assert(caches[i].slabs_partial == NULL);
+    assert(caches[i].slabs_full == NULL);
+    assert(caches[i].slabs_empty != NULL);
+  }
+  free(ptrs);
+  printf("Slab lookup test PASSED.\n");
+}
+
+void test_slab_shards() {
+  printf("\n--- Test: Per-CPU Sharded Slab Cache ---\n");
+  struct slab_cache cache;
+  slab_cache_init(&cache, 48, 8, NULL, NULL);
+  int rc = slab_cache_shard(&cache, 4);
+  assert(rc == 0);
+  assert(cache.shards != NULL && cache.shards_num == 4);
+
+  const size_t NUM_OBJS = 500;
+  void **ptrs = (void **)malloc(sizeof(void *) * NUM_OBJS);
+  assert(ptrs != NULL);
+  for (size_t i = 0; i < NUM_OBJS; ++i) {
+    ptrs[i] = slab_alloc(48, 8, &cache, 1);
+    assert(ptrs[i] != NULL);
+    // the slab belongs to a shard, which resolves to the parent cache
+    struct slab *slab = slab_of(ptrs[i]);
+    assert(slab->cache->parent == &cache);
+    assert(slab_top_cache(slab) == &cache);
+  }
+  for (size_t i = 0; i < NUM_OBJS; ++i) {
+    slab_free(ptrs[i], &cache, 1);
+  }
+  // the lists of the parent cache stay unused
+  assert(cache.slabs_partial == NULL && cache.slabs_full == NULL &&
+         cache.slabs_empty == NULL);
+  free(ptrs);
+  printf("Sharded slab cache test PASSED.\n");
+}
+
+void test_remote_free() {
+  printf("\n--- Test: Remote Free List ---\n");
+  struct slab_cache cache;
+  slab_cache_init(&cache, 32, 8, NULL, NULL);
+  void *p1 = slab_alloc(32, 8, &cache, 1);
+  void *p2 = slab_alloc(32, 8, &cache, 1);
+  assert(p1 != NULL && p2 != NULL);
+  struct slab *slab = slab_of(p1);
+  assert(slab->active == 2);
+
+  // while another thread holds the lock, frees do not wait for it
+  spin_lock(&cache.lock);
+  slab_free(p1, &cache, 1);
+  slab_free(p2, &cache, 1);
+  assert(cache.remote_free != NULL);
+  assert(slab->active == 2);
+  spin_unlock(&cache.lock);
+
+  // the next allocation drains the remote free list
+  void *p3 = slab_alloc(32, 8, &cache, 1);
+  assert(p3 != NULL);
+  assert(cache.remote_free == NULL);
+  assert(slab->active == 1);
+  slab_free(p3, &cache, 1);
+  assert(slab->active == 0 && cache.slabs_empty == slab);
+  printf("Remote free test PASSED.\n");
+}
+
+static size_t list_length(struct slab *slab) {
+  size_t n = 0;
+  for (; slab; slab = slab->next) {
+    n++;
+  }
+  return n;
+}
+
+void test_slab_bulk() {
+  printf("\n--- Test: Bulk Alloc and Free ---\n");
+  struct slab_cache caches[2];
+  slab_cache_init(&caches[0], 32, 8, NULL, NULL);
+  slab_cache_init(&caches[1], 100, 4, NULL, NULL);
+  size_t per_slab = caches[0].objects_num_per_slab;
+  size_t num = per_slab * 3 + 5;
+  void **objs = (void **)malloc(sizeof(void *) * num);
+  void *others[20];
+  assert(objs != NULL);
+
+  // 1. a burst fills whole slabs at once
+  size_t got = slab_alloc_bulk(32, 8, caches, 2, objs, num);
+  assert(got == num);
+  assert(list_length(caches[0].slabs_full) == 3);
+  assert(list_length(caches[0].slabs_partial) == 1);
+  assert(slab_of(objs[num - 1])->active == 5);
+  for (size_t i = 0; i < num; ++i) {
+    assert(slab_of(objs[i])->cache == &caches[0]);
+    memset(objs[i], (int)i, 32);
+  }
+  for (size_t i = 1; i < num; ++i) {
+    assert(objs[i] != objs[i - 1]);
+  }
+  got = slab_cache_alloc_bulk(&caches[1], others, 20, NULL);
+  assert(got == 20);
+  printf("  Allocated %zu + 20 objects in two calls.\n", num);
+
+  // 2. free them interleaved with another cache's objects
+  void **mixed = (void **)malloc(sizeof(void *) * (num + 20));
+  assert(mixed != NULL);
+  size_t n = 0;
+  for (size_t i = 0; i < num; ++i) {
+    mixed[n++] = objs[i];
+    if (i % 20 == 0 && i / 20 < 20) {
+      mixed[n++] = others[i / 20];
+    }
+  }
+  for (size_t i = (num + 19) / 20; i < 20; ++i) {
+    mixed[n++] = others[i];
+  }
+  assert(n == num + 20);
+  slab_free_bulk(mixed, n);
+  assert(caches[0].slabs_full == NULL && caches[0].slabs_partial == NULL);
+  assert(caches[0].slabs_empty_num == 4);
+  assert(caches[1].slabs_full == NULL && caches[1].slabs_partial == NULL);
+  printf("  Freed them in one call.\n");
+
+  // 3. a run freed while the lock is taken goes to the remote list at once
+  got = slab_cache_alloc_bulk(&caches[0], objs, 10, NULL);
+  assert(got == 10);
+  spin_lock(&caches[0].lock);
+  slab_free_bulk(objs, 10);
+  assert(caches[0].remote_free == objs[0]);
+  spin_unlock(&caches[0].lock);
+  void *p = slab_cache_alloc(&caches[0]);
+  assert(p != NULL && caches[0].remote_free == NULL);
+  slab_free_bulk(&p, 1);
+  assert(caches[0].slabs_partial == NULL && caches[0].slabs_full == NULL);
+
+  slab_cache_shrink(&caches[0]);
+  slab_cache_shrink(&caches[1]);
+  free(mixed);
+  free(objs);
+  printf("Bulk alloc/free test PASSED.\n");
+}
+
+void test_slab_reclaim() {
+  printf("\n--- Test: Empty Slab Reclamation ---\n");
+  struct slab_cache cache;
+  slab_cache_init(&cache, 32, 8, NULL, NULL);
+  size_t per_slab = cache.objects_num_per_slab;
+  size_t num = per_slab * 5;
+  void **ptrs = (void **)malloc(sizeof(void *) * num);
+  assert(ptrs != NULL);
+
+  // 1. beyond the high watermark, emptied slabs go back to the page source
+  slab_cache_set_reclaim(&cache, 2, 1);
+  for (size_t i = 0; i < num; ++i) {
+    ptrs[i] = slab_alloc(32, 8, &cache, 1);
+    assert(ptrs[i] != NULL);
+  }
+  for (size_t i = 0; i < num; ++i) {
+    slab_free(ptrs[i], &cache, 1);
+  }
+  assert(cache.slabs_empty_num == 2);
+  assert(cache.slabs_partial == NULL && cache.slabs_full == NULL);
+  printf("  kept %zu empty slabs out of 5.\n", cache.slabs_empty_num);
+
+  // 2. unused empty slabs decay after decay_epochs + 1 ticks
+  slab_cache_set_reclaim(&cache, 8, 1);
+  for (size_t i = 0; i < num; ++i) {
+    ptrs[i] = slab_alloc(32, 8, &cache, 1);
+    assert(ptrs[i] != NULL);
+  }
+  for (size_t i = 0; i < num; ++i) {
+    slab_free(ptrs[i], &cache, 1);
+  }
+  assert(cache.slabs_empty_num == 5);
+  size_t released = slab_cache_decay(&cache);
+  assert(released == 0 && cache.slabs_empty_num == 5);
+  // a slab reused and emptied again starts over
+  void *p = slab_alloc(32, 8, &cache, 1);
+  assert(p != NULL);
+  slab_free(p, &cache, 1);
+  released = slab_cache_decay(&cache);
+  assert(released == 4 * cache.slab_size && cache.slabs_empty_num == 1);
+  released = slab_cache_decay(&cache);
+  assert(released == cache.slab_size && cache.slabs_empty == NULL);
+  printf("  empty slabs decayed.\n");
+
+  // 3. shrink releases every empty slab at once
+  for (size_t i = 0; i < per_slab * 3; ++i) {
+    ptrs[i] = slab_alloc(32, 8, &cache, 1);
+    assert(ptrs[i] != NULL);
+  }
+  for (size_t i = 0; i < per_slab * 3; ++i) {
+    slab_free(ptrs[i], &cache, 1);
+  }
+  released = slab_cache_shrink(&cache);
+  assert(released == 3 * cache.slab_size);
+  assert(cache.slabs_empty == NULL && cache.slabs_empty_num == 0);
+  free(ptrs);
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  // 4. mm_trim flushes the thread cache and shrinks the global caches
+  void *objs[64];
+  for (int i = 0; i < 64; ++i) {
+    objs[i] = mm_malloc(1000, 8);
+    assert(objs[i] != NULL);
+  }
+  for (int i = 0; i < 64; ++i) {
+    mm_free(objs[i]);
+  }
+  released = mm_trim();
+  assert(released > 0);
+  assert(mm_trim() == 0);
+  printf("  mm_trim released %zu bytes.\n", released);
+#endif
+  printf("Empty slab reclamation test PASSED.\n");
+}
+
+static int sign_of(int v) { return (v > 0) - (v < 0); }
+
+// offset of the objects area of the slab holding ptr from the slab's start
+static size_t color_offset(void *ptr) {
+  struct slab *slab = slab_of(ptr);
+  assert(slab != NULL);
+  return (uintptr_t)slab->mem_ptr - (uintptr_t)slab;
+}
+
+void test_slab_coloring() {
+  printf("\n--- Test: Slab Coloring ---\n");
+  struct slab_cache cache;
+  // 11 objects of 704 bytes leave 320 bytes of a two page slab: 6 colors
+  slab_cache_init(&cache, 700, 64, NULL, NULL);
+  assert(cache.slab_size == 2 * PAGE_SIZE);
+  assert(cache.colors_num == 6 && cache.color_step == 64);
+  size_t per_slab = cache.objects_num_per_slab;
+  size_t slabs = cache.colors_num + 2;
+  void **ptrs = (void **)malloc(sizeof(void *) * slabs * per_slab);
+  assert(ptrs != NULL);
+
+  // 1. every new slab shifts its objects one cache line further, cyclically
+  for (size_t i = 0; i < slabs * per_slab; ++i) {
+    ptrs[i] = slab_cache_alloc(&cache);
+    assert(ptrs[i] != NULL && (uintptr_t)ptrs[i] % 64 == 0);
+  }
+  size_t first = color_offset(ptrs[0]);
+  for (size_t i = 0; i < slabs * per_slab; ++i) {
+    size_t color = (i / per_slab) % cache.colors_num;
+    assert(color_offset(ptrs[i]) == first + color * cache.color_step);
+    // the shifted objects still end inside their slab
+    struct slab *slab = slab_of(ptrs[i]);
+    assert((uintptr_t)ptrs[i] + 704 <= (uintptr_t)slab + cache.slab_size);
+  }
+  for (size_t i = 0; i < slabs * per_slab; ++i) {
+    slab_free_to(slab_of(ptrs[i]), ptrs[i]);
+  }
+  slab_cache_shrink(&cache);
+  printf("  %zu slabs cycled through %zu colors.\n", slabs, cache.colors_num);
+
+  // 2. without coloring every slab has the same layout
+  slab_cache_set_coloring(&cache, false);
+  for (size_t i = 0; i < 3 * per_slab; ++i) {
+    ptrs[i] = slab_cache_alloc(&cache);
+    assert(ptrs[i] != NULL);
+  }
+  for (size_t i = 0; i < 3 * per_slab; ++i) {
+    assert(color_offset(ptrs[i]) == first);
+  }
+  for (size_t i = 0; i < 3 * per_slab; ++i) {
+    slab_free_to(slab_of(ptrs[i]), ptrs[i]);
+  }
+  slab_cache_shrink(&cache);
+  free(ptrs);
+
+  // 3. a cache whose objects fill its slabs has a single color
+  struct slab_cache full;
+  slab_cache_init(&full, 64, 64, NULL, NULL);
+  assert(full.colors_num == 1);
+  printf("Slab coloring test PASSED.\n");
+}
+
+void test_slab_orders() {
+  printf("\n--- Test: Slab Orders ---\n");
+  // 1. every cache picks a slab of 2^n pages whose tail is small
+  for (size_t size = 8; size <= SMALL_SIZE_MAX; size += 8) {
+    struct slab_cache cache;
+    slab_cache_init(&cache, size, 8, NULL, NULL);
+    size_t pages = cache.slab_size / PAGE_SIZE;
+    assert(cache.slab_size % PAGE_SIZE == 0);
+    assert(pages <= SLAB_PAGES_MAX && (pages & (pages - 1)) == 0);
+    assert(cache.objects_num_per_slab >= 1);
+    size_t tail = cache.slab_size - sizeof(struct slab) -
+                  cache.objects_num_per_slab * (size + sizeof(short));
+    // a larger slab is only taken when the smaller ones waste too much
+    if (pages > 1) {
+      assert(tail * 100 <= cache.slab_size * SLAB_WASTE_MAX_PERCENT ||
+             pages == SLAB_PAGES_MAX);
+    }
+  }
+  struct slab_cache small_objects;
+  slab_cache_init(&small_objects, 64, 8, NULL, NULL);
+  assert(small_objects.slab_size == PAGE_SIZE);
+
+  // 2. objects of the later pages of a slab are found and freed through it
+  struct slab_cache cache;
+  slab_cache_init(&cache, 2048, 8, NULL, NULL);
+  assert(cache.slab_size > PAGE_SIZE);
+  size_t per_slab = cache.objects_num_per_slab;
+  printf("  2048 bytes: %zu pages, %zu objects per slab\n",
+         cache.slab_size / PAGE_SIZE, per_slab);
+  void **ptrs = (void **)malloc(sizeof(void *) * per_slab * 2);
+  assert(ptrs != NULL);
+  for (size_t i = 0; i < per_slab * 2; ++i) {
+    ptrs[i] = slab_cache_alloc(&cache);
+    assert(ptrs[i] != NULL);
+    memset(ptrs[i], 0xab, 2048);
+  }
+  for (size_t i = 0; i < per_slab * 2; ++i) {
+    struct slab *slab = slab_of(ptrs[i]);
+    assert(slab != NULL && slab->cache == &cache);
+    assert((uintptr_t)ptrs[i] + 2048 <= (uintptr_t)slab + cache.slab_size);
+    // the object's last byte is owned by the same slab
+    assert(slab_of((char *)ptrs[i] + 2047) == slab);
+  }
+  for (size_t i = 0; i < per_slab * 2; ++i) {
+    slab_free_to(slab_of(ptrs[i]), ptrs[i]);
+  }
+  assert(slab_cache_shrink(&cache) == 2 * cache.slab_size);
+  free(ptrs);
+
+  // 3. the objects too large for the largest slab get a slab of their own
+  struct slab_cache huge_objects;
+  slab_cache_init(&huge_objects, SLAB_PAGES_MAX * PAGE_SIZE, 8, NULL, NULL);
+  assert(huge_objects.objects_num_per_slab == 1);
+  assert(huge_objects.slab_size > SLAB_PAGES_MAX * PAGE_SIZE);
+  void *big = slab_cache_alloc(&huge_objects);
+  assert(big != NULL && slab_of(big) != NULL);
+  slab_free_to(slab_of(big), big);
+  slab_cache_shrink(&huge_objects);
+  printf("Slab orders test PASSED.\n");
+}
+
+void test_slab_freelists() {
+  printf("\n--- Test: Freelist Representations ---\n");
+  const enum slab_freelist_kind kinds[] = {
+      SLAB_FREELIST_INDEX, SLAB_FREELIST_LINKED, SLAB_FREELIST_BITMAP};
+  const char *names[] = {"index", "linked", "bitmap"};
+  size_t index_per_slab = 0;
+  for (size_t k = 0; k < 3; ++k) {
+    struct slab_cache cache;
+    slab_cache_init(&cache, 48, 16, NULL, NULL);
+    int ret = slab_cache_set_freelist(&cache, kinds[k]);
+    assert(ret == 0 && cache.freelist_kind == kinds[k]);
+    size_t per_slab = cache.objects_num_per_slab;
+    printf("  %s: %zu objects per slab\n", names[k], per_slab);
+    if (k == 0) {
+      index_per_slab = per_slab;
+    } else {
+      // less metadata, more objects in the same slab
+      assert(cache.slab_size == PAGE_SIZE && per_slab > index_per_slab);
+    }
+    size_t num = per_slab * 2;
+    void **ptrs = (void **)malloc(sizeof(void *) * num);
+    assert(ptrs != NULL);
+
+    // 1. two slabs are filled with distinct, clean blocks
+    for (size_t i = 0; i < num; ++i) {
+      bool clean = false;
+      ptrs[i] = slab_cache_alloc_clean(&cache, &clean);
+      assert(ptrs[i] != NULL && clean);
+      for (size_t j = 0; j < i; ++j) {
+        assert(ptrs[j] != ptrs[i]);
+      }
+      memset(ptrs[i], 0x5a, 48);
+    }
+    struct slab *first = slab_of(ptrs[0]);
+    assert(first->active == (int)per_slab && cache.slabs_full != NULL);
+
+    // 2. freed blocks are handed out again, and are not clean any more
+    for (size_t i = 1; i < per_slab; i += 2) {
+      slab_free_to(first, ptrs[i]);
+    }
+    assert(first->active == (int)(per_slab - per_slab / 2));
+    for (size_t i = 1; i < per_slab; i += 2) {
+      bool clean = true;
+      void *p = slab_cache_alloc_clean(&cache, &clean);
+      assert(slab_of(p) == first && !clean);
+      bool found = false;
+      for (size_t j = 1; j < per_slab; j += 2) {
+        found = found || p == ptrs[j];
+      }
+      assert(found);
+    }
+    assert(first->active == (int)per_slab);
+
+    // 3. index arrays and linked lists hand out the hottest block, bitmaps
+    // the lowest one
+    slab_free_to(first, ptrs[3]);
+    slab_free_to(first, ptrs[5]);
+    void *next = slab_cache_alloc(&cache);
+    void *after = slab_cache_alloc(&cache);
+    if (kinds[k] == SLAB_FREELIST_BITMAP) {
+      assert(next == ptrs[3] && after == ptrs[5]);
+    } else {
+      assert(next == ptrs[5] && after == ptrs[3]);
+    }
+
+    // 4. everything goes back, and the slabs become empty
+    for (size_t i = 0; i < num; ++i) {
+      slab_free_to(slab_of(ptrs[i]), ptrs[i]);
+    }
+    assert(cache.slabs_full == NULL && cache.slabs_partial == NULL);
+    assert(slab_cache_shrink(&cache) == 2 * cache.slab_size);
+    free(ptrs);
+  }
+
+  // 5. a linked list needs room for its link in every block
+  struct slab_cache tiny;
+  slab_cache_init(&tiny, 4, 4, NULL, NULL);
+  assert(slab_cache_set_freelist(&tiny, SLAB_FREELIST_LINKED) == -1);
+  assert(tiny.freelist_kind == SLAB_FREELIST_INDEX);
+  assert(slab_cache_set_freelist(&tiny, SLAB_FREELIST_BITMAP) == 0);
+  void *p = slab_cache_alloc(&tiny);
+  assert(p != NULL);
+  slab_free_to(slab_of(p), p);
+  slab_cache_shrink(&tiny);
+  printf("Freelist representations test PASSED.\n");
+}
+
+void test_slab_regions() {
+  printf("\n--- Test: Huge Page Regions ---\n");
+  struct slab_cache cache;
+  slab_cache_init(&cache, 64, 8, NULL, NULL);
+  slab_cache_set_huge(&cache, true);
+  // empty slabs go back right away
+  slab_cache_set_reclaim(&cache, 0, 0);
+  size_t per_slab = cache.objects_num_per_slab;
+  size_t num = per_slab * 4;
+  void **ptrs = (void **)malloc(sizeof(void *) * num);
+  assert(ptrs != NULL);
+
+  // 1. the slabs are carved out of a single region
+  for (size_t i = 0; i < num; ++i) {
+    ptrs[i] = slab_cache_alloc(&cache);
+    assert(ptrs[i] != NULL);
+  }
+  struct slab *first = slab_of(ptrs[0]);
+  uintptr_t region = (uintptr_t)first & ~(REGION_SIZE - 1);
+  for (size_t i = 0; i < num; ++i) {
+    struct slab *slab = slab_of(ptrs[i]);
+    assert(slab->in_region);
+    assert(((uintptr_t)slab & ~(REGION_SIZE - 1)) == region);
+  }
+  assert(cache.regions.regions_num == 1 && cache.regions.slots_used == 4);
+  struct slab_cache_stats stats;
+  slab_cache_get_stats(&cache, &stats);
+  assert(stats.regions_num == 1 && stats.bytes_reserved == REGION_SIZE);
+  printf("  4 slabs share one region.\n");
+
+  // 2. a slot that held a slab is reused, but is not zero any more
+  for (size_t i = 0; i < per_slab; ++i) {
+    memset(ptrs[i], 0xAB, 64);
+    slab_free_to(slab_of(ptrs[i]), ptrs[i]);
+  }
+  assert(cache.regions.slots_used == 3);
+  for (size_t i = 0; i < per_slab; ++i) {
+    bool clean = true;
+    ptrs[i] = slab_cache_alloc_clean(&cache, &clean);
+    assert(ptrs[i] != NULL && !clean);
+  }
+  assert(slab_of(ptrs[0]) == first && cache.regions.regions_num == 1);
+  printf("  reused slot is not taken for zero.\n");
+
+  // 3. the region goes back with its last slab
+  for (size_t i = 0; i < num; ++i) {
+    slab_free_to(slab_of(ptrs[i]), ptrs[i]);
+  }
+  assert(cache.regions.regions_num == 0 && cache.regions.regions == NULL);
+  free(ptrs);
+
+  // 4. slabs aligned above a page are not a multiple of pages, but still
+  // start on one
+  struct slab_cache wide;
+  slab_cache_init(&wide, 100, 2 * PAGE_SIZE, NULL, NULL);
+  slab_cache_set_huge(&wide, true);
+  slab_cache_set_reclaim(&wide, 0, 0);
+  assert(wide.slab_size % PAGE_SIZE != 0);
+  void *objs[8];
+  for (size_t i = 0; i < 8; ++i) {
+    objs[i] = slab_cache_alloc(&wide);
+    assert(objs[i] != NULL && (uintptr_t)objs[i] % (2 * PAGE_SIZE) == 0);
+    memset(objs[i], 0xCD, 100);
+    struct slab *slab = slab_of(objs[i]);
+    assert(slab->in_region && (uintptr_t)slab % PAGE_SIZE == 0);
+  }
+  // the slots are whole pages, so are the bytes they take
+  size_t regions_num, unused;
+  region_pool_stats(&wide.regions, wide.slab_size, &regions_num, &unused);
+  size_t slot_size = (wide.slab_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  assert(regions_num == 1 &&
+         unused == REGION_SIZE - wide.regions.slots_used * slot_size);
+  for (size_t i = 0; i < 8; ++i) {
+    slab_free_to(slab_of(objs[i]), objs[i]);
+  }
+  assert(wide.regions.regions_num == 0);
+  printf("  slabs aligned above a page start on one.\n");
+  printf("Huge page region test PASSED.\n");
+}
+
+void test_memops() {
+  printf("\n--- Test: Memory Kernels ---\n");
+  enum memops_isa saved = memops_get_isa();
+  unsigned char src[600], dest[600], expect[600];
+  for (int i = 0; i < 600; ++i) {
+    src[i] = (unsigned char)(i * 7 + 3);
+  }
+  for (int isa = MEMOPS_WORD; isa <= MEMOPS_AVX2; ++isa) {
+    if (memops_set_isa((enum memops_isa)isa) != 0) {
+      printf("  isa %d not supported, skipped.\n", isa);
+      continue;
+    }
+    for (size_t offset = 0; offset < 8; ++offset) {
+      for (size_t n = 0; n <= 300; ++n) {
+        // copy: the bytes around the range must stay untouched
+        memset(dest, 0xEE, sizeof(dest));
+        memcpy(expect, dest, sizeof(dest));
+        memcpy(expect + offset, src + 3, n);
+        mm_memcpy(dest + offset, src + 3, n);
+        assert(memcmp(dest, expect, sizeof(dest)) == 0);
+
+        memset(expect + offset, 0x5C, n);
+        mm_memset(dest + offset, 0x5C, n);
+        assert(memcmp(dest, expect, sizeof(dest)) == 0);
+
+        // compare: equal, then one differing byte at every position
+        memcpy(dest + offset, src, n);
+        assert(mm_memcmp(dest + offset, src, n) == 0);
+        for (size_t i = 0; i < n; i += 1 + n / 16) {
+          dest[offset + i] ^= 0x80;
+          assert(sign_of(mm_memcmp(dest + offset, src, n)) ==
+                 sign_of(memcmp(dest + offset, src, n)));
+          dest[offset + i] ^= 0x80;
+        }
+      }
+    }
+    printf("  isa %d OK.\n", isa);
+  }
+  memops_set_isa(saved);
+  printf("Memory kernels test PASSED.\n");
+}
+
+void test_size_classes() {
+  printf("\n--- Test: Size Classes ---\n");
+  printf("  %zu classes up to %d bytes\n", SIZE_CLASSES_NUM, SMALL_SIZE_MAX);
+  for (size_t i = 1; i < SIZE_CLASSES_NUM; ++i) {
+    assert(size_classes.sizes[i] > size_classes.sizes[i - 1]);
+  }
+  assert(size_classes.sizes[SIZE_CLASSES_NUM - 1] == SMALL_SIZE_MAX);
+  for (size_t size = 1; size <= SMALL_SIZE_MAX; ++size) {
+    size_t index = size_class_of(size, 1);
+    assert(index < SIZE_CLASSES_NUM);
+    size_t class_size = size_classes.sizes[index];
+    // the class fits, and it is the smallest one that does
+    assert(class_size >= size);
+    assert(index == 0 || size_classes.sizes[index - 1] < size);
+    // bounded internal fragmentation
+    if (size > SIZE_CLASS_SPACING_START) {
+      assert((class_size - size) * SIZE_CLASS_STEPS < size);
+    } else {
+      assert(class_size - size < SIZE_CLASS_QUANTUM);
+    }
+    // aligned requests get a class that is aligned enough
+    for (size_t alignment = 1; alignment <= 1024; alignment *= 2) {
+      size_t aligned = size_class_of(size, alignment);
+      if (aligned == SIZE_CLASSES_NUM) {
+        assert(((size + alignment - 1) & ~(alignment - 1)) > SMALL_SIZE_MAX);
+        continue;
+      }
+      assert(size_classes.sizes[aligned] >= size);
+      assert(size_classes.alignments[aligned] >= alignment);
+    }
+  }
+  assert(size_class_of(SMALL_SIZE_MAX + 1, 1) == SIZE_CLASSES_NUM);
+  printf("Size class test PASSED.\n");
+}
+
 void test_mm_canary() {
   printf("\n--- Test: MM Allocator with Canary ---\n");
 
@@ -186,18 +872,27 @@ void test_mm_canary() {
   printf("    Freed p1. OK.\n");
 
   // Test 2: Buffer overflow detection
+#if MM_HARDENING != MM_HARDENING_OFF
   printf("  Sub-test: Buffer overflow detection\n");
-  char *p2 = (char *)mm_malloc(50, 1);
-  assert(p2 != NULL);
-  printf("    Allocated p2: %p\n", (void *)p2);
-  // Corrupt the memory right after the user block to overwrite the canary
-  printf("    Writing past the allocated boundary to corrupt canary...\n");
-  for (int i = 0; i <= 50 + 5; i++) { // overflow
-    p2[i] = 'A';
-  }
-  printf("    Freeing p2. Expecting a corruption message...\n");
-  mm_free(p2); // This should print a corruption message.
-  printf("    Corruption check finished.\n");
+  // the corrupted heap aborts the process, so it happens in a child
+  fflush(stdout);
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    char *p2 = (char *)mm_malloc(50, 1);
+    // Corrupt the memory right after the user block to overwrite the canary
+    for (int i = 0; i <= 50 + 5; i++) { // overflow
+      p2[i] = 'A';
+    }
+    mm_free(p2); // This should abort.
+    _exit(0);
+  }
+  int status;
+  pid_t waited = waitpid(pid, &status, 0);
+  assert(waited == pid);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  printf("    Corruption aborted the child.\n");
+#endif
 
   // Test 3: Realloc
   printf("  Sub-test: Realloc\n");
@@ -217,7 +912,44 @@ void test_mm_canary() {
   mm_free(p4);
   printf("    Freed p4. OK.\n");
 
-  // Test 4: Realloc with no previous allocation
+  // Test 3b: Realloc within the size class keeps the block
+  printf("  Sub-test: Realloc in place\n");
+  size_t in_place = mm_realloc_in_place_count();
+  char *s1 = (char *)mm_malloc(20, 8);
+  assert(s1 != NULL);
+  strcpy(s1, "grow me");
+  // 20 and 32 bytes plus canary and trailer share a class in every tier
+  char *s2 = (char *)mm_realloc(s1, 32, 8);
+  assert(s2 == s1 && strcmp(s2, "grow me") == 0);
+  assert(mm_usable_size(s2) == 32);
+  s2 = (char *)mm_realloc(s2, 20, 8);
+  assert(s2 == s1);
+  assert(mm_realloc_in_place_count() == in_place + 2);
+  // a smaller class moves the block
+  s2 = (char *)mm_realloc(s2, 1, 8);
+  assert(s2 != NULL && s2 != s1 && s2[0] == 'g');
+  assert(mm_realloc_in_place_count() == in_place + 2);
+  // without a trailer the usable size is the one of the 8 byte class
+  assert(mm_usable_size(s2) == (MM_HARDENING == MM_HARDENING_OFF ? 8 : 1));
+  mm_free(s2);
+  assert(mm_usable_size(&in_place) == 0);
+  printf("    Realloc in place OK.\n");
+
+  // Test 4: Many distinct sizes share the size classes
+  printf("  Sub-test: Many distinct sizes\n");
+  void *sized[300];
+  for (int i = 0; i < 300; i++) {
+    sized[i] = mm_malloc(1 + i * 11, i % 3 ? 8 : 64);
+    assert(sized[i] != NULL);
+    assert(i % 3 || ((uintptr_t)sized[i] % 64) == 0);
+    memset(sized[i], 0x5A, 1 + i * 11);
+  }
+  for (int i = 0; i < 300; i++) {
+    mm_free(sized[i]);
+  }
+  printf("    300 distinct sizes allocated and freed. OK.\n");
+
+  // Test 5: Realloc with no previous allocation
   printf("  Sub-test: Realloc with NULL pointer\n");
   void *p5 = mm_realloc(NULL, 70, 8);
   assert(p5 != NULL);
@@ -234,14 +966,1242 @@ void test_mm_canary() {
   printf("MM Allocator test PASSED.\n");
 }
 
-int main() {
+static bool all_zero(const void *ptr, size_t size) {
+  const unsigned char *p = (const unsigned char *)ptr;
+  for (size_t i = 0; i < size; ++i) {
+    if (p[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void test_mm_calloc() {
+  printf("\n--- Test: Lazy Zeroing and Calloc ---\n");
+  // 1. the slab cache knows which objects were never handed out
+  struct slab_cache cache;
+  slab_cache_init(&cache, 64, 8, NULL, NULL);
+  bool clean = false;
+  void *p1 = slab_cache_alloc_clean(&cache, &clean);
+  assert(p1 != NULL && clean && all_zero(p1, 64));
+  memset(p1, 0xAB, 64);
+  slab_free_to(slab_of(p1), p1);
+  void *p2 = slab_cache_alloc_clean(&cache, &clean);
+  assert(p2 == p1 && !clean);
+  void *p3 = slab_cache_alloc_clean(&cache, &clean);
+  assert(p3 != NULL && clean);
+  slab_free_to(slab_of(p2), p2);
+  slab_free_to(slab_of(p3), p3);
+  slab_cache_shrink(&cache);
+  printf("  Slab clean tracking OK.\n");
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  // 2. a reused object is cleared, a fresh one comes zeroed anyway
+  for (int round = 0; round < 3; ++round) {
+    unsigned char *d = (unsigned char *)mm_malloc(100, 8);
+    assert(d != NULL);
+    memset(d, 0xCD, 100);
+    mm_free(d);
+    unsigned char *z = (unsigned char *)mm_calloc(10, 10, 8);
+    assert(z != NULL && all_zero(z, 100));
+    mm_free(z);
+  }
+  unsigned char *fresh = (unsigned char *)mm_calloc(1, 2500, 8);
+  assert(fresh != NULL && all_zero(fresh, 2500));
+  mm_free(fresh);
+
+  // 3. large objects are fresh pages
+  unsigned char *big = (unsigned char *)mm_calloc(1000, 100, 16);
+  assert(big != NULL && all_zero(big, 100000));
+  mm_free(big);
+
+  // 4. the product must not overflow
+  assert(mm_calloc(~(size_t)0 / 2, 4, 8) == NULL);
+  printf("  mm_calloc OK.\n");
+#endif
+  printf("Lazy zeroing test PASSED.\n");
+}
+
+void test_mm_huge_sizes() {
+  printf("\n--- Test: Sizes Close to SIZE_MAX ---\n");
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  // adding the canary, trailer or alignment must not wrap to a small object
+  const size_t sizes[] = {SIZE_MAX,      SIZE_MAX - 8, SIZE_MAX - 20,
+                          SIZE_MAX - 64, SIZE_MAX / 2, SIZE_MAX - PAGE_SIZE};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    assert(mm_malloc(sizes[i], 1) == NULL);
+    assert(mm_malloc(sizes[i], 16) == NULL);
+    assert(mm_malloc(sizes[i], PAGE_SIZE) == NULL);
+    assert(mm_calloc(1, sizes[i], 8) == NULL);
+  }
+  // a failed realloc keeps the object
+  char *obj = (char *)mm_malloc(100, 8);
+  assert(obj != NULL);
+  memset(obj, 0x5A, 100);
+  assert(mm_realloc(obj, SIZE_MAX, 8) == NULL);
+  assert(mm_realloc(obj, SIZE_MAX - 20, 8) == NULL);
+  if (MM_HARDENING != MM_HARDENING_OFF) {
+    assert(mm_usable_size(obj) == 100);
+  }
+  assert(obj[0] == 0x5A && obj[99] == 0x5A);
+  // a hint that large goes through the lookup
+  mm_free_sized(obj, SIZE_MAX - 8, 8);
+  assert(mm_realloc(NULL, SIZE_MAX, 8) == NULL);
+  assert(size_class_of(SIZE_MAX, 16) == SIZE_CLASSES_NUM);
+  assert(size_class_of(SIZE_MAX - 8, 8) == SIZE_CLASSES_NUM);
+#else
+  printf("Skipping huge size tests because NO_GLOBAL_SLAB_CACHE_ARRAY is "
+         "defined.\n");
+#endif
+  printf("Huge size test PASSED.\n");
+}
+
+/**
+the huge size checks of libmm_preload.so: run by a copy of this binary started
+with LD_PRELOAD, so malloc and friends are the ones of the library.
+*/
+static int preload_huge_sizes() {
+  // volatile: the compiler must not fold the calls with constant sizes
+  volatile size_t huge = SIZE_MAX - 8;
+  errno = 0;
+  assert(malloc(huge) == NULL && errno == ENOMEM);
+  errno = 0;
+  assert(calloc(1, huge) == NULL && errno == ENOMEM);
+  errno = 0;
+  assert(calloc(huge / 2, 4) == NULL && errno == ENOMEM);
+  errno = 0;
+  assert(aligned_alloc(64, huge) == NULL && errno == ENOMEM);
+  errno = 0;
+  assert(memalign(PAGE_SIZE, huge) == NULL && errno == ENOMEM);
+  errno = 0;
+  assert(valloc(huge) == NULL && errno == ENOMEM);
+  errno = 0;
+  assert(pvalloc(huge) == NULL && errno == ENOMEM);
+  void *ptr = NULL;
+  assert(posix_memalign(&ptr, 64, huge) == ENOMEM && ptr == NULL);
+  assert(new (std::nothrow) char[huge] == NULL);
+  // a failed realloc keeps the object
+  char *obj = (char *)malloc(100);
+  assert(obj != NULL);
+  memset(obj, 0x5A, 100);
+  errno = 0;
+  assert(realloc(obj, huge) == NULL && errno == ENOMEM);
+  errno = 0;
+  assert(reallocarray(obj, huge / 2, 4) == NULL && errno == ENOMEM);
+  assert(obj[0] == 0x5A && obj[99] == 0x5A);
+  free(obj);
+  return 0;
+}
+
+/**
+memalign takes any alignment, like glibc does, and rounds it up to the next
+power of 2. run with LD_PRELOAD as well.
+*/
+static int preload_memalign() {
+  const size_t alignments[] = {0, 3, 24, 48, 100, 3000, 5000, 12288};
+  for (size_t i = 0; i < sizeof(alignments) / sizeof(alignments[0]); ++i) {
+    size_t power = 16;
+    while (power < alignments[i]) {
+      power <<= 1;
+    }
+    char *ptr = (char *)memalign(alignments[i], 100);
+    assert(ptr != NULL && (size_t)ptr % power == 0);
+    memset(ptr, 0x5A, 100);
+    free(ptr);
+  }
+  errno = 0;
+  assert(memalign(SIZE_MAX - 1, 100) == NULL && errno == EINVAL);
+  // only memalign is that lenient
+  void *ptr = NULL;
+  assert(posix_memalign(&ptr, 24, 100) == EINVAL && ptr == NULL);
+  errno = 0;
+  assert(aligned_alloc(24, 100) == NULL && errno == EINVAL);
+  return 0;
+}
+
+void test_preload() {
+  printf("\n--- Test: Preload Library ---\n");
+#if defined(MM_PRELOAD_PATH) && !defined(__SANITIZE_THREAD__)
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    setenv("LD_PRELOAD", MM_PRELOAD_PATH, 1);
+    execl("/proc/self/exe", "test", "preload", (char *)NULL);
+    _exit(127);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+#else
+  // the sanitizer runtime replaces malloc before the library could
+  printf("Skipping preload tests because the preload library is not "
+         "built.\n");
+#endif
+  printf("Preload test PASSED.\n");
+}
+
+struct dump_buffer {
+  char text[16384];
+  size_t len;
+};
+
+static void dump_write(void *arg, const char *buf, size_t len) {
+  struct dump_buffer *dump = (struct dump_buffer *)arg;
+  assert(dump->len + len < sizeof(dump->text));
+  memcpy(dump->text + dump->len, buf, len);
+  dump->len += len;
+  dump->text[dump->len] = '\0';
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+static void *stats_worker(void *arg) {
+  void **objs = (void **)arg;
+  for (int i = 0; i < 100; ++i) {
+    objs[i] = mm_malloc(40, 8);
+  }
+  return NULL;
+}
+#endif
+
+void test_mm_stats() {
+  printf("\n--- Test: Allocator Statistics ---\n");
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  static struct mm_stats before, after;
+  size_t cls = size_class_of(100 + MM_HARDENING_OVERHEAD, 8);
+  mm_stats_get(&before);
+
+  // 1. allocations are counted per size class, large objects apart
+  void *objs[10];
+  for (int i = 0; i < 10; ++i) {
+    objs[i] = mm_malloc(100, 8);
+    assert(objs[i] != NULL);
+  }
+  void *big = mm_malloc(100000, 8);
+  assert(big != NULL);
+  mm_stats_get(&after);
+  assert(after.classes_num == SIZE_CLASSES_NUM);
+  assert(after.classes[cls].object_size == size_classes.sizes[cls]);
+  assert(after.classes[cls].allocs == before.classes[cls].allocs + 10);
+  assert(after.classes[cls].live_objects ==
+         before.classes[cls].live_objects + 10);
+  // without a trailer the whole object counts as requested
+  assert(after.classes[cls].bytes_requested ==
+         before.classes[cls].bytes_requested +
+             10 * (MM_HARDENING == MM_HARDENING_OFF
+                       ? size_classes.sizes[cls]
+                       : 100));
+  assert(after.classes[cls].bytes_allocated >=
+         after.classes[cls].bytes_requested);
+  assert(after.classes[cls].slabs_created >= 1);
+  assert(after.classes[cls].bytes_reserved > 0);
+  assert(after.large.allocs == before.large.allocs + 1);
+  assert(after.large.bytes_requested == before.large.bytes_requested + 100000);
+  assert(after.large.bytes_reserved >= 100000);
+  assert(after.total.allocs == before.total.allocs + 11);
+
+  // 2. counts of exited threads are kept
+  void *remote[100];
+  pthread_t tid;
+  int rc = pthread_create(&tid, NULL, stats_worker, remote);
+  assert(rc == 0);
+  pthread_join(tid, NULL);
+  struct mm_stats *mid = &before;
+  mm_stats_get(mid);
+  size_t cls40 = size_class_of(40 + MM_HARDENING_OVERHEAD, 8);
+  assert(mid->classes[cls40].allocs >= after.classes[cls40].allocs + 100);
+
+  // 3. dumps
+  static struct dump_buffer dump;
+  dump.len = 0;
+  mm_stats_dump(MM_STATS_TEXT, dump_write, &dump);
+  assert(strstr(dump.text, "total") != NULL);
+  assert(strstr(dump.text, "large") != NULL);
+  printf("%s", dump.text);
+  dump.len = 0;
+  mm_stats_dump(MM_STATS_JSON, dump_write, &dump);
+  assert(dump.text[0] == '{' && strstr(dump.text, "\"total\":{") != NULL);
+  assert(strstr(dump.text, "\"bytes_reserved\":") != NULL);
+  printf("  JSON dump: %zu bytes.\n", dump.len);
+
+  for (int i = 0; i < 10; ++i) {
+    mm_free(objs[i]);
+  }
+  for (int i = 0; i < 100; ++i) {
+    mm_free(remote[i]);
+  }
+  mm_free(big);
+  mm_stats_get(&after);
+  assert(after.classes[cls].frees == mid->classes[cls].frees + 10);
+  assert(after.large.live_objects + 1 == mid->large.live_objects);
+#else
+  printf("Skipping statistics tests because NO_GLOBAL_SLAB_CACHE_ARRAY is "
+         "defined.\n");
+#endif
+  printf("Statistics test PASSED.\n");
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+#define MT_THREADS 4
+#define MT_ROUNDS 2000
+#define MT_LIVE 64
+
+static void *mt_worker(void *arg) {
+  size_t id = (size_t)arg;
+  void *live[MT_LIVE] = {0};
+  for (int round = 0; round < MT_ROUNDS; ++round) {
+    int slot = (round * 7 + (int)id) % MT_LIVE;
+    if (live[slot]) {
+      // every byte must still carry the pattern written by this thread
+      unsigned char *p = (unsigned char *)live[slot];
+      size_t size = 16 + (slot % 4) * 40;
+      for (size_t i = 0; i < size; ++i) {
+        assert(p[i] == (unsigned char)(id + slot));
+      }
+      mm_free(live[slot]);
+    }
+    size_t size = 16 + (slot % 4) * 40;
+    live[slot] = mm_malloc(size, 8);
+    assert(live[slot] != NULL);
+    memset(live[slot], (int)(id + slot), size);
+  }
+  for (int i = 0; i < MT_LIVE; ++i) {
+    if (live[i]) {
+      mm_free(live[i]);
+    }
+  }
+  return NULL;
+}
+
+// objects allocated by one thread and freed by another
+static void *mt_consumer(void *arg) {
+  void **objs = (void **)arg;
+  for (int i = 0; i < MT_ROUNDS; ++i) {
+    assert(strcmp((char *)objs[i], "message") == 0);
+    mm_free(objs[i]);
+  }
+  return NULL;
+}
+#endif
+
+void test_mm_large() {
+  printf("\n--- Test: MM Large Objects ---\n");
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  // just above the size classes, and a few megabytes
+  size_t sizes[] = {SMALL_SIZE_MAX - MM_HARDENING_OVERHEAD + 1, 8192, 100000,
+                    3 << 20};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    unsigned char *p = (unsigned char *)mm_malloc(sizes[i], 16);
+    assert(p != NULL);
+    assert(((uintptr_t)p % 16) == 0);
+    assert(slab_of(p) == NULL);
+    struct large_block *block = large_of(p);
+    assert(block != NULL && block->size >= sizes[i]);
+    memset(p, 0x3C, sizes[i]);
+    mm_free(p);
+  }
+  printf("  Large alloc/free OK.\n");
+
+  // page aligned and larger alignments
+  void *aligned = mm_malloc(10000, 8192);
+  assert(aligned != NULL && ((uintptr_t)aligned % 8192) == 0);
+  mm_free(aligned);
+
+  // growing and shrinking keep the contents
+  unsigned char *p = (unsigned char *)mm_malloc(5000, 8);
+  assert(p != NULL);
+  for (size_t i = 0; i < 5000; ++i) {
+    p[i] = (unsigned char)i;
+  }
+  p = (unsigned char *)mm_realloc(p, 1 << 20, 8);
+  assert(p != NULL && large_of(p) != NULL);
+  for (size_t i = 0; i < 5000; ++i) {
+    assert(p[i] == (unsigned char)i);
+  }
+  p = (unsigned char *)mm_realloc(p, 6000, 8);
+  assert(p != NULL);
+  // shrinking into the size classes moves the object to a slab
+  p = (unsigned char *)mm_realloc(p, 100, 8);
+  assert(p != NULL && slab_of(p) != NULL);
+  for (size_t i = 0; i < 100; ++i) {
+    assert(p[i] == (unsigned char)i);
+  }
+  mm_free(p);
+  printf("  Large realloc OK.\n");
+
+  // out of memory while moving: first no new mapping, then no page map node
+  // for it, which a mapping 64 MB away from the others needs. the object
+  // stays where it was.
+  p = (unsigned char *)mm_malloc(5000, 8);
+  assert(p != NULL);
+  memset(p, 0x77, 5000);
+  struct large_block *block = large_of(p);
+  size_t failed = 0;
+  for (int calls = 0; calls < 3; ++calls) {
+    bulk_alloc_countdown = calls;
+    unsigned char *q = (unsigned char *)mm_realloc(p, 64 << 20, 8);
+    bulk_alloc_countdown = -1;
+    if (q == NULL) {
+      failed++;
+      assert(large_of(p) == block && block->size >= 5000);
+      assert(p[0] == 0x77 && p[4999] == 0x77);
+      continue;
+    }
+    assert(q[0] == 0x77 && q[4999] == 0x77);
+    p = (unsigned char *)mm_realloc(q, 5000, 8);
+    assert(p != NULL);
+    block = large_of(p);
+  }
+  assert(failed == 2);
+  mm_free(p);
+  printf("  %zu failed moves kept the object.\n", failed);
+#else
+  printf("Skipping large object tests because NO_GLOBAL_SLAB_CACHE_ARRAY is "
+         "defined.\n");
+#endif
+  printf("Large object test PASSED.\n");
+}
+
+void test_mm_threads() {
+  printf("\n--- Test: MM Allocator with Thread Caches ---\n");
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  pthread_t threads[MT_THREADS];
+  for (size_t i = 0; i < MT_THREADS; ++i) {
+    int rc = pthread_create(&threads[i], NULL, mt_worker, (void *)i);
+    assert(rc == 0);
+  }
+  for (size_t i = 0; i < MT_THREADS; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  printf("  %d threads did %d malloc/free rounds each.\n", MT_THREADS,
+         MT_ROUNDS);
+
+  void **objs = (void **)malloc(sizeof(void *) * MT_ROUNDS);
+  assert(objs != NULL);
+  for (int i = 0; i < MT_ROUNDS; ++i) {
+    objs[i] = mm_malloc(8, 8);
+    assert(objs[i] != NULL);
+    strcpy((char *)objs[i], "message");
+  }
+  pthread_t consumer;
+  int rc = pthread_create(&consumer, NULL, mt_consumer, objs);
+  assert(rc == 0);
+  pthread_join(consumer, NULL);
+  free(objs);
+  printf("  %d objects freed by another thread.\n", MT_ROUNDS);
+  tcache_flush();
+#else
+  printf("Skipping thread cache tests because NO_GLOBAL_SLAB_CACHE_ARRAY is "
+         "defined.\n");
+#endif
+  printf("Thread cache test PASSED.\n");
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+#define FORK_ROUNDS 20
+
+static bool fork_stop;
+
+static void *fork_worker(void *arg) {
+  (void)arg;
+  while (!__atomic_load_n(&fork_stop, __ATOMIC_RELAXED)) {
+    void *p = mm_malloc(100, 8);
+    mm_free(p);
+  }
+  return NULL;
+}
+#endif
+
+void test_mm_fork() {
+  printf("\n--- Test: MM Allocator across fork ---\n");
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  pthread_atfork(mm_prefork, mm_postfork, mm_postfork);
+  pthread_t worker;
+  int rc = pthread_create(&worker, NULL, fork_worker, NULL);
+  assert(rc == 0);
+  // the worker holds cache locks at random times: the child must not inherit
+  // them locked
+  for (int i = 0; i < FORK_ROUNDS; ++i) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      for (int j = 0; j < 1000; ++j) {
+        void *p = mm_malloc(100, 8);
+        mm_free(p);
+      }
+      _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  __atomic_store_n(&fork_stop, true, __ATOMIC_RELAXED);
+  pthread_join(worker, NULL);
+  printf("  %d children allocated while another thread was busy.\n",
+         FORK_ROUNDS);
+#else
+  printf("Skipping fork tests because NO_GLOBAL_SLAB_CACHE_ARRAY is "
+         "defined.\n");
+#endif
+  printf("Fork test PASSED.\n");
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+// allocate until one allocation is sampled, freeing the others
+static char *guarded_malloc(size_t size, size_t alignment) {
+  for (int i = 0; i < 100000; ++i) {
+    char *p = (char *)mm_malloc(size, alignment);
+    assert(p != NULL);
+    if (guarded_of(p)) {
+      return p;
+    }
+    mm_free(p);
+  }
+  assert(!"no allocation was sampled");
+  return NULL;
+}
+
+enum guarded_bug {
+  GUARDED_OVERFLOW,
+  GUARDED_USE_AFTER_FREE,
+  GUARDED_DOUBLE_FREE,
+};
+
+// run bug in a child and return its status, with its report in out
+static int guarded_child(enum guarded_bug bug, char *out, size_t out_len) {
+  int fds[2];
+  int rc = pipe(fds);
+  assert(rc == 0);
+  fflush(stdout);
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    dup2(fds[1], STDERR_FILENO);
+    char *p = guarded_malloc(100, 1);
+    if (bug == GUARDED_OVERFLOW) {
+      p[100] = 'A';
+    } else if (bug == GUARDED_USE_AFTER_FREE) {
+      mm_free(p);
+      volatile char c = p[0];
+      (void)c;
+    } else {
+      mm_free(p);
+      mm_free(p);
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  size_t len = 0;
+  while (len + 1 < out_len) {
+    ssize_t n = read(fds[0], out + len, out_len - len - 1);
+    if (n <= 0) {
+      break;
+    }
+    len += n;
+  }
+  out[len] = '\0';
+  close(fds[0]);
+  int status;
+  pid_t waited = waitpid(pid, &status, 0);
+  assert(waited == pid);
+  return status;
+}
+#endif
+
+void test_mm_guarded() {
+  printf("\n--- Test: MM Guarded Sampling ---\n");
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  struct guarded_stats before, after;
+  guarded_get_stats(&before);
+  mm_set_guarded_sample_rate(1);
+
+  // 1. a sampled object ends against its guard page and has no canary
+  char *p = guarded_malloc(100, 1);
+  assert(slab_of(p) == NULL && large_of(p) == NULL);
+  assert(((uintptr_t)p + 100) % PAGE_SIZE == 0);
+  assert(mm_usable_size(p) == 100);
+  memset(p, 0x11, 100);
+  char *q = guarded_malloc(40, 64);
+  assert((uintptr_t)q % 64 == 0);
+  // realloc moves it out with its contents
+  p = (char *)mm_realloc(p, 200, 1);
+  assert(p != NULL && p[0] == 0x11 && p[99] == 0x11);
+  mm_free(p);
+  mm_free(q);
+  guarded_get_stats(&after);
+  assert(after.allocs >= before.allocs + 2);
+  assert(after.live == before.live);
+  printf("  Guarded objects: %zu allocated.\n", after.allocs - before.allocs);
+
+  // 2. bugs fault at once, with the stacks in the report
+  char report[4096];
+  int status = guarded_child(GUARDED_OVERFLOW, report, sizeof(report));
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  assert(strstr(report, "heap-buffer-overflow") != NULL);
+  assert(strstr(report, "0 bytes past the 100-byte object") != NULL);
+  assert(strstr(report, "allocated at:\n    #0 0x") != NULL);
+  status = guarded_child(GUARDED_USE_AFTER_FREE, report, sizeof(report));
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  assert(strstr(report, "use-after-free") != NULL);
+  assert(strstr(report, "freed at:\n    #0 0x") != NULL);
+  status = guarded_child(GUARDED_DOUBLE_FREE, report, sizeof(report));
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  assert(strstr(report, "double free") != NULL);
+  printf("  Overflow, use after free and double free reported.\n");
+
+  // 3. about one in rate allocations is sampled
+  mm_set_guarded_sample_rate(100);
+  guarded_get_stats(&before);
+  for (int i = 0; i < 100000; ++i) {
+    mm_free(mm_malloc(64, 8));
+  }
+  guarded_get_stats(&after);
+  size_t sampled = after.allocs - before.allocs;
+  printf("  %zu of 100000 allocations sampled at rate 100.\n", sampled);
+  assert(sampled > 500 && sampled < 2000);
+  mm_set_guarded_sample_rate(0);
+#else
+  printf("Skipping guarded tests because NO_GLOBAL_SLAB_CACHE_ARRAY is "
+         "defined.\n");
+#endif
+  printf("Guarded sampling test PASSED.\n");
+}
+
+void test_mm_arena() {
+  printf("\n--- Test: MM Arenas ---\n");
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  struct mm_arena arena;
+  mm_arena_init(&arena, 2 * PAGE_SIZE, false);
+  assert(arena.chunk_size == 2 * PAGE_SIZE && arena.mapped_bytes == 0);
+
+  // 1. bump allocation, aligned, spilling over into new chunks
+  char *first = (char *)mm_arena_alloc(&arena, 10, 1);
+  assert(first != NULL);
+  char *prev = first;
+  for (int i = 0; i < 1000; ++i) {
+    size_t alignment = (size_t)1 << (i % 7);
+    char *p = (char *)mm_arena_alloc(&arena, 24, alignment);
+    assert(p != NULL && (uintptr_t)p % alignment == 0);
+    assert(p != prev);
+    memset(p, i, 24);
+    prev = p;
+  }
+  size_t mapped = arena.mapped_bytes;
+  assert(mapped >= 24000 && mapped % (2 * PAGE_SIZE) == 0);
+  void *zero = mm_arena_alloc(&arena, 0, 1);
+  assert(zero != NULL && zero != mm_arena_alloc(&arena, 0, 1));
+  // alignments that are not a power of two fail, and leave the chunk usable
+  char *cur = arena.cur;
+  assert(mm_arena_alloc(&arena, 10, 0) == NULL);
+  assert(mm_arena_alloc(&arena, 10, 24) == NULL);
+  assert(arena.cur == cur && mm_arena_alloc(&arena, 10, 1) == cur);
+  printf("  1000 objects in %zu bytes of chunks.\n", mapped);
+
+  // 2. reset keeps the chunks: no new memory is mapped the next round
+  mm_arena_reset(&arena);
+  assert(arena.chunk == NULL && arena.spare != NULL);
+  assert(mm_arena_alloc(&arena, 10, 1) != NULL);
+  for (int i = 0; i < 1000; ++i) {
+    mm_arena_alloc(&arena, 24, 8);
+  }
+  assert(arena.mapped_bytes == mapped);
+  printf("  Reset reuses the chunks.\n");
+
+  // 3. nested savepoints free back to where they were taken
+  struct mm_arena_savepoint outer = mm_arena_save(&arena);
+  void *a = mm_arena_alloc(&arena, 100, 8);
+  struct mm_arena_savepoint inner = mm_arena_save(&arena);
+  for (int i = 0; i < 200; ++i) {
+    mm_arena_alloc(&arena, 100, 8);
+  }
+  mm_arena_restore(&arena, &inner);
+  void *b = mm_arena_alloc(&arena, 100, 8);
+  assert(b == (char *)a + 104 || (uintptr_t)b % (2 * PAGE_SIZE) < 64);
+  mm_arena_restore(&arena, &outer);
+  assert(mm_arena_alloc(&arena, 100, 8) == a);
+  assert(arena.mapped_bytes <= mapped + 8 * PAGE_SIZE);
+  printf("  Nested savepoints OK.\n");
+
+  // 4. an object larger than a chunk gets a chunk of its own
+  char *big = (char *)mm_arena_alloc(&arena, 5 * PAGE_SIZE, 64);
+  assert(big != NULL && (uintptr_t)big % 64 == 0);
+  memset(big, 0x5A, 5 * PAGE_SIZE);
+  assert(mm_arena_alloc(&arena, 8, 8) != NULL);
+  mm_arena_destroy(&arena);
+  assert(arena.mapped_bytes == 0 && arena.chunk == NULL);
+
+  // 5. with the fallback, large objects that do not fit the current chunk
+  // come from mm_malloc and are freed with the arena
+  size_t blocks_before, blocks, bytes;
+  large_get_stats(&blocks_before, &bytes);
+  mm_arena_init(&arena, 2 * PAGE_SIZE, true);
+  for (int i = 0; i < 7; ++i) {
+    void *small = mm_arena_alloc(&arena, 1000, 16);
+    assert(slab_of(small) == NULL && large_of(small) == NULL);
+  }
+  struct mm_arena_savepoint before_large = mm_arena_save(&arena);
+  void *mid = mm_arena_alloc(&arena, 3000, 16);
+  assert(slab_of(mid) != NULL && (uintptr_t)mid % 16 == 0);
+  void *huge = mm_arena_alloc(&arena, 1 << 20, 16);
+  assert(large_of(huge) != NULL);
+  memset(huge, 0x77, 1 << 20);
+  large_get_stats(&blocks, &bytes);
+  assert(blocks == blocks_before + 1);
+  mm_arena_restore(&arena, &before_large);
+  large_get_stats(&blocks, &bytes);
+  assert(blocks == blocks_before);
+  huge = mm_arena_alloc(&arena, 1 << 20, 16);
+  assert(large_of(huge) != NULL);
+  mm_arena_destroy(&arena);
+  large_get_stats(&blocks, &bytes);
+  assert(blocks == blocks_before);
+  printf("  Oversize fallback OK.\n");
+#else
+  printf("Skipping arena tests because NO_GLOBAL_SLAB_CACHE_ARRAY is "
+         "defined.\n");
+#endif
+  printf("Arena test PASSED.\n");
+}
+
+static int tracked_live;
+
+// counts its live instances; throws when asked to
+struct tracked {
+  long key;
+  char name[20];
+  std::unique_ptr<int> owned;
+  tracked(long k, const char *n, std::unique_ptr<int> o)
+      : key(k), owned(std::move(o)) {
+    if (k < 0) {
+      throw k;
+    }
+    strncpy(name, n, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    ++tracked_live;
+  }
+  ~tracked() { --tracked_live; }
+};
+
+struct alignas(64) line_sized {
+  char byte;
+};
+
+void test_object_cache() {
+  printf("\n--- Test: Typed Object Cache ---\n");
+  mm::object_cache<tracked> cache;
+  assert(cache.cache()->object_size == sizeof(tracked));
+  assert(cache.cache()->freelist_kind == SLAB_FREELIST_LINKED);
+  struct slab_cache_stats stats;
+
+  // 1. arguments are forwarded, moves included, and the destructor runs
+  tracked *t = cache.construct(7, "seven", std::unique_ptr<int>(new int(70)));
+  assert(t != NULL && slab_of(t) != NULL && slab_of(t)->cache == cache.cache());
+  assert(t->key == 7 && strcmp(t->name, "seven") == 0 && *t->owned == 70);
+  assert(tracked_live == 1);
+  cache.destroy(t);
+  assert(tracked_live == 0);
+  cache.destroy(NULL);
+
+  // 2. handles destroy their objects when they go away
+  {
+    mm::object_cache<tracked>::handle handles[100];
+    for (int i = 0; i < 100; ++i) {
+      handles[i] = cache.create(i, "h", std::unique_ptr<int>());
+      assert(handles[i] && handles[i]->key == i);
+    }
+    assert(tracked_live == 100);
+    handles[0].reset();
+    assert(tracked_live == 99);
+  }
+  assert(tracked_live == 0);
+  slab_cache_get_stats(cache.cache(), &stats);
+  assert(stats.objects_active == 0);
+
+  // 3. a throwing constructor gives the memory back
+  bool thrown = false;
+  try {
+    cache.construct(-1, "bad", std::unique_ptr<int>());
+  } catch (long) {
+    thrown = true;
+  }
+  assert(thrown && tracked_live == 0);
+  slab_cache_get_stats(cache.cache(), &stats);
+  assert(stats.objects_active == 0);
+
+  // 4. the alignment of the type is kept, and small types still work
+  mm::object_cache<line_sized> lines;
+  mm::object_cache<char> chars;
+  assert(chars.cache()->freelist_kind == SLAB_FREELIST_INDEX);
+  for (int i = 0; i < 200; ++i) {
+    line_sized *l = lines.construct();
+    assert(l != NULL && (uintptr_t)l % 64 == 0);
+    char *c = chars.construct((char)i);
+    assert(c != NULL && *c == (char)i);
+    lines.destroy(l);
+    chars.destroy(c);
+  }
+  printf("Typed object cache test PASSED.\n");
+}
+
+void test_mm_allocator() {
+  printf("\n--- Test: Standard Library Adapters ---\n");
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  struct mm_stats before, after;
+  mm_stats_get(&before);
+
+  // 1. sized frees: the size picks the thread cache
+  void *ptrs[4];
+  size_t sizes[4] = {1, 100, 3000, 100000};
+  for (int i = 0; i < 4; ++i) {
+    ptrs[i] = mm_malloc(sizes[i], 16);
+    memset(ptrs[i], 0x42, sizes[i]);
+  }
+  for (int i = 0; i < 4; ++i) {
+    mm_free_sized(ptrs[i], sizes[i], 16);
+  }
+  void *p = mm_malloc(200, 8);
+  p = mm_realloc(p, 190, 8);
+  mm_free_sized(p, 190, 8);
+#if MM_HARDENING == MM_HARDENING_FULL
+  // a wrong size, of the object's class or of another one, is corruption
+  const size_t wrong[] = {41, 3000};
+  for (int i = 0; i < 2; ++i) {
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      mm_free_sized(mm_malloc(40, 8), wrong[i], 8);
+      _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+  }
+#endif
+  mm_set_guarded_sample_rate(1);
+  p = guarded_malloc(64, 8);
+  mm_free_sized(p, 64, 8);
+  mm_set_guarded_sample_rate(0);
+  mm_free_sized(NULL, 8, 8);
+  mm_stats_get(&after);
+  assert(after.total.live_objects == before.total.live_objects);
+  assert(after.total.bytes_requested == before.total.bytes_requested);
+  printf("  Sized frees OK.\n");
+
+  // 2. node containers on mm::allocator
+  {
+    std::map<int, long, std::less<int>,
+             mm::allocator<std::pair<const int, long>>>
+        map;
+    std::list<int, mm::allocator<int>> list;
+    for (int i = 0; i < 10000; ++i) {
+      map[i] = i * 3L;
+      list.push_back(i);
+    }
+    struct slab *slab = slab_of(&map.find(5000)->second);
+    assert(slab != NULL);
+    assert(map.size() == 10000 && map[9999] == 29997L);
+    for (int i = 0; i < 10000; i += 2) {
+      map.erase(i);
+    }
+    assert(map.size() == 5000 && list.size() == 10000);
+    mm_stats_get(&after);
+    assert(after.total.live_objects == before.total.live_objects + 15000);
+  }
+  mm_stats_get(&after);
+  assert(after.total.live_objects == before.total.live_objects);
+
+  // 3. pmr containers on the resource
+  {
+    std::pmr::vector<std::pmr::string> strings(mm::resource());
+    for (int i = 0; i < 1000; ++i) {
+      strings.emplace_back(100, (char)('a' + i % 26));
+    }
+    assert(strings[999][99] == 'a' + 999 % 26);
+    assert(slab_of(strings[500].data()) != NULL);
+    assert(large_of(strings.data()) != NULL);
+    assert(mm::resource()->is_equal(*mm::resource()));
+    assert(!mm::resource()->is_equal(*std::pmr::new_delete_resource()));
+  }
+  mm_stats_get(&after);
+  assert(after.total.live_objects == before.total.live_objects);
+  printf("  Containers OK.\n");
+#else
+  printf("Skipping adapter tests because NO_GLOBAL_SLAB_CACHE_ARRAY is "
+         "defined.\n");
+#endif
+  printf("Standard library adapter test PASSED.\n");
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+// the call site the profile has to find
+__attribute__((noinline)) static void *profiled_alloc(size_t size) {
+  void *ptr = mm_malloc(size, 8);
+  // keep the call from being a tail call
+  __asm__ volatile("" ::: "memory");
+  return ptr;
+}
+
+// count the profile lines with a frame in profiled_alloc, and their objects
+static size_t profile_site_lines(const char *text, size_t *live,
+                                 size_t *allocs) {
+  uintptr_t site = (uintptr_t)profiled_alloc;
+  size_t lines = 0;
+  *live = *allocs = 0;
+  for (const char *line = text; *line; line = strchr(line, '\n') + 1) {
+    unsigned long live_num, live_bytes, alloc_num, alloc_bytes;
+    int used;
+    if (sscanf(line, "%lu: %lu [%lu: %lu] @%n", &live_num, &live_bytes,
+               &alloc_num, &alloc_bytes, &used) == 4 &&
+        strncmp(line, "heap", 4) != 0) {
+      for (const char *f = strstr(line + used, "0x");
+           f && f < strchr(line, '\n'); f = strstr(f + 2, "0x")) {
+        uintptr_t pc = strtoul(f, NULL, 16);
+        if (pc > site && pc < site + 256) {
+          lines++;
+          *live += live_num;
+          *allocs += alloc_num;
+          break;
+        }
+      }
+    }
+    if (strchr(line, '\n') == NULL) {
+      break;
+    }
+  }
+  return lines;
+}
+#endif
+
+void test_mm_profile() {
+  printf("\n--- Test: MM Heap Profiler ---\n");
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  struct profile_stats before, after;
+  profile_get_stats(&before);
+  mm_set_profile_rate(4096);
+  // let this thread draw its countdown from the new rate
+  for (int i = 0; i < 1000; ++i) {
+    mm_free(mm_malloc(8192, 8));
+  }
+  profile_get_stats(&before);
+
+  // 1. 1000-byte objects are sampled with probability 1 - exp(-1000/4096)
+  const size_t num = 20000;
+  void **ptrs = (void **)malloc(sizeof(void *) * num);
+  for (size_t i = 0; i < num; ++i) {
+    ptrs[i] = profiled_alloc(1000);
+  }
+  profile_get_stats(&after);
+  size_t sampled = after.samples - before.samples;
+  printf("  %zu of %zu objects sampled, %zu expected.\n", sampled, num,
+         (size_t)(num * 0.2166));
+  assert(sampled > 3900 && sampled < 4800);
+  assert(after.live >= before.live + sampled - 1 && after.dropped == 0);
+  size_t slabs_sampled = 0;
+  for (size_t i = 1; i < num; ++i) {
+    slabs_sampled += slab_of(ptrs[i])->sampled != 0;
+  }
+  assert(slabs_sampled > 0);
+  // a moved large object keeps its sample
+  ptrs[0] = mm_realloc(ptrs[0], 200000, 8);
+  ptrs[0] = mm_realloc(ptrs[0], 400000, 8);
+
+  // 2. the dump attributes them to their call site
+  static struct dump_buffer dump;
+  dump.len = 0;
+  mm_profile_dump(dump_write, &dump);
+  assert(strncmp(dump.text, "heap profile: ", 14) == 0);
+  assert(strstr(dump.text, "@ heap_v2/4096\n") != NULL);
+  assert(strstr(dump.text, "\nMAPPED_LIBRARIES:\n") != NULL);
+  size_t live, allocs;
+  size_t lines = profile_site_lines(dump.text, &live, &allocs);
+  printf("  %zu call site lines, %zu live samples.\n", lines, live);
+  assert(lines >= 1 && live >= sampled - 1 && allocs == sampled);
+
+  // 3. freeing forgets the samples but keeps the cumulative counts
+  for (size_t i = 0; i < num; ++i) {
+    mm_free(ptrs[i]);
+  }
+  free(ptrs);
+  profile_get_stats(&after);
+  assert(after.live == before.live);
+  dump.len = 0;
+  mm_profile_dump(dump_write, &dump);
+  lines = profile_site_lines(dump.text, &live, &allocs);
+  assert(live == 0 && allocs == sampled);
+  mm_set_profile_rate(0);
+  for (int i = 0; i < 1000; ++i) {
+    mm_free(mm_malloc(8192, 8));
+  }
+#else
+  printf("Skipping profiler tests because NO_GLOBAL_SLAB_CACHE_ARRAY is "
+         "defined.\n");
+#endif
+  printf("Heap profiler test PASSED.\n");
+}
+
+struct walk_check {
+  void **objs;
+  bool *live;
+  size_t num;
+  size_t slabs;
+  size_t slabs_live;
+  size_t found;
+  struct slab *last_slab;
+  void *last_obj;
+};
+
+static void check_walk_slab(void *arg, struct slab *slab) {
+  struct walk_check *check = (struct walk_check *)arg;
+  check->slabs++;
+  check->slabs_live += (size_t)slab->active;
+}
+
+static void check_walk_object(void *arg, struct slab *slab, void *obj) {
+  struct walk_check *check = (struct walk_check *)arg;
+  // objects come in address order, slab by slab
+  assert(slab != check->last_slab || obj > check->last_obj);
+  assert(slab_of(obj) == slab);
+  check->last_slab = slab;
+  check->last_obj = obj;
+  for (size_t i = 0; i < check->num; ++i) {
+    if (check->objs[i] == obj) {
+      assert(check->live[i]);
+      // reported once
+      check->live[i] = false;
+      check->found++;
+      return;
+    }
+  }
+  assert(!"walk reported an object that was not allocated");
+}
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+struct heap_check {
+  size_t cls;
+  size_t slabs_live;
+  size_t objects;
+  size_t ours;
+  size_t requested;
+  void **objs;
+  size_t num;
+};
+
+static void heap_check_slab(void *arg, const struct mm_heap_slab *slab) {
+  struct heap_check *check = (struct heap_check *)arg;
+  assert(slab->start == (void *)slab->slab && slab->size > 0);
+  assert(slab->objects_live <= slab->objects_num);
+  if (slab->cache_index == check->cls) {
+    check->slabs_live += slab->objects_live;
+  }
+}
+
+static void heap_check_object(void *arg, const struct mm_heap_slab *slab,
+                              void *ptr, size_t size) {
+  struct heap_check *check = (struct heap_check *)arg;
+  assert((char *)ptr >= (char *)slab->start &&
+         (char *)ptr < (char *)slab->start + slab->size);
+  if (slab->cache_index != check->cls) {
+    return;
+  }
+  check->objects++;
+  for (size_t i = 0; i < check->num; ++i) {
+    if (check->objs[i] == ptr) {
+      check->ours++;
+      check->requested += size;
+      return;
+    }
+  }
+}
+
+static void check_frag_sums(const struct mm_frag_class *c) {
+  assert(c->bytes_reserved == c->bytes_requested + c->bytes_padding +
+                                  c->bytes_hardening + c->bytes_free +
+                                  c->bytes_slab_overhead);
+  assert(c->bytes_hardening == c->objects_live * MM_HARDENING_OVERHEAD);
+  size_t in_use = 0;
+  for (int i = 0; i < MM_FRAG_BUCKETS; ++i) {
+    in_use += c->occupancy[i];
+  }
+  assert(in_use + c->slabs_empty == c->slabs);
+  assert(c->bytes_reclaimable >= c->slabs_empty * c->slab_size);
+}
+#endif
+
+void test_mm_heap_walk() {
+  printf("\n--- Test: Heap Walk and Fragmentation ---\n");
+  // 1. every freelist kind reports exactly the objects in use
+  const enum slab_freelist_kind kinds[] = {
+      SLAB_FREELIST_INDEX, SLAB_FREELIST_LINKED, SLAB_FREELIST_BITMAP};
+  for (size_t k = 0; k < 3; ++k) {
+    struct slab_cache cache;
+    slab_cache_init(&cache, 48, 16, NULL, NULL);
+    assert(slab_cache_set_freelist(&cache, kinds[k]) == 0);
+    size_t per_slab = cache.objects_num_per_slab;
+    size_t num = per_slab * 3;
+    void **objs = (void **)malloc(sizeof(void *) * num);
+    bool *live = (bool *)malloc(sizeof(bool) * num);
+    assert(objs != NULL && live != NULL);
+    for (size_t i = 0; i < num; ++i) {
+      objs[i] = slab_cache_alloc(&cache);
+      assert(objs[i] != NULL);
+    }
+    // free every third object of the first slabs, and all of the last one
+    size_t live_num = 0;
+    for (size_t i = 0; i < num; ++i) {
+      live[i] = i < per_slab * 2 && i % 3 != 0;
+      if (live[i]) {
+        live_num++;
+      } else {
+        slab_free_to(slab_of(objs[i]), objs[i]);
+      }
+    }
+    // a freed object is handed out again, and is in use once more
+    objs[0] = slab_cache_alloc(&cache);
+    live[0] = true;
+    live_num++;
+    struct walk_check check;
+    memset(&check, 0, sizeof(check));
+    check.objs = objs;
+    check.live = live;
+    check.num = num;
+    assert(slab_cache_walk(&cache, check_walk_slab, check_walk_object,
+                           &check) == 0);
+    assert(check.slabs == 3 && check.slabs_live == live_num);
+    assert(check.found == live_num);
+    for (size_t i = 0; i < num; ++i) {
+      assert(!live[i]);
+    }
+    // slabs only
+    memset(&check, 0, sizeof(check));
+    assert(slab_cache_walk(&cache, check_walk_slab, NULL, &check) == 0);
+    assert(check.slabs == 3 && check.slabs_live == live_num);
+    for (size_t i = 0; i < num; ++i) {
+      if (i < per_slab * 2 && (i % 3 != 0 || i == 0)) {
+        slab_free_to(slab_of(objs[i]), objs[i]);
+      }
+    }
+    slab_cache_shrink(&cache);
+    free(objs);
+    free(live);
+  }
+  printf("  slab walk: index, linked and bitmap freelists agree.\n");
+
+#ifndef NO_GLOBAL_SLAB_CACHE_ARRAY
+  // 2. the heap walk sees the objects of mm_malloc with their request
+  const size_t size = 700;
+  const size_t num = 600;
+  size_t cls = size_class_of(size + MM_HARDENING_OVERHEAD, 8);
+  void **objs = (void **)malloc(sizeof(void *) * num);
+  assert(objs != NULL);
+  for (size_t i = 0; i < num; ++i) {
+    objs[i] = mm_malloc(size, 8);
+    assert(objs[i] != NULL);
+  }
+  struct heap_check check;
+  memset(&check, 0, sizeof(check));
+  check.cls = cls;
+  check.objs = objs;
+  check.num = num;
+  assert(mm_heap_walk(heap_check_slab, heap_check_object, &check) == 0);
+  assert(check.ours == num);
+  assert(check.objects == check.slabs_live);
+  size_t expected = MM_HARDENING == MM_HARDENING_OFF
+                        ? size_classes.sizes[cls]
+                        : size;
+  assert(check.requested == num * expected);
+
+  // 3. keeping one object in ten leaves sparse slabs to reclaim
+  static struct mm_frag_report before, after;
+  assert(mm_frag_get(&before) == 0);
+  for (size_t i = 0; i < num; ++i) {
+    if (i % 10 != 0) {
+      mm_free(objs[i]);
+    }
+  }
+  assert(mm_frag_get(&after) == 0);
+  assert(after.classes_num == SIZE_CLASSES_NUM);
+  const struct mm_frag_class *c = &after.classes[cls];
+  assert(c->object_size == size_classes.sizes[cls]);
+  assert(c->objects_live + num - num / 10 == before.classes[cls].objects_live);
+  assert(c->bytes_reclaimable > before.classes[cls].bytes_reclaimable);
+  // the slabs still in use are at most half full
+  size_t sparse = 0;
+  for (int i = 0; i < MM_FRAG_BUCKETS / 2; ++i) {
+    sparse += c->occupancy[i];
+  }
+  assert(sparse > 0 && sparse + c->slabs_empty == c->slabs);
+  if (MM_HARDENING != MM_HARDENING_OFF) {
+    assert(c->bytes_padding ==
+           before.classes[cls].bytes_padding -
+               (num - num / 10) *
+                   (size_classes.sizes[cls] - size - MM_HARDENING_OVERHEAD));
+  }
+  for (size_t i = 0; i < after.classes_num; ++i) {
+    check_frag_sums(&after.classes[i]);
+  }
+  check_frag_sums(&after.total);
+  printf("  %zu B class: %zu slabs, %zu live objects, %zu bytes reclaimable\n",
+         c->object_size, c->slabs, c->objects_live, c->bytes_reclaimable);
+
+  // 4. dumps
+  static struct dump_buffer dump;
+  dump.len = 0;
+  assert(mm_frag_dump(MM_STATS_TEXT, dump_write, &dump) == 0);
+  assert(strstr(dump.text, "reclaimable") != NULL);
+  assert(strstr(dump.text, "occupancy") != NULL);
+  printf("%s", dump.text);
+  dump.len = 0;
+  assert(mm_frag_dump(MM_STATS_JSON, dump_write, &dump) == 0);
+  assert(dump.text[0] == '{' && strstr(dump.text, "\"total\":{") != NULL);
+  assert(strstr(dump.text, "\"occupancy\":[") != NULL);
+  printf("  JSON dump: %zu bytes.\n", dump.len);
+
+  for (size_t i = 0; i < num; i += 10) {
+    mm_free(objs[i]);
+  }
+  free(objs);
+#else
+  printf("Skipping heap walk tests of mm because NO_GLOBAL_SLAB_CACHE_ARRAY "
+         "is defined.\n");
+#endif
+  printf("Heap walk test PASSED.\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "preload") == 0) {
+    return preload_huge_sizes() || preload_memalign();
+  }
   printf("--- Starting Slab Allocator Tests ---\n");
 
   test_basic_alloc_free();
   test_alignment();
   test_slab_lifecycle();
   test_multiple_caches();
+  test_slab_lookup();
+  test_slab_shards();
+  test_remote_free();
+  test_slab_bulk();
+  test_slab_reclaim();
+  test_slab_coloring();
+  test_slab_orders();
+  test_slab_freelists();
+  test_slab_regions();
+  test_memops();
+  test_size_classes();
   test_mm_canary();
+  test_mm_large();
+  test_mm_calloc();
+  test_mm_huge_sizes();
+  test_preload();
+  test_mm_stats();
+  test_mm_threads();
+  test_mm_fork();
+  test_mm_guarded();
+  test_mm_arena();
+  test_object_cache();
+  test_mm_allocator();
+  test_mm_profile();
+  test_mm_heap_walk();
 
   printf("\n--- All tests completed successfully! ---\n");
 